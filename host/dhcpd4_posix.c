@@ -0,0 +1,304 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcpmem.h"
+#include "logging.h"
+#include "stats.h"
+#include "events.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * POSIX UDP front end of the engine, serving a single pool from
+ * a host, to profile the engine (perf, valgrind) and run benchmarks.
+ *
+ * The replies are sent as by the Zephyr server (RFC 2131 4.1), except
+ * that the replies to a client without an address are broadcast: the
+ * ARP cache of the host is not seeded. With -r, each reply is sent back
+ * to the source of its request instead, for the load generators
+ * running on the same host.
+ */
+
+#define DHCPD4_BROADCAST_FLAG 0x8000
+
+#define USAGE_TXT							\
+    "usage: dhcpd4 [-a first,last] [-l time] [-o opt,value] [-p port]\n"	\
+    "              [-q] [-r] [-v] server_address/length\n"		\
+    "  -a: pool of the addresses to allocate (default: the addresses\n"	\
+    "      of the subnet after the server address)\n"			\
+    "  -l: lease time (in seconds)\n"					\
+    "  -o: DHCP option of the pool\n"					\
+    "  -p: server port (default 67), the client port being the next one\n" \
+    "  -q: log the errors only, not the lease events\n"		\
+    "  -r: send the replies to the source of the requests\n"		\
+    "  -v: log the debug messages\n"
+
+static volatile sig_atomic_t dhcpd4_stopped;
+
+static void dhcpd4_stop_signal(int sig)
+{
+    ARG_UNUSED(sig);
+
+    dhcpd4_stopped = 1;
+}
+
+static void dhcpd4_print_lease_event(const dhcpd4_lease_event *event, void *arg)
+{
+    char text[80];
+
+    ARG_UNUSED(arg);
+
+    dhcpd4_lease_event_format(event, text, sizeof(text));
+    LOG_INF("%s (xid 0x%08x)", text, event->xid);
+}
+
+/*
+ * Parse the arguments into the pool.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_parse_args(int argc, char *argv[], address_pool *pool, uint16_t *port, bool *reply_to_source)
+{
+    char *first = NULL, *last, *length;
+    int c;
+
+    while ((c = getopt(argc, argv, "a:l:o:p:qrv")) != -1)
+	switch (c) {
+
+	case 'a':
+	    first = optarg;
+	    break;
+
+	case 'l':
+	    pool->lease_time = atoi(optarg);
+	    break;
+
+	case 'o': {
+	    char *value = strchr(optarg, ',');
+
+	    if (value == NULL)
+		return -1;
+
+	    *value++ = '\0';
+
+	    if (dhcpd4_parse_and_add_option(pool, optarg, value) != 0)
+		return -1;
+	    break;
+	}
+
+	case 'p':
+	    *port = atoi(optarg);
+	    break;
+
+	case 'q':
+	    dhcpd4_log_level = LOG_LEVEL_ERR;
+	    break;
+
+	case 'r':
+	    *reply_to_source = true;
+	    break;
+
+	case 'v':
+	    dhcpd4_log_level = LOG_LEVEL_DBG;
+	    break;
+
+	default:
+	    return -1;
+	}
+
+    if (optind != argc - 1 || (length = strchr(argv[optind], '/')) == NULL)
+	return -1;
+
+    *length++ = '\0';
+
+    if (inet_pton(AF_INET, argv[optind], &pool->server_id) != 1 || atoi(length) < 1 || atoi(length) > 30)
+	return -1;
+
+    pool->netmask = htonl(0xffffffffu << (32 - atoi(length)));
+
+    if (first != NULL) {
+	if ((last = strchr(first, ',')) == NULL)
+	    return -1;
+
+	*last++ = '\0';
+
+	if (inet_pton(AF_INET, first, &pool->indexes.first) != 1 ||
+	    inet_pton(AF_INET, last, &pool->indexes.last) != 1)
+	    return -1;
+    } else {
+	uint32_t broadcast = ntohl(pool->server_id | ~pool->netmask);
+
+	pool->indexes.first = htonl(ntohl(pool->server_id) + 1);
+	pool->indexes.last = htonl(broadcast - 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Select the destination of a reply, as dhcpd4_reply_destination()
+ * of the Zephyr server, or the source of the request.
+ */
+
+static void dhcpd4_reply_destination(dhcpd_msg *msg, uint8_t type, uint16_t port,
+				     struct sockaddr_in *dst, bool reply_to_source)
+{
+    if (reply_to_source)
+	return; // dst is the source of the request
+
+    dst->sin_port = htons(port + 1);
+
+    if (msg->hdr.giaddr != 0) {
+	if (type == DHCP_NAK)
+	    msg->hdr.flags |= htons(DHCPD4_BROADCAST_FLAG);
+
+	dst->sin_addr.s_addr = msg->hdr.giaddr;
+	dst->sin_port = htons(port);
+    } else if (type != DHCP_NAK && msg->hdr.ciaddr != 0) {
+	dst->sin_addr.s_addr = msg->hdr.ciaddr;
+    } else {
+	dst->sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    }
+}
+
+/*
+ * Serve the requests until SIGINT or SIGTERM: after every wakeup,
+ * the queued requests, then the bindings timers.
+ */
+
+static void dhcpd4_serve(int s, uint32_t server_id, uint16_t port, bool reply_to_source)
+{
+    struct pollfd fds = { .fd = s, .events = POLLIN };
+    uint32_t lost;
+
+    while (!dhcpd4_stopped) {
+	int timeout = dhcpd4_run_shard_timers(dhcpd4_shards, dhcpd4_pool_count);
+
+	if (poll(&fds, 1, timeout) <= 0)
+	    continue;
+
+	while (true) {
+	    dhcpd_msg msg;
+	    struct sockaddr_in client_sock;
+	    socklen_t socklen = sizeof(client_sock);
+	    uint32_t start = k_cycle_get_32();
+	    ssize_t len;
+	    uint8_t type;
+
+	    len = recvfrom(s, &msg.hdr, sizeof(msg.hdr), MSG_DONTWAIT,
+			   (struct sockaddr *)&client_sock, &socklen);
+
+	    if (len < 0)
+		break; // no more requests queued
+
+	    msg.tmpl = NULL;
+	    msg.server_id = server_id;
+
+	    if ((type = dhcpd4_serve_message(dhcpd4_shards, &msg, len, &client_sock)) == 0)
+		continue;
+
+	    dhcpd4_reply_destination(&msg, type, port, &client_sock, reply_to_source);
+
+	    if (sendto(s, &msg.hdr, DHCP_HEADER_SIZE + msg.opts_len, 0,
+		       (struct sockaddr *)&client_sock, sizeof(client_sock)) < 0) {
+		LOG_ERR("Reply not sent: %s", strerror(errno));
+		continue;
+	    }
+
+	    dhcpd4_count(type == DHCP_OFFER ? DHCPD4_STAT_TX_OFFER :
+			 type == DHCP_NAK ? DHCPD4_STAT_TX_NAK : DHCPD4_STAT_TX_ACK);
+	    dhcpd4_count_latency(start);
+	}
+
+	if (dhcpd4_log_level >= LOG_LEVEL_INF &&
+	    (dhcpd4_lease_events_drain(dhcpd4_print_lease_event, NULL, &lost), lost != 0))
+	    LOG_WRN("%u lease events lost (ring full)", lost);
+    }
+}
+
+static void dhcpd4_print_stats(void)
+{
+    struct dhcpd4_stats stats;
+    int i;
+
+    dhcpd4_get_stats(&stats, false);
+
+    for (i = 0; i < DHCPD4_STATS; i++) {
+	if (stats.counters[i] != 0)
+	    fprintf(stderr, "%s: %u\n", dhcpd4_stat_name(i), stats.counters[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    address_pool *pool = dhcpd4_get_pool();
+    struct sockaddr_in server_sock;
+    bool reply_to_source = false;
+    uint16_t port = 67;
+    int s, on = 1;
+
+    memset(pool, 0, sizeof(*pool));
+    dhcpd4_init_binding_list(&pool->bindings);
+    dhcpd4_init_option_list(&pool->options);
+    pool->device_index = 1;
+
+    if (dhcpd4_parse_args(argc, argv, pool, &port, &reply_to_source) != 0) {
+	fputs(USAGE_TXT, stderr);
+	return 1;
+    }
+
+    if (dhcpd4_search_option(&pool->options, SUBNET_MASK) == NULL)
+	dhcpd4_parse_and_add_option(pool, "SUBNET_MASK", inet_ntoa((struct in_addr){ pool->netmask }));
+
+    if (dhcpd4_init_pools(pool) != 0 || dhcpd4_init_shards() != 0) {
+	LOG_ERR("dhcpd not started. Invalid address pool");
+	return 1;
+    }
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1 ||
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	setsockopt(s, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1) {
+	LOG_ERR("server: socket() error %s", strerror(errno));
+	return 1;
+    }
+
+    server_sock.sin_family = AF_INET;
+    server_sock.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_sock.sin_port = htons(port);
+
+    if (bind(s, (struct sockaddr *)&server_sock, sizeof(server_sock)) == -1) {
+	LOG_ERR("server: bind() %s", strerror(errno));
+	close(s);
+	return 1;
+    }
+
+    signal(SIGINT, dhcpd4_stop_signal);
+    signal(SIGTERM, dhcpd4_stop_signal);
+
+    LOG_INF("dhcpd4 server: listening on %u, pool %s-%s", port, str_ip(pool->indexes.first),
+	    str_ip(pool->indexes.last));
+
+    dhcpd4_serve(s, pool->server_id, port, reply_to_source);
+
+    close(s);
+    dhcpd4_print_stats();
+    dhcpd4_delete_pools();
+
+    return 0;
+}
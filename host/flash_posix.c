@@ -0,0 +1,501 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Simulated flash of the host, and the flash circular buffer of the
+ * lease journal over it (see platform.h).
+ *
+ * As a NOR flash (and the flash simulator of native_sim), a byte is
+ * written once after an erase, and a write must be aligned on the
+ * write block size.
+ */
+
+#define DHCPD4_HOST_FLASH_ERASED 0xff
+
+static uint8_t *dhcpd4_host_flash;
+static uint32_t dhcpd4_host_flash_sector_size;
+static uint32_t dhcpd4_host_flash_sectors;
+static uint32_t dhcpd4_host_flash_align;
+static struct flash_area dhcpd4_host_flash_area;
+
+int dhcpd4_host_flash_writes = -1; // writes and erases before a power loss, -1 for no limit
+
+/*
+ * Set up the partition, erased: sectors of sector_size bytes,
+ * written by blocks of align bytes.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+int dhcpd4_host_flash_setup(uint32_t sector_size, uint32_t sectors, uint32_t align)
+{
+    size_t size = (size_t)sector_size * sectors;
+
+    free(dhcpd4_host_flash);
+
+    if ((dhcpd4_host_flash = malloc(size)) == NULL)
+	return -1;
+
+    memset(dhcpd4_host_flash, DHCPD4_HOST_FLASH_ERASED, size);
+
+    dhcpd4_host_flash_sector_size = sector_size;
+    dhcpd4_host_flash_sectors = sectors;
+    dhcpd4_host_flash_align = align;
+    dhcpd4_host_flash_area.fa_size = size;
+    dhcpd4_host_flash_writes = -1;
+
+    return 0;
+}
+
+/*
+ * Check the power before a write or an erase.
+ *
+ * Return 0 if the flash may be changed, -EIO after a power loss.
+ */
+
+static int dhcpd4_host_flash_power(void)
+{
+    if (dhcpd4_host_flash_writes == 0)
+	return -EIO;
+
+    if (dhcpd4_host_flash_writes > 0)
+	dhcpd4_host_flash_writes--;
+
+    return 0;
+}
+
+int flash_area_open(uint8_t id, const struct flash_area **fa)
+{
+    if (id != 0 || dhcpd4_host_flash == NULL)
+	return -ENOENT;
+
+    *fa = &dhcpd4_host_flash_area;
+
+    return 0;
+}
+
+void flash_area_close(const struct flash_area *fa)
+{
+    ARG_UNUSED(fa);
+}
+
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst, size_t len)
+{
+    if (off < 0 || (size_t)off + len > fa->fa_size)
+	return -EINVAL;
+
+    memcpy(dst, dhcpd4_host_flash + off, len);
+
+    return 0;
+}
+
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src, size_t len)
+{
+    size_t i;
+
+    if (off < 0 || (size_t)off + len > fa->fa_size ||
+	off % dhcpd4_host_flash_align != 0 || len % dhcpd4_host_flash_align != 0)
+	return -EINVAL;
+
+    for (i = 0; i < len; i++) {
+	if (dhcpd4_host_flash[off + i] != DHCPD4_HOST_FLASH_ERASED)
+	    return -EIO; // not erased
+    }
+
+    if (dhcpd4_host_flash_power() != 0)
+	return -EIO;
+
+    memcpy(dhcpd4_host_flash + off, src, len);
+
+    return 0;
+}
+
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len)
+{
+    if (off < 0 || (size_t)off + len > fa->fa_size ||
+	off % dhcpd4_host_flash_sector_size != 0 || len % dhcpd4_host_flash_sector_size != 0)
+	return -EINVAL;
+
+    if (dhcpd4_host_flash_power() != 0)
+	return -EIO;
+
+    memset(dhcpd4_host_flash + off, DHCPD4_HOST_FLASH_ERASED, len);
+
+    return 0;
+}
+
+uint32_t flash_area_align(const struct flash_area *fa)
+{
+    ARG_UNUSED(fa);
+
+    return dhcpd4_host_flash_align;
+}
+
+/*
+ * Get the sectors of the partition, up to *count.
+ *
+ * Return 0 on success, -ENOMEM if the partition has more sectors.
+ */
+
+int flash_area_get_sectors(int fa_id, uint32_t *count, struct flash_sector *sectors)
+{
+    uint32_t i;
+
+    if (fa_id != 0 || dhcpd4_host_flash == NULL)
+	return -ENOENT;
+
+    for (i = 0; i < *count && i < dhcpd4_host_flash_sectors; i++) {
+	sectors[i].fs_off = (off_t)i * dhcpd4_host_flash_sector_size;
+	sectors[i].fs_size = dhcpd4_host_flash_sector_size;
+    }
+
+    *count = i;
+
+    return i < dhcpd4_host_flash_sectors ? -ENOMEM : 0;
+}
+
+/*
+ * Flash circular buffer: each sector in use starts with a header
+ * holding its id, one more than the previous sector; an entry is
+ * its length (one or two bytes), its data and their CRC, each
+ * padded to the write alignment.
+ */
+
+struct fcb_disk_area {
+    uint32_t fd_magic;
+    uint8_t fd_ver;
+    uint8_t _pad;
+    uint16_t fd_id;
+};
+
+#define FCB_ID_GT(a, b) ((int16_t)((a) - (b)) > 0)
+
+static uint32_t fcb_len_in_flash(struct fcb *fcb, uint32_t len)
+{
+    return ROUND_UP(len, fcb->f_align);
+}
+
+static uint32_t fcb_start_offset(struct fcb *fcb)
+{
+    return fcb_len_in_flash(fcb, sizeof(struct fcb_disk_area));
+}
+
+static uint8_t fcb_crc8(uint8_t crc, const uint8_t *data, size_t len)
+{
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+	crc ^= data[i];
+
+	for (bit = 0; bit < 8; bit++)
+	    crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+static struct flash_sector *fcb_getnext_sector(struct fcb *fcb, struct flash_sector *sector)
+{
+    sector++;
+
+    return sector < &fcb->f_sectors[fcb->f_sector_cnt] ? sector : fcb->f_sectors;
+}
+
+/*
+ * Write at an offset of a sector, padded to the write alignment.
+ */
+
+static int fcb_flash_write(struct fcb *fcb, struct flash_sector *sector, uint32_t off,
+			   const void *data, uint32_t len)
+{
+    uint8_t buf[64];
+    uint32_t size = fcb_len_in_flash(fcb, len);
+
+    if (size > sizeof(buf))
+	return -EINVAL;
+
+    memset(buf, DHCPD4_HOST_FLASH_ERASED, size);
+    memcpy(buf, data, len);
+
+    return flash_area_write(fcb->fap, sector->fs_off + off, buf, size);
+}
+
+/*
+ * Read the header of a sector.
+ *
+ * Return 1 if the sector is in use, 0 if erased, -ENOMSG if unknown.
+ */
+
+static int fcb_sector_hdr_read(struct fcb *fcb, struct flash_sector *sector, struct fcb_disk_area *fda)
+{
+    if (flash_area_read(fcb->fap, sector->fs_off, fda, sizeof(*fda)) != 0)
+	return -EIO;
+
+    if (fda->fd_magic == 0xffffffff)
+	return 0;
+
+    if (fda->fd_magic != fcb->f_magic || fda->fd_ver != fcb->f_version)
+	return -ENOMSG;
+
+    return 1;
+}
+
+static int fcb_sector_hdr_init(struct fcb *fcb, struct flash_sector *sector, uint16_t id)
+{
+    struct fcb_disk_area fda = { .fd_magic = fcb->f_magic, .fd_ver = fcb->f_version, ._pad = 0xff, .fd_id = id };
+
+    return fcb_flash_write(fcb, sector, 0, &fda, sizeof(fda)) == 0 ? 0 : -EIO;
+}
+
+/*
+ * Read the entry at loc->fe_elem_off of its sector.
+ *
+ * Return 0 if valid, -EBADMSG if its CRC does not match, -ENOTSUP
+ * if there is no entry (erased, or end of the sector).
+ */
+
+static int fcb_elem_info(struct fcb *fcb, struct fcb_entry *loc)
+{
+    uint8_t buf[2], data[UINT8_MAX], crc;
+    uint32_t cnt;
+    uint16_t len;
+
+    if (loc->fe_elem_off + 2 > loc->fe_sector->fs_size ||
+	flash_area_read(fcb->fap, loc->fe_sector->fs_off + loc->fe_elem_off, buf, sizeof(buf)) != 0)
+	return -ENOTSUP;
+
+    if (buf[0] == 0xff && buf[1] == 0xff)
+	return -ENOTSUP;
+
+    if (buf[0] & 0x80) {
+	len = (buf[0] & 0x7f) | (uint16_t)(buf[1] << 7);
+	cnt = 2;
+    } else {
+	len = buf[0];
+	cnt = 1;
+    }
+
+    loc->fe_data_off = loc->fe_elem_off + fcb_len_in_flash(fcb, cnt);
+    loc->fe_data_len = len;
+
+    if (len > sizeof(data) ||
+	loc->fe_data_off + fcb_len_in_flash(fcb, len) + fcb_len_in_flash(fcb, 1) > loc->fe_sector->fs_size)
+	return -ENOTSUP;
+
+    if (flash_area_read(fcb->fap, FCB_ENTRY_FA_DATA_OFF(*loc), data, len) != 0 ||
+	flash_area_read(fcb->fap, FCB_ENTRY_FA_DATA_OFF(*loc) + fcb_len_in_flash(fcb, len), &crc, 1) != 0)
+	return -EIO;
+
+    return fcb_crc8(fcb_crc8(0xff, buf, cnt), data, len) == crc ? 0 : -EBADMSG;
+}
+
+/*
+ * Move loc to the next entry of its sector: the first one if
+ * loc->fe_elem_off is 0.
+ *
+ * Return as fcb_elem_info().
+ */
+
+static int fcb_getnext_in_sector(struct fcb *fcb, struct fcb_entry *loc)
+{
+    if (loc->fe_elem_off == 0)
+	loc->fe_elem_off = fcb_start_offset(fcb);
+    else
+	loc->fe_elem_off = loc->fe_data_off + fcb_len_in_flash(fcb, loc->fe_data_len) + fcb_len_in_flash(fcb, 1);
+
+    return fcb_elem_info(fcb, loc);
+}
+
+int fcb_init(int f_area_id, struct fcb *fcb)
+{
+    struct flash_sector *oldest_sector = NULL, *newest_sector = NULL;
+    struct fcb_disk_area fda;
+    uint16_t oldest = 0, newest = 0;
+    int i, rc;
+
+    if (fcb->f_sector_cnt - fcb->f_scratch_cnt < 1 || flash_area_open(f_area_id, &fcb->fap) != 0)
+	return -EINVAL;
+
+    fcb->f_align = flash_area_align(fcb->fap);
+
+    for (i = 0; i < fcb->f_sector_cnt; i++) {
+	rc = fcb_sector_hdr_read(fcb, &fcb->f_sectors[i], &fda);
+
+	if (rc < 0)
+	    return rc;
+
+	if (rc == 0)
+	    continue;
+
+	if (oldest_sector == NULL) {
+	    oldest = newest = fda.fd_id;
+	    oldest_sector = newest_sector = &fcb->f_sectors[i];
+	} else if (FCB_ID_GT(fda.fd_id, newest)) {
+	    newest = fda.fd_id;
+	    newest_sector = &fcb->f_sectors[i];
+	} else if (FCB_ID_GT(oldest, fda.fd_id)) {
+	    oldest = fda.fd_id;
+	    oldest_sector = &fcb->f_sectors[i];
+	}
+    }
+
+    if (oldest_sector == NULL) { // no sector in use
+	if (fcb_sector_hdr_init(fcb, &fcb->f_sectors[0], 0) != 0)
+	    return -EIO;
+
+	oldest_sector = newest_sector = &fcb->f_sectors[0];
+    }
+
+    fcb->f_oldest = oldest_sector;
+    fcb->f_active.fe_sector = newest_sector;
+    fcb->f_active.fe_elem_off = fcb_start_offset(fcb);
+    fcb->f_active_id = newest;
+
+    // the end of the last entry of the active sector
+
+    for (;;) {
+	struct fcb_entry loc = fcb->f_active;
+
+	loc.fe_elem_off = fcb->f_active.fe_elem_off;
+
+	if (fcb_elem_info(fcb, &loc) == -ENOTSUP)
+	    break;
+
+	fcb->f_active.fe_elem_off = loc.fe_data_off + fcb_len_in_flash(fcb, loc.fe_data_len) +
+	    fcb_len_in_flash(fcb, 1);
+    }
+
+    return 0;
+}
+
+int fcb_append(struct fcb *fcb, uint16_t len, struct fcb_entry *loc)
+{
+    struct fcb_entry *active = &fcb->f_active;
+    uint8_t buf[2];
+    uint32_t cnt, size;
+
+    if (len < 0x80) {
+	buf[0] = (uint8_t)len;
+	cnt = 1;
+    } else {
+	buf[0] = (len & 0x7f) | 0x80;
+	buf[1] = (uint8_t)(len >> 7);
+	cnt = 2;
+    }
+
+    size = fcb_len_in_flash(fcb, cnt) + fcb_len_in_flash(fcb, len) + fcb_len_in_flash(fcb, 1);
+
+    if (active->fe_elem_off + size > active->fe_sector->fs_size) {
+	struct flash_sector *sector = fcb_getnext_sector(fcb, active->fe_sector);
+
+	if (sector == fcb->f_oldest || sector->fs_size < fcb_start_offset(fcb) + size)
+	    return -ENOSPC;
+
+	if (fcb_sector_hdr_init(fcb, sector, fcb->f_active_id + 1) != 0)
+	    return -EIO;
+
+	active->fe_sector = sector;
+	active->fe_elem_off = fcb_start_offset(fcb);
+	fcb->f_active_id++;
+    }
+
+    if (fcb_flash_write(fcb, active->fe_sector, active->fe_elem_off, buf, cnt) != 0)
+	return -EIO;
+
+    loc->fe_sector = active->fe_sector;
+    loc->fe_elem_off = active->fe_elem_off;
+    loc->fe_data_off = active->fe_elem_off + fcb_len_in_flash(fcb, cnt);
+    loc->fe_data_len = len;
+    active->fe_elem_off += size;
+
+    return 0;
+}
+
+int fcb_append_finish(struct fcb *fcb, struct fcb_entry *loc)
+{
+    uint8_t buf[2], data[UINT8_MAX], crc;
+    uint32_t cnt = loc->fe_data_off - loc->fe_elem_off;
+
+    if (loc->fe_data_len > sizeof(data) ||
+	flash_area_read(fcb->fap, loc->fe_sector->fs_off + loc->fe_elem_off, buf, MIN(cnt, sizeof(buf))) != 0 ||
+	flash_area_read(fcb->fap, FCB_ENTRY_FA_DATA_OFF(*loc), data, loc->fe_data_len) != 0)
+	return -EIO;
+
+    crc = fcb_crc8(fcb_crc8(0xff, buf, loc->fe_data_len < 0x80 ? 1 : 2), data, loc->fe_data_len);
+
+    return fcb_flash_write(fcb, loc->fe_sector, loc->fe_data_off + fcb_len_in_flash(fcb, loc->fe_data_len),
+			   &crc, 1) == 0 ? 0 : -EIO;
+}
+
+/*
+ * Call cb for each valid entry, oldest first: of the sector
+ * if not NULL, of all the sectors in use otherwise.
+ *
+ * Return 0, or the value of cb if not 0.
+ */
+
+int fcb_walk(struct fcb *fcb, struct flash_sector *sector, fcb_walk_cb cb, void *cb_arg)
+{
+    struct flash_sector *cur = sector != NULL ? sector : fcb->f_oldest;
+    struct fcb_entry_ctx ctx = { .fap = fcb->fap };
+    int rc;
+
+    for (;;) {
+	ctx.loc.fe_sector = cur;
+	ctx.loc.fe_elem_off = 0;
+
+	while ((rc = fcb_getnext_in_sector(fcb, &ctx.loc)) != -ENOTSUP) {
+	    if (rc == 0 && (rc = cb(&ctx, cb_arg)) != 0)
+		return rc;
+	    if (rc == -EIO)
+		return rc;
+	}
+
+	if (sector != NULL || cur == fcb->f_active.fe_sector)
+	    return 0;
+
+	cur = fcb_getnext_sector(fcb, cur);
+    }
+}
+
+int fcb_rotate(struct fcb *fcb)
+{
+    if (flash_area_erase(fcb->fap, fcb->f_oldest->fs_off, fcb->f_oldest->fs_size) != 0)
+	return -EIO;
+
+    if (fcb->f_oldest == fcb->f_active.fe_sector) { // a new active sector, the current one wiped
+	struct flash_sector *sector = fcb_getnext_sector(fcb, fcb->f_oldest);
+
+	if (fcb_sector_hdr_init(fcb, sector, fcb->f_active_id + 1) != 0)
+	    return -EIO;
+
+	fcb->f_active.fe_sector = sector;
+	fcb->f_active.fe_elem_off = fcb_start_offset(fcb);
+	fcb->f_active_id++;
+    }
+
+    fcb->f_oldest = fcb_getnext_sector(fcb, fcb->f_oldest);
+
+    return 0;
+}
+
+int fcb_clear(struct fcb *fcb)
+{
+    int rc = 0;
+
+    while (!(fcb->f_active.fe_sector == fcb->f_oldest && fcb->f_active.fe_elem_off == fcb_start_offset(fcb))) {
+	if ((rc = fcb_rotate(fcb)) != 0)
+	    break;
+    }
+
+    return rc;
+}
@@ -0,0 +1,216 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Kernel primitives of the engine emulated over POSIX (see platform.h).
+ */
+
+int dhcpd4_log_level = LOG_LEVEL_INF;
+int64_t dhcpd4_host_clock_ms = -1;
+
+int64_t k_uptime_get(void)
+{
+    struct timespec ts;
+
+    if (dhcpd4_host_clock_ms >= 0)
+	return dhcpd4_host_clock_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / 1000000;
+}
+
+uint32_t k_cycle_get_32(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec);
+}
+
+/*
+ * Take a block of a slab: a freed block first, else the next block
+ * never used of its buffer.
+ *
+ * Return 0 on success, -ENOMEM if the slab is empty.
+ */
+
+int k_mem_slab_alloc(struct k_mem_slab *slab, void **mem, k_timeout_t timeout)
+{
+    int ret = 0;
+
+    ARG_UNUSED(timeout);
+
+    pthread_mutex_lock(&slab->lock);
+
+    if (slab->free_list != NULL) {
+	*mem = slab->free_list;
+	slab->free_list = *(void **)slab->free_list;
+    } else if (slab->num_used < slab->num_blocks) {
+	*mem = slab->buffer + (size_t)slab->num_used++ * slab->block_size;
+    } else {
+	*mem = NULL;
+	ret = -ENOMEM;
+    }
+
+    pthread_mutex_unlock(&slab->lock);
+
+    return ret;
+}
+
+void k_mem_slab_free(struct k_mem_slab *slab, void *mem)
+{
+    pthread_mutex_lock(&slab->lock);
+
+    *(void **)mem = slab->free_list;
+    slab->free_list = mem;
+
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/*
+ * A block of the heap is preceded by its size, counted in the heap.
+ */
+
+union k_heap_header {
+    size_t size;
+    max_align_t align;
+};
+
+void *k_heap_alloc(struct k_heap *heap, size_t bytes, k_timeout_t timeout)
+{
+    union k_heap_header *header = NULL;
+
+    ARG_UNUSED(timeout);
+
+    pthread_mutex_lock(&heap->lock);
+
+    if (bytes <= heap->size - heap->used &&
+	(header = malloc(sizeof(*header) + bytes)) != NULL) {
+	header->size = bytes;
+	heap->used += bytes;
+    }
+
+    pthread_mutex_unlock(&heap->lock);
+
+    return header != NULL ? header + 1 : NULL;
+}
+
+void k_heap_free(struct k_heap *heap, void *mem)
+{
+    union k_heap_header *header = (union k_heap_header *)mem - 1;
+
+    if (mem == NULL)
+	return;
+
+    pthread_mutex_lock(&heap->lock);
+    heap->used -= header->size;
+    pthread_mutex_unlock(&heap->lock);
+
+    free(header);
+}
+
+/*
+ * Delayed works scheduled, run by k_sleep() once due, earliest first.
+ */
+
+static struct k_work_delayable *dhcpd4_host_works;
+
+void k_work_queue_start(struct k_work_q *queue, char *stack, size_t stack_size, int prio, const void *cfg)
+{
+    ARG_UNUSED(queue);
+    ARG_UNUSED(stack);
+    ARG_UNUSED(stack_size);
+    ARG_UNUSED(prio);
+    ARG_UNUSED(cfg);
+}
+
+/*
+ * Schedule a work, unless already scheduled.
+ *
+ * Return 1 if scheduled, 0 if it already was.
+ */
+
+int k_work_schedule_for_queue(struct k_work_q *queue, struct k_work_delayable *dwork, k_timeout_t delay)
+{
+    ARG_UNUSED(queue);
+
+    if (dwork->scheduled)
+	return 0;
+
+    dwork->scheduled = true;
+    dwork->due = k_uptime_get() + delay.ticks;
+    dwork->next = dhcpd4_host_works;
+    dhcpd4_host_works = dwork;
+
+    return 1;
+}
+
+static void dhcpd4_host_run_work(struct k_work_delayable *dwork)
+{
+    struct k_work_delayable **prev;
+
+    for (prev = &dhcpd4_host_works; *prev != dwork; prev = &(*prev)->next)
+	;
+
+    *prev = dwork->next;
+    dwork->scheduled = false;
+    dwork->work.handler(&dwork->work);
+}
+
+/*
+ * Run a scheduled work at once.
+ *
+ * Return true if the work was scheduled.
+ */
+
+bool k_work_flush_delayable(struct k_work_delayable *dwork, struct k_work_sync *sync)
+{
+    ARG_UNUSED(sync);
+
+    if (!dwork->scheduled)
+	return false;
+
+    dhcpd4_host_run_work(dwork);
+
+    return true;
+}
+
+/*
+ * Sleep, then run the works due.
+ */
+
+int32_t k_sleep(k_timeout_t timeout)
+{
+    struct timespec ts = { timeout.ticks / MSEC_PER_SEC, timeout.ticks % MSEC_PER_SEC * 1000000 };
+    struct k_work_delayable *dwork, *first;
+
+    if (dhcpd4_host_clock_ms >= 0)
+	dhcpd4_host_clock_ms += timeout.ticks;
+    else
+	nanosleep(&ts, NULL);
+
+    do {
+	first = NULL;
+
+	for (dwork = dhcpd4_host_works; dwork != NULL; dwork = dwork->next) {
+	    if (dwork->due <= k_uptime_get() && (first == NULL || dwork->due < first->due))
+		first = dwork;
+	}
+
+	if (first != NULL)
+	    dhcpd4_host_run_work(first);
+    } while (first != NULL);
+
+    return 0;
+}
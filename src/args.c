@@ -12,6 +12,17 @@ LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 #include "options.h"
 #include <zephyr/shell/shell.h>
 #include "dhcpmem.h"
+#include "stats.h"
+#include "events.h"
+#if defined(CONFIG_DHCPD_SNAPSHOT_BENCH)
+#include "snapshot.h"
+#endif
+#if defined(CONFIG_DHCPD_LOADGEN)
+#include "loadgen.h"
+#endif
+#if defined(CONFIG_DHCPD_BENCH)
+#include "bench.h"
+#endif
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic error "-Wall"
@@ -41,36 +52,18 @@ static void dhcpd4_usage(const struct shell *sh,char *msg)
     
 }
 
-int dhcpd4_parse_and_add_option(address_pool *pool, char * name, char * value)
-{
-
-    dhcp_option *option = dhcpd4_calloc(1, sizeof(*option));
-    if (!option) {
-	    return -1;
-    }
-    uint8_t id = dhcpd4_parse_option(option, name, value);
-    if (id == 0) {
-	    LOG_ERR("error: invalid dhcp option specified: %s,%s", name, value);
-	    dhcpd4_option_free(&option);
-	    return -1;
-    }
-    return dhcpd4_append_option(&pool->options, option);
-}
+/*
+ * Parse the options of a pool, accepted in optstring.
+ */
 
-static int dhcpd4_parse_args(const struct shell *sh, int argc, char *argv[], address_pool *pool)
+static int dhcpd4_parse_pool_args(const struct shell *sh, int argc, char *argv[], const char *optstring,
+				  address_pool *pool)
 {
     int c;
 
     opterr = 0;
 
-    struct net_if * iface = net_if_get_default();
-    if (iface) {
-	pool->device_index=net_if_get_by_iface(iface);
-    } else {
-	pool->device_index=-1;
-    }
-
-    while ((c = getopt (argc, argv, "a:d:o:p:s:")) != -1)
+    while ((c = getopt (argc, argv, optstring)) != -1)
 	switch (c) {
 
 	case 'a': // parse IP address pool
@@ -100,7 +93,6 @@ static int dhcpd4_parse_args(const struct shell *sh, int argc, char *argv[], add
 
 		pool->indexes.first   = *first;
 		pool->indexes.last    = *last;
-		pool->indexes.current = *first;
 
 		dhcpd4_free(first);
 		dhcpd4_free(last);
@@ -200,7 +192,7 @@ static int dhcpd4_parse_args(const struct shell *sh, int argc, char *argv[], add
 		    return -1;
 		}
 
-		dhcpd4_add_binding(&pool->bindings, *ip, hw, 6, 1);
+		dhcpd4_add_binding(&pool->bindings, &pool->indexes, *ip, hw, 6, STATIC);
 
 		dhcpd4_free(ip);
 		dhcpd4_free(hw);
@@ -214,6 +206,21 @@ static int dhcpd4_parse_args(const struct shell *sh, int argc, char *argv[], add
 	    dhcpd4_usage(sh, NULL);
 	}
 
+    return 0;
+}
+
+static int dhcpd4_parse_args(const struct shell *sh, int argc, char *argv[], address_pool *pool)
+{
+    struct net_if * iface = net_if_get_default();
+    if (iface) {
+	pool->device_index=net_if_get_by_iface(iface);
+    } else {
+	pool->device_index=-1;
+    }
+
+    if (dhcpd4_parse_pool_args(sh, argc, argv, "a:d:o:p:s:", pool) != 0)
+	return -1;
+
     if(optind >= argc) {
 	dhcpd4_usage(sh, "error: server address not provided.");
 	return -1;
@@ -248,6 +255,74 @@ static int cmd_dhcpd_start(const struct shell *sh, size_t argc, char *argv[]) {
     return 0;
 }
 
+/*
+ * Parse the pool of a subnet, specified as network/length,
+ * served on an interface (-d) or reached through relay agents.
+ */
+
+static int dhcpd4_parse_subnet_args(const struct shell *sh, int argc, char *argv[], address_pool *pool)
+{
+    uint32_t *ip, *len;
+    char *slen;
+
+    if (dhcpd4_parse_pool_args(sh, argc, argv, "a:d:o:p:s:", pool) != 0)
+	return -1;
+
+    if(optind >= argc || (slen = strchr(argv[optind], '/')) == NULL) {
+	dhcpd4_usage(sh, "error: subnet not provided.");
+	return -1;
+    }
+    *slen = '\0';
+    slen++;
+
+    if (dhcpd4_parse_ip(argv[optind], (void **)&ip) != 4) {
+	dhcpd4_usage(sh, "error: invalid subnet address.");
+	return -1;
+    }
+
+    if (dhcpd4_parse_long(slen, (void **)&len) != 4 || *len > 32) {
+	dhcpd4_free(ip);
+	dhcpd4_usage(sh, "error: invalid subnet length.");
+	return -1;
+    }
+
+    pool->subnet = *ip;
+    pool->netmask = *len ? htonl(UINT32_MAX << (32 - *len)) : 0;
+
+    dhcpd4_free(ip);
+    dhcpd4_free(len);
+    return 0;
+}
+
+static int cmd_dhcpd4_subnet(const struct shell *sh, size_t argc, char *argv[]) {
+    address_pool *pool = dhcpd4_calloc(1, sizeof(*pool));
+
+    if (pool == NULL) {
+	PR(sh, SHELL_ERROR, "out of memory\n");
+	return -ENOMEM;
+    }
+
+    dhcpd4_init_binding_list(&pool->bindings);
+    dhcpd4_init_option_list(&pool->options);
+
+    if (dhcpd4_parse_subnet_args(sh, argc, argv, pool) != 0) {
+	dhcpd4_delete_binding_list(&pool->bindings);
+	dhcpd4_delete_option_list(&pool->options);
+	dhcpd4_free(pool);
+	return 1;
+    }
+
+    if (dhcpd4_add_pool(pool) != 0) {
+	PR(sh, SHELL_ERROR, "subnet already served\n");
+	dhcpd4_delete_binding_list(&pool->bindings);
+	dhcpd4_delete_option_list(&pool->options);
+	dhcpd4_free(pool);
+	return 1;
+    }
+
+    return 0;
+}
+
 static int cmd_dhcpd4_stop(const struct shell *sh, size_t argc, char *argv[]) {
 	ARG_UNUSED(argc);
 	ARG_UNUSED(argv);
@@ -256,9 +331,241 @@ static int cmd_dhcpd4_stop(const struct shell *sh, size_t argc, char *argv[]) {
 	return -ENOEXEC;
 }
 
+static int cmd_dhcpd4_batches(const struct shell *sh, size_t argc, char *argv[]) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	uint32_t histogram[DHCPD4_BATCH_BUCKETS];
+	int i;
+
+	dhcpd4_get_batch_histogram(histogram);
+
+	PR(sh, SHELL_NORMAL, "requests per wakeup: wakeups\n");
+	for (i = 0; i < DHCPD4_BATCH_BUCKETS - 1; i++) {
+		PR(sh, SHELL_NORMAL, "%u-%u: %u\n", 1u << i, (2u << i) - 1, histogram[i]);
+	}
+	PR(sh, SHELL_NORMAL, "%u+: %u\n", 1u << i, histogram[i]);
+	return 0;
+}
+
+static int cmd_dhcpd4_replies(const struct shell *sh, size_t argc, char *argv[]) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct dhcpd4_reply_counters counters;
+
+	dhcpd4_get_reply_counters(&counters);
+
+	PR(sh, SHELL_NORMAL, "broadcast: %u\n", counters.broadcast);
+	PR(sh, SHELL_NORMAL, "unicast: %u\n", counters.unicast);
+	PR(sh, SHELL_NORMAL, "relayed: %u\n", counters.relayed);
+	PR(sh, SHELL_NORMAL, "dropped: %u\n", counters.dropped);
+	return 0;
+}
+
+static const char *const dhcpd4_mem_names[DHCPD4_MEM_CLASSES] = { "scratch", "option", "binding", "heap" };
+
+static int cmd_dhcpd4_memory(const struct shell *sh, size_t argc, char *argv[]) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct dhcpd4_mem_stats stats[DHCPD4_MEM_CLASSES];
+	int i;
+
+	dhcpd4_get_mem_stats(stats);
+
+	PR(sh, SHELL_NORMAL, "class: block size, blocks, used, high, failures\n");
+	for (i = 0; i < DHCPD4_MEM_CLASSES; i++) {
+		PR(sh, SHELL_NORMAL, "%s: %u, %u, %u, %u, %u\n", dhcpd4_mem_names[i], stats[i].block_size,
+		   stats[i].blocks, stats[i].used, stats[i].high, stats[i].failures);
+	}
+	return 0;
+}
+
+static int cmd_dhcpd4_stats(const struct shell *sh, size_t argc, char *argv[]) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct dhcpd4_stats stats;
+	struct dhcpd4_mem_stats mem[DHCPD4_MEM_CLASSES];
+	struct dhcpd4_pool_usage usage;
+	char subnet[INET_ADDRSTRLEN];
+	uint32_t failures = 0;
+	int i;
+
+	dhcpd4_get_stats(&stats, true);
+	dhcpd4_get_mem_stats(mem);
+
+	for (i = 0; i < DHCPD4_STATS; i++) {
+		PR(sh, SHELL_NORMAL, "%s: %u\n", dhcpd4_stat_name(i), stats.counters[i]);
+	}
+	for (i = 0; i < DHCPD4_MEM_CLASSES; i++) {
+		failures += mem[i].failures;
+	}
+	PR(sh, SHELL_NORMAL, "allocation failures (since start): %u\n", failures);
+
+	for (i = 0; dhcpd4_get_pool_usage(i, &usage) == 0; i++) {
+		inet_ntop(AF_INET, &usage.subnet, subnet, sizeof(subnet));
+		PR(sh, SHELL_NORMAL, "pool %s: %u of %u addresses used\n", subnet,
+		   usage.size - usage.free, usage.size);
+	}
+
+	PR(sh, SHELL_NORMAL, "request to reply latency (us): replies\n");
+	PR(sh, SHELL_NORMAL, "0: %u\n", stats.latency[0]);
+	for (i = 1; i < DHCPD4_LATENCY_BUCKETS - 1; i++) {
+		PR(sh, SHELL_NORMAL, "%u-%u: %u\n", 1u << (i - 1), (1u << i) - 1, stats.latency[i]);
+	}
+	PR(sh, SHELL_NORMAL, "%u+: %u\n", 1u << (i - 1), stats.latency[i]);
+	return 0;
+}
+
+static void dhcpd4_print_lease_event(const dhcpd4_lease_event *event, void *arg) {
+	const struct shell *sh = arg;
+	char text[80];
+
+	dhcpd4_lease_event_format(event, text, sizeof(text));
+	PR(sh, SHELL_NORMAL, "%u.%03u: %s (xid 0x%08x)\n", event->time / 1000, event->time % 1000,
+	   text, event->xid);
+}
+
+static int cmd_dhcpd4_events(const struct shell *sh, size_t argc, char *argv[]) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	uint32_t lost;
+
+	dhcpd4_lease_events_drain(dhcpd4_print_lease_event, (void *)sh, &lost);
+	if (lost != 0) {
+		PR(sh, SHELL_WARNING, "%u events lost (ring full)\n", lost);
+	}
+	return 0;
+}
+
+#if defined(CONFIG_DHCPD_SNAPSHOT_BENCH)
+static int cmd_dhcpd4_snapshot_bench(const struct shell *sh, size_t argc, char *argv[]) {
+	uint32_t leases, write_us, restore_us;
+	int restored;
+
+	if (argc != 2 || (leases = strtoul(argv[1], NULL, 10)) == 0) {
+		shell_help(sh);
+		return -EINVAL;
+	}
+
+	if (dhcpd4_running()) {
+		PR(sh, SHELL_ERROR, "stop the server first\n");
+		return -EBUSY;
+	}
+
+	restored = dhcpd4_snapshot_bench(leases, &write_us, &restore_us);
+
+	if (restored < 0) {
+		PR(sh, SHELL_ERROR, "snapshot not written or not restored\n");
+		return -EIO;
+	}
+
+	PR(sh, SHELL_NORMAL, "leases: %u (%d restored)\n", leases, restored);
+	PR(sh, SHELL_NORMAL, "write: %u us\n", write_us);
+	PR(sh, SHELL_NORMAL, "restore: %u us (%u ns per lease)\n", restore_us,
+	   restored > 0 ? (uint32_t)((uint64_t)restore_us * 1000 / restored) : 0);
+	return 0;
+}
+#endif
+
+#if defined(CONFIG_DHCPD_LOADGEN)
+static int cmd_dhcpd4_load(const struct shell *sh, size_t argc, char *argv[]) {
+	struct dhcpd4_loadgen_result result;
+	struct dhcpd4_mem_stats mem[DHCPD4_MEM_CLASSES];
+	uint32_t clients, cycles = 1, seed = 0;
+	int i;
+
+	if (argc < 2 || argc > 4 || (clients = strtoul(argv[1], NULL, 10)) == 0 ||
+	    (argc > 2 && (cycles = strtoul(argv[2], NULL, 10)) == 0)) {
+		shell_help(sh);
+		return -EINVAL;
+	}
+	if (argc > 3) {
+		seed = strtoul(argv[3], NULL, 10);
+	}
+
+	if (dhcpd4_loadgen_run(clients, cycles, seed, &result) != 0) {
+		PR(sh, SHELL_ERROR, "server not running, or load generator busy\n");
+		return -EIO;
+	}
+
+	dhcpd4_get_mem_stats(mem);
+
+	PR(sh, SHELL_NORMAL, "clients: %u, cycles: %u, seed: %u\n", clients, cycles, seed);
+	PR(sh, SHELL_NORMAL, "elapsed: %u ms\n", result.elapsed_ms);
+	PR(sh, SHELL_NORMAL, "DORA: %u (%u/s)\n", result.dora,
+	   result.elapsed_ms ? (uint32_t)((uint64_t)result.dora * 1000 / result.elapsed_ms) : 0);
+	PR(sh, SHELL_NORMAL, "renewals: %u, releases: %u, naks: %u, timeouts: %u\n",
+	   result.renewals, result.releases, result.naks, result.timeouts);
+	PR(sh, SHELL_NORMAL, "latency (us): p50 %u, p99 %u, p999 %u\n",
+	   result.p50_us, result.p99_us, result.p999_us);
+	PR(sh, SHELL_NORMAL, "memory high-water (since start): block size, blocks, high\n");
+	for (i = 0; i < DHCPD4_MEM_CLASSES; i++) {
+		PR(sh, SHELL_NORMAL, "%s: %u, %u, %u\n", dhcpd4_mem_names[i], mem[i].block_size,
+		   mem[i].blocks, mem[i].high);
+	}
+	return 0;
+}
+#endif
+
+#if defined(CONFIG_DHCPD_BENCH)
+static int cmd_dhcpd4_bench(const struct shell *sh, size_t argc, char *argv[]) {
+	static const char *const steps[DHCPD4_BENCH_STEPS] = {
+		"discover", "request", "renew", "release",
+	};
+	struct dhcpd4_bench_result result;
+	uint32_t clients, cycles = 1;
+	int i;
+
+	if (argc < 2 || argc > 3 || (clients = strtoul(argv[1], NULL, 10)) == 0 ||
+	    (argc > 2 && (cycles = strtoul(argv[2], NULL, 10)) == 0)) {
+		shell_help(sh);
+		return -EINVAL;
+	}
+
+	if (dhcpd4_running()) {
+		PR(sh, SHELL_ERROR, "stop the server first\n");
+		return -EBUSY;
+	}
+
+	if (dhcpd4_bench_run(clients, cycles, &result) != 0) {
+		PR(sh, SHELL_ERROR, "benchmark not run (too many clients, or busy)\n");
+		return -EIO;
+	}
+
+	PR(sh, SHELL_NORMAL, "clients: %u, cycles: %u\n", clients, cycles);
+	PR(sh, SHELL_NORMAL, "requests: %u in %u us (%u/s), failures: %u\n", result.messages,
+	   (uint32_t)(result.engine_ns / 1000),
+	   result.engine_ns ? (uint32_t)((uint64_t)result.messages * 1000000000 / result.engine_ns) : 0,
+	   result.failures);
+	PR(sh, SHELL_NORMAL, "cost per request (ns): mean, max\n");
+	for (i = 0; i < DHCPD4_BENCH_STEPS; i++) {
+		PR(sh, SHELL_NORMAL, "%s: %u, %u\n", steps[i], result.mean_ns[i], result.max_ns[i]);
+	}
+	return 0;
+}
+#endif
+
 SHELL_STATIC_SUBCMD_SET_CREATE(dhcpd_commands,
 	SHELL_CMD(start, NULL, "dhcpd4 start", cmd_dhcpd_start),
 	SHELL_CMD(stop, NULL, "dhcpd4 stop", cmd_dhcpd4_stop),
+	SHELL_CMD(subnet, NULL, "dhcpd4 subnet [-a first,last] [-d device] [-o opt,value] [-p time] [-s mac,ip] network/length",
+		  cmd_dhcpd4_subnet),
+	SHELL_CMD(batches, NULL, "dhcpd4 batches", cmd_dhcpd4_batches),
+	SHELL_CMD(replies, NULL, "dhcpd4 replies", cmd_dhcpd4_replies),
+	SHELL_CMD(memory, NULL, "dhcpd4 memory", cmd_dhcpd4_memory),
+	SHELL_CMD(stats, NULL, "dhcpd4 stats (counters since the last call)", cmd_dhcpd4_stats),
+	SHELL_CMD(events, NULL, "dhcpd4 events (lease events not logged yet)", cmd_dhcpd4_events),
+#if defined(CONFIG_DHCPD_LOADGEN)
+	SHELL_CMD(load, NULL, "dhcpd4 load <clients> [cycles] [seed] (virtual clients, e.g. 1000 10)",
+		  cmd_dhcpd4_load),
+#endif
+#if defined(CONFIG_DHCPD_BENCH)
+	SHELL_CMD(bench, NULL, "dhcpd4 bench <clients> [cycles] (engine alone, server stopped, e.g. 1000 10)",
+		  cmd_dhcpd4_bench),
+#endif
+#if defined(CONFIG_DHCPD_SNAPSHOT_BENCH)
+	SHELL_CMD(snapshot_bench, NULL, "dhcpd4 snapshot_bench <leases> (e.g. 1000, 10000, 65536)",
+		  cmd_dhcpd4_snapshot_bench),
+#endif
 	SHELL_SUBCMD_SET_END
 );
 
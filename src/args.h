@@ -2,6 +2,7 @@
 #include <time.h>
 
 #include "dhcpserver.h"
+#include "engine.h"
 
 #define NAME "dhcpserver"
 #define VERSION "v. 0.1"
@@ -23,5 +24,4 @@
 /* Prototypes */
 
 //void usage(char *msg, int exit_status);
-//void parse_args(int argc, char *argv[], address_pool *pool);
-int dhcpd4_parse_and_add_option(address_pool *pool, char * name, char * value);
\ No newline at end of file
+//void parse_args(int argc, char *argv[], address_pool *pool);
\ No newline at end of file
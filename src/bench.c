@@ -0,0 +1,247 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <string.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcp.h"
+#include "options.h"
+#include "bench.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Engine benchmark: synthetic clients run DISCOVER/REQUEST/RENEW/RELEASE
+ * cycles through dhcpd4_handle(), with no socket nor thread, to measure
+ * the cost of a request in the engine alone (parsing, bindings, reply).
+ *
+ * The clients are served by a scratch pool of 10.0.0.0/8 having an
+ * address for each one: the server must be stopped. Each step is run
+ * for all the clients before the next one, so that the requests are
+ * served with every client bound.
+ */
+
+#define DHCPD4_BENCH_SERVER  0x0a000001 // 10.0.0.1
+#define DHCPD4_BENCH_NETMASK 0xff000000
+
+static address_pool dhcpd4_bench_pool;
+static uint32_t dhcpd4_bench_addresses[CONFIG_DHCPD_MAX_BINDINGS]; // leased by client, 0 if failed
+static dhcpd_message dhcpd4_bench_request;
+static dhcpd_message dhcpd4_bench_reply;
+static atomic_t dhcpd4_bench_busy;
+
+/*
+ * Cost of the requests of a step, in cycles.
+ */
+
+struct dhcpd4_bench_cost {
+    uint64_t cycles;   // total
+    uint32_t max;      // highest cost of a request
+    uint32_t requests; // requests handled
+};
+
+static struct dhcpd4_bench_cost dhcpd4_bench_costs[DHCPD4_BENCH_STEPS];
+
+static const uint8_t dhcpd4_bench_parameters[] = { SUBNET_MASK, ROUTER, DOMAIN_NAME_SERVER };
+
+/*
+ * Build the request of a client for a step.
+ *
+ * Return the length of the request.
+ */
+
+static size_t dhcpd4_bench_build(uint32_t client, uint32_t xid, int step)
+{
+    dhcpd_message *msg = &dhcpd4_bench_request;
+    uint32_t server_id = htonl(DHCPD4_BENCH_SERVER);
+    uint32_t index = htonl(client);
+    size_t room = sizeof(msg->options) - 1;
+    size_t len = sizeof(option_magic);
+    uint8_t type = step == DHCPD4_BENCH_DISCOVER ? DHCP_DISCOVER :
+		   step == DHCPD4_BENCH_RELEASE ? DHCP_RELEASE : DHCP_REQUEST;
+
+    memset(msg, 0, DHCP_HEADER_SIZE);
+
+    msg->op = BOOTREQUEST;
+    msg->htype = ETHERNET;
+    msg->hlen = ETHERNET_LEN;
+    msg->xid = htonl(xid);
+    msg->chaddr[0] = 0x02; // locally administered MAC address
+    memcpy(&msg->chaddr[2], &index, sizeof(index));
+
+    memcpy(msg->options, option_magic, sizeof(option_magic));
+    len += dhcpd4_serialize_option(msg->options + len, room - len, DHCP_MESSAGE_TYPE, 1, &type);
+
+    switch (step) {
+
+    case DHCPD4_BENCH_DISCOVER:
+	len += dhcpd4_serialize_option(msg->options + len, room - len, PARAMETER_REQUEST_LIST,
+				       sizeof(dhcpd4_bench_parameters), dhcpd4_bench_parameters);
+	break;
+
+    case DHCPD4_BENCH_REQUEST:
+	len += dhcpd4_serialize_option(msg->options + len, room - len, SERVER_IDENTIFIER, 4, &server_id);
+	len += dhcpd4_serialize_option(msg->options + len, room - len, REQUESTED_IP_ADDRESS, 4,
+				       &dhcpd4_bench_addresses[client]);
+	len += dhcpd4_serialize_option(msg->options + len, room - len, PARAMETER_REQUEST_LIST,
+				       sizeof(dhcpd4_bench_parameters), dhcpd4_bench_parameters);
+	break;
+
+    case DHCPD4_BENCH_RENEW:
+	msg->ciaddr = dhcpd4_bench_addresses[client];
+	len += dhcpd4_serialize_option(msg->options + len, room - len, PARAMETER_REQUEST_LIST,
+				       sizeof(dhcpd4_bench_parameters), dhcpd4_bench_parameters);
+	break;
+
+    case DHCPD4_BENCH_RELEASE:
+	msg->ciaddr = dhcpd4_bench_addresses[client];
+	len += dhcpd4_serialize_option(msg->options + len, room - len, SERVER_IDENTIFIER, 4, &server_id);
+	break;
+    }
+
+    msg->options[len++] = END;
+
+    return DHCP_HEADER_SIZE + len;
+}
+
+/*
+ * Set up the scratch pool, served by the shards of the server thread.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_bench_init(uint32_t clients)
+{
+    address_pool *pool = &dhcpd4_bench_pool;
+
+    memset(pool, 0, sizeof(*pool));
+    dhcpd4_init_binding_list(&pool->bindings);
+    dhcpd4_init_option_list(&pool->options);
+
+    pool->device_index = 1;
+    pool->server_id = htonl(DHCPD4_BENCH_SERVER);
+    pool->netmask = htonl(DHCPD4_BENCH_NETMASK);
+    pool->indexes.first = htonl(DHCPD4_BENCH_SERVER + 1);
+    pool->indexes.last = htonl(DHCPD4_BENCH_SERVER + clients);
+
+    if (dhcpd4_parse_and_add_option(pool, "SUBNET_MASK", "255.0.0.0") != 0 ||
+	dhcpd4_parse_and_add_option(pool, "ROUTER", "10.0.0.1") != 0 ||
+	dhcpd4_parse_and_add_option(pool, "DOMAIN_NAME_SERVER", "10.0.0.1") != 0) {
+	dhcpd4_delete_option_list(&pool->options);
+	return -1;
+    }
+
+    if (dhcpd4_init_pools(pool) != 0) {
+	dhcpd4_delete_option_list(&pool->options);
+	return -1;
+    }
+
+    if (dhcpd4_init_shards() != 0) {
+	dhcpd4_delete_pools();
+	dhcpd4_delete_option_list(&pool->options);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run a step of the cycle for all the clients still bound (or all
+ * of them at the DISCOVER step), adding up the cost of the requests.
+ */
+
+static void dhcpd4_bench_step(uint32_t clients, int step, uint32_t *xid, struct dhcpd4_bench_result *result)
+{
+    static const int expected[DHCPD4_BENCH_STEPS] = { DHCP_OFFER, DHCP_ACK, DHCP_ACK, 0 };
+    struct dhcpd4_bench_cost *cost = &dhcpd4_bench_costs[step];
+    dhcpd4_rxinfo rxinfo = {
+	.server_id = htonl(DHCPD4_BENCH_SERVER),
+	.src_port = htons(BOOTPC),
+    };
+    uint32_t client;
+
+    for (client = 0; client < clients; client++) {
+	size_t reply_len = sizeof(dhcpd4_bench_reply);
+	uint32_t start, elapsed;
+	size_t len;
+	int type;
+
+	if (step != DHCPD4_BENCH_DISCOVER && dhcpd4_bench_addresses[client] == 0)
+	    continue; // cycle failed
+
+	len = dhcpd4_bench_build(client, (*xid)++, step);
+	rxinfo.src_addr = step >= DHCPD4_BENCH_RENEW ? dhcpd4_bench_addresses[client] : 0;
+
+	start = k_cycle_get_32();
+	type = dhcpd4_handle((const uint8_t *)&dhcpd4_bench_request, len,
+			     (uint8_t *)&dhcpd4_bench_reply, &reply_len, &rxinfo);
+	elapsed = k_cycle_get_32() - start;
+
+	cost->cycles += elapsed;
+	cost->max = MAX(cost->max, elapsed);
+	cost->requests++;
+
+	if (type != expected[step]) {
+	    dhcpd4_bench_addresses[client] = 0;
+	    result->failures++;
+	} else if (step == DHCPD4_BENCH_DISCOVER) {
+	    dhcpd4_bench_addresses[client] = dhcpd4_bench_reply.yiaddr;
+	}
+    }
+}
+
+/*
+ * Run cycles of synthetic clients through the engine, the server
+ * being stopped. Up to CONFIG_DHCPD_MAX_BINDINGS clients.
+ *
+ * Return 0 on success, -1 if the server is running, or on error.
+ */
+
+int dhcpd4_bench_run(uint32_t clients, uint32_t cycles, struct dhcpd4_bench_result *result)
+{
+    uint32_t xid = 0, cycle;
+    uint64_t total = 0;
+    int step;
+
+    memset(result, 0, sizeof(*result));
+
+    if (clients == 0 || clients > CONFIG_DHCPD_MAX_BINDINGS || cycles == 0 ||
+	dhcpd4_running() || !atomic_cas(&dhcpd4_bench_busy, 0, 1))
+	return -1;
+
+    if (dhcpd4_bench_init(clients) != 0) {
+	LOG_ERR("Engine benchmark: out of memory for the pool");
+	atomic_clear(&dhcpd4_bench_busy);
+	return -1;
+    }
+
+    memset(dhcpd4_bench_costs, 0, sizeof(dhcpd4_bench_costs));
+
+    for (cycle = 0; cycle < cycles; cycle++) {
+	for (step = 0; step < DHCPD4_BENCH_STEPS; step++)
+	    dhcpd4_bench_step(clients, step, &xid, result);
+    }
+
+    for (step = 0; step < DHCPD4_BENCH_STEPS; step++) {
+	struct dhcpd4_bench_cost *cost = &dhcpd4_bench_costs[step];
+
+	if (cost->requests != 0)
+	    result->mean_ns[step] = (uint32_t)k_cyc_to_ns_floor64(cost->cycles / cost->requests);
+
+	result->max_ns[step] = (uint32_t)k_cyc_to_ns_floor64(cost->max);
+	result->messages += cost->requests;
+	total += cost->cycles;
+    }
+
+    result->engine_ns = k_cyc_to_ns_floor64(total);
+
+    dhcpd4_delete_pools();
+    dhcpd4_delete_option_list(&dhcpd4_bench_pool.options);
+    atomic_clear(&dhcpd4_bench_busy);
+
+    return 0;
+}
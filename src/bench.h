@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/*
+ * Steps of the cycle of a client of the engine benchmark.
+ */
+
+enum {
+    DHCPD4_BENCH_DISCOVER = 0, // DISCOVER, offered
+    DHCPD4_BENCH_REQUEST,      // REQUEST of the offered address, acked
+    DHCPD4_BENCH_RENEW,        // REQUEST of a RENEWING client, acked
+    DHCPD4_BENCH_RELEASE,      // RELEASE, no reply
+    DHCPD4_BENCH_STEPS
+};
+
+/*
+ * Results of a run of the engine benchmark. The cost of a request is
+ * the time spent in dhcpd4_handle(), its reply included.
+ */
+
+struct dhcpd4_bench_result {
+    uint32_t messages;                     // requests handled
+    uint32_t failures;                     // cycles not completed (no address, NAK)
+    uint64_t engine_ns;                    // time spent in the engine
+    uint32_t mean_ns[DHCPD4_BENCH_STEPS];  // mean cost of a request by step
+    uint32_t max_ns[DHCPD4_BENCH_STEPS];   // highest cost of a request by step
+};
+
+/* Prototypes */
+
+int dhcpd4_bench_run(uint32_t clients, uint32_t cycles, struct dhcpd4_bench_result *result);
+
+#endif
@@ -1,4 +1,4 @@
-#include <zephyr/logging/log.h>
+#include "platform.h"
 LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 #include <string.h>
 #include <time.h>
@@ -6,6 +6,7 @@ LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 #include "queue.h"
 #include "bindings.h"
 #include "dhcpmem.h"
+#include "journal.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic error "-Wall"
@@ -14,6 +15,179 @@ LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 #pragma GCC diagnostic error "-Wint-conversion"
 #pragma GCC diagnostic error "-Wincompatible-pointer-types"
 
+#define BINDING_INDEX_MIN_SIZE 16u
+
+/*
+ * Hash of a client identifier (FNV-1a over length and bytes).
+ */
+
+uint32_t dhcpd4_cident_hash(const uint8_t *cident, uint8_t cident_len)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    hash = (hash ^ cident_len) * 16777619u;
+
+    for (i = 0; i < cident_len; i++)
+	hash = (hash ^ cident[i]) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t dhcpd4_binding_cident_hash(const address_binding *binding)
+{
+    return dhcpd4_cident_hash(dhcpd4_binding_cident(binding), binding->cident_len);
+}
+
+/*
+ * Hash of an address (Fibonacci hashing, folded since the index takes
+ * the low bits). The address is taken in host order: the low bits of
+ * the product only depend on the low bits of the address, which must
+ * be the ones changing between neighbour addresses.
+ */
+
+static uint32_t dhcpd4_address_hash(uint32_t address)
+{
+    uint32_t hash = ntohl(address) * 2654435761u;
+
+    return hash ^ (hash >> 16);
+}
+
+static uint32_t dhcpd4_binding_address_hash(const address_binding *binding)
+{
+    return dhcpd4_address_hash(binding->address);
+}
+
+/*
+ * Insert a binding in the hash index, without any check on the table size.
+ */
+
+static void dhcpd4_index_put(binding_index *index, address_binding *binding)
+{
+    uint32_t mask = index->size - 1;
+    uint32_t i = index->hash(binding) & mask;
+
+    while (index->slots[i] != NULL)
+	i = (i + 1) & mask;
+
+    index->slots[i] = binding;
+    index->count++;
+}
+
+/*
+ * Reallocate the slots of the hash index and reinsert all the bindings.
+ *
+ * Return 0 on success, -1 if out of memory (the index is left untouched).
+ */
+
+static int dhcpd4_index_resize(binding_index *index, uint32_t size)
+{
+    address_binding **slots = index->slots;
+    uint32_t old_size = index->size;
+    uint32_t i;
+
+    index->slots = dhcpd4_calloc(size, sizeof(*slots));
+
+    if (index->slots == NULL) {
+	index->slots = slots;
+	return -1;
+    }
+
+    index->size = size;
+    index->count = 0;
+
+    for (i = 0; i < old_size; i++) {
+	if (slots[i] != NULL)
+	    dhcpd4_index_put(index, slots[i]);
+    }
+
+    dhcpd4_free(slots);
+
+    return 0;
+}
+
+/*
+ * Add a binding to the hash index, growing it to keep the load under 3/4.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+static int dhcpd4_index_insert(binding_index *index, address_binding *binding)
+{
+    if ((index->count + 1) * 4 > index->size * 3) {
+	uint32_t size = index->size ? index->size * 2 : BINDING_INDEX_MIN_SIZE;
+
+	if (dhcpd4_index_resize(index, size) != 0 && index->count + 1 >= index->size)
+	    return -1; // no room to grow and no free slot left
+    }
+
+    dhcpd4_index_put(index, binding);
+
+    return 0;
+}
+
+/*
+ * Remove a binding from the hash index.
+ *
+ * The following slots of the same cluster are shifted back,
+ * so that no tombstones are needed.
+ */
+
+static void dhcpd4_index_remove(binding_index *index, address_binding *binding)
+{
+    uint32_t mask = index->size - 1;
+    uint32_t i, j;
+
+    if (index->size == 0)
+	return;
+
+    for (i = index->hash(binding) & mask; index->slots[i] != binding; i = (i + 1) & mask) {
+	if (index->slots[i] == NULL)
+	    return; // not indexed
+    }
+
+    for (j = (i + 1) & mask; index->slots[j] != NULL; j = (j + 1) & mask) {
+	uint32_t home = index->hash(index->slots[j]) & mask;
+
+	// move slot j back to i if its home is not in the (i, j] cyclic range
+
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    index->slots[i] = index->slots[j];
+	    i = j;
+	}
+    }
+
+    index->slots[i] = NULL;
+    index->count--;
+}
+
+/*
+ * Current time of the bindings, in seconds.
+ *
+ * The system uptime is used, so that the expiries are not
+ * affected by changes of the wall clock.
+ */
+
+uint32_t dhcpd4_bindings_time(void)
+{
+    return k_uptime_get() / MSEC_PER_SEC;
+}
+
+/*
+ * Get the n-th of the lists the bindings are linked in:
+ * the idle list first, then the slots of the timer wheel.
+ */
+
+#define BINDING_LIST_HEADS (1 + BINDING_TIMER_LEVELS * BINDING_TIMER_SLOTS)
+
+static BINDING_LIST_HEAD *dhcpd4_binding_list_head(binding_list *list, int n)
+{
+    if (n == 0)
+	return &list->idle;
+
+    n--;
+    return &list->timer.slots[n / BINDING_TIMER_SLOTS][n % BINDING_TIMER_SLOTS];
+}
 
 /*
  * Initialize the binding list.
@@ -21,50 +195,615 @@ LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 
 void dhcpd4_init_binding_list(binding_list *list)
 {
-    LIST_INIT(list);
+    int n;
+
+    memset(list, 0, sizeof(*list));
+
+    list->cident_index.hash = dhcpd4_binding_cident_hash;
+    list->address_index.hash = dhcpd4_binding_address_hash;
+
+    list->timer.base = dhcpd4_bindings_time();
+
+    for (n = 0; n < BINDING_LIST_HEADS; n++)
+	LIST_INIT(dhcpd4_binding_list_head(list, n));
+}
+
+/*
+ * Call f for each binding of the list. The binding passed to f
+ * can be removed from the list.
+ */
+
+void dhcpd4_foreach_binding(binding_list *list, void (*f)(address_binding *binding, void *arg), void *arg)
+{
+    address_binding *binding, *binding_temp;
+    int n;
+
+    for (n = 0; n < BINDING_LIST_HEADS; n++) {
+	LIST_FOREACH_SAFE(binding, dhcpd4_binding_list_head(list, n), link, binding_temp)
+	    f(binding, arg);
+    }
+}
+
+/*
+ * Deallocate a binding record and its client identifier.
+ */
+
+static void dhcpd4_free_binding(address_binding *binding)
+{
+    if (binding->cident_len > BINDING_CIDENT_INLINE)
+	dhcpd4_free(binding->cident.spill);
+
+    dhcpd4_free(binding);
+}
+
+/*
+ * Delete all the bindings of the list and deallocate their memory.
+ */
+
+void dhcpd4_delete_binding_list(binding_list *list)
+{
+    address_binding *binding, *binding_temp;
+    int n;
+
+    for (n = 0; n < BINDING_LIST_HEADS; n++) {
+	LIST_FOREACH_SAFE(binding, dhcpd4_binding_list_head(list, n), link, binding_temp) {
+	    LIST_REMOVE(binding, link);
+	    dhcpd4_free_binding(binding);
+	}
+    }
+
+    dhcpd4_free(list->cident_index.slots);
+    dhcpd4_free(list->address_index.slots);
+    dhcpd4_init_binding_list(list);
+}
+
+/*
+ * Pool allocation bitmaps.
+ *
+ * The bit of an address is its offset from the first address of the pool
+ * (addresses are in network order). The bits of the last word beyond the
+ * end of the pool are always set in the used bitmap.
+ */
+
+#define POOL_WORD_BITS 64u
+
+#define POOL_WORDS(size) (((size) + POOL_WORD_BITS - 1) / POOL_WORD_BITS)
+#define POOL_BIT(offset) (1ull << ((offset) % POOL_WORD_BITS))
+#define POOL_WORD(map, offset) ((map)[(offset) / POOL_WORD_BITS])
+
+/*
+ * Get the offset of an address in the pool.
+ *
+ * Return 1 if the address belongs to the pool, 0 otherwise.
+ */
+
+static int dhcpd4_pool_offset(pool_indexes *indexes, uint32_t address, uint32_t *offset)
+{
+    uint32_t n = ntohl(address) - ntohl(indexes->first);
+
+    if (indexes->used == NULL || n >= indexes->size)
+	return 0;
+
+    *offset = n;
+    return 1;
+}
+
+/*
+ * Take an address from the pool.
+ */
+
+static void dhcpd4_use_address(pool_indexes *indexes, uint32_t address)
+{
+    uint32_t offset;
+
+    if (!dhcpd4_pool_offset(indexes, address, &offset) ||
+	(POOL_WORD(indexes->used, offset) & POOL_BIT(offset)))
+	return;
+
+    POOL_WORD(indexes->used, offset) |= POOL_BIT(offset);
+    POOL_WORD(indexes->held, offset) &= ~POOL_BIT(offset);
+    indexes->free--;
+}
+
+/*
+ * Give an address back to the pool.
+ *
+ * If held is true, the address is still recorded by a binding.
+ */
+
+static void dhcpd4_release_address(pool_indexes *indexes, uint32_t address, int held)
+{
+    uint32_t offset;
+
+    if (!dhcpd4_pool_offset(indexes, address, &offset))
+	return;
+
+    if (POOL_WORD(indexes->used, offset) & POOL_BIT(offset)) {
+	POOL_WORD(indexes->used, offset) &= ~POOL_BIT(offset);
+	indexes->free++;
+    }
+
+    if (held)
+	POOL_WORD(indexes->held, offset) |= POOL_BIT(offset);
+    else
+	POOL_WORD(indexes->held, offset) &= ~POOL_BIT(offset);
+}
+
+/*
+ * Take an address from the pool for good, for a static binding
+ * recorded elsewhere.
+ */
+
+void dhcpd4_reserve_address(pool_indexes *indexes, uint32_t address)
+{
+    dhcpd4_use_address(indexes, address);
+}
+
+/*
+ * Add a binding to the address index: in the array of the pool
+ * if its address belongs to a dense pool, in the hash index otherwise.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+static int dhcpd4_address_index_insert(binding_list *list, pool_indexes *indexes, address_binding *binding)
+{
+    uint32_t offset;
+
+    if (indexes->bindings != NULL && dhcpd4_pool_offset(indexes, binding->address, &offset) &&
+	indexes->bindings[offset] == NULL) {
+	indexes->bindings[offset] = binding;
+	return 0;
+    }
+
+    return dhcpd4_index_insert(&list->address_index, binding);
+}
+
+/*
+ * Remove a binding from the address index.
+ */
+
+static void dhcpd4_address_index_remove(binding_list *list, pool_indexes *indexes, address_binding *binding)
+{
+    uint32_t offset;
+
+    if (indexes->bindings != NULL && dhcpd4_pool_offset(indexes, binding->address, &offset) &&
+	indexes->bindings[offset] == binding) {
+	indexes->bindings[offset] = NULL;
+	return;
+    }
+
+    dhcpd4_index_remove(&list->address_index, binding);
+}
+
+/*
+ * Allocate the bitmaps of the pool delimited by indexes->first and
+ * indexes->last, mark the addresses of the bindings already in the list
+ * and rebuild the address index.
+ *
+ * A pool up to CONFIG_DHCPD_ADDRESS_INDEX_DENSE_MAX addresses is dense:
+ * its bindings are indexed by an array with a slot for each address.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_init_pool_indexes(pool_indexes *indexes, binding_list *list)
+{
+    uint32_t first = ntohl(indexes->first);
+    uint32_t last = ntohl(indexes->last);
+    address_binding *binding;
+    int n;
+
+    dhcpd4_delete_pool_indexes(indexes);
+
+    if (first == 0 || last < first)
+	return -1;
+
+    indexes->size = last - first + 1;
+    indexes->free = indexes->size;
+    indexes->cursor = 0;
+
+    indexes->used = dhcpd4_calloc(POOL_WORDS(indexes->size), sizeof(uint64_t));
+    indexes->held = dhcpd4_calloc(POOL_WORDS(indexes->size), sizeof(uint64_t));
+
+    if (indexes->size <= CONFIG_DHCPD_ADDRESS_INDEX_DENSE_MAX)
+	indexes->bindings = dhcpd4_calloc(indexes->size, sizeof(*indexes->bindings));
+
+    if (indexes->used == NULL || indexes->held == NULL ||
+	(indexes->size <= CONFIG_DHCPD_ADDRESS_INDEX_DENSE_MAX && indexes->bindings == NULL)) {
+	dhcpd4_delete_pool_indexes(indexes);
+	return -1;
+    }
+
+    dhcpd4_free(list->address_index.slots);
+    list->address_index.size = 0;
+    list->address_index.count = 0;
+
+    if (indexes->size % POOL_WORD_BITS)
+	indexes->used[POOL_WORDS(indexes->size) - 1] = ~0ull << (indexes->size % POOL_WORD_BITS);
+
+    for (n = 0; n < BINDING_LIST_HEADS; n++) {
+	LIST_FOREACH(binding, dhcpd4_binding_list_head(list, n), link) {
+	    if (binding->is_static || binding->status == PENDING || binding->status == ASSOCIATED)
+		dhcpd4_use_address(indexes, binding->address);
+	    else
+		dhcpd4_release_address(indexes, binding->address, 1);
+
+	    if (dhcpd4_address_index_insert(list, indexes, binding) != 0) {
+		dhcpd4_delete_pool_indexes(indexes);
+		return -1;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Deallocate the bitmaps and the address array of the pool.
+ *
+ * The bindings of the pool must be deleted before.
+ */
+
+void dhcpd4_delete_pool_indexes(pool_indexes *indexes)
+{
+    dhcpd4_free(indexes->used);
+    dhcpd4_free(indexes->held);
+    dhcpd4_free(indexes->bindings);
+
+    indexes->used = NULL;
+    indexes->held = NULL;
+    indexes->bindings = NULL;
+    indexes->size = 0;
+    indexes->free = 0;
+    indexes->cursor = 0;
+}
+
+#define BINDING_TIMER_MASK (BINDING_TIMER_SLOTS - 1)
+#define BINDING_TIMER_SPAN ((int32_t)1 << (BINDING_TIMER_LEVELS * BINDING_TIMER_BITS))
+
+/*
+ * Put a binding in the slot of the timer wheel of its expiry.
+ *
+ * An expiry beyond the span of the wheel is rescheduled when
+ * its slot is cascaded.
+ */
+
+static void dhcpd4_timer_put(binding_timer *timer, address_binding *binding)
+{
+    uint32_t expires = binding->expiry;
+    int32_t delta = (int32_t)(expires - timer->base);
+    int level;
+
+    if (delta < 0) { // already expired, run at the next second
+	expires = timer->base;
+	delta = 0;
+
+    } else if (delta >= BINDING_TIMER_SPAN) {
+	expires = timer->base + BINDING_TIMER_SPAN - 1;
+	delta = BINDING_TIMER_SPAN - 1;
+    }
+
+    for (level = 0; level < BINDING_TIMER_LEVELS - 1 &&
+	     delta >= ((int32_t)1 << ((level + 1) * BINDING_TIMER_BITS)); level++);
+
+    LIST_INSERT_HEAD(&timer->slots[level][(expires >> (level * BINDING_TIMER_BITS)) & BINDING_TIMER_MASK],
+		     binding, link);
+}
+
+/*
+ * Schedule the expiry of a binding in the timer wheel.
+ */
+
+static void dhcpd4_timer_add(binding_list *list, address_binding *binding)
+{
+    LIST_REMOVE(binding, link);
+
+    if (!binding->scheduled) {
+	binding->scheduled = 1;
+	list->timer.count++;
+    }
+
+    dhcpd4_timer_put(&list->timer, binding);
+}
+
+/*
+ * Remove a binding from the timer wheel (to the idle list), if scheduled.
+ */
+
+static void dhcpd4_timer_remove(binding_list *list, address_binding *binding)
+{
+    if (!binding->scheduled)
+	return;
+
+    LIST_REMOVE(binding, link);
+    LIST_INSERT_HEAD(&list->idle, binding, link);
+
+    binding->scheduled = 0;
+    list->timer.count--;
+}
+
+/*
+ * Move the bindings of the current slot of a level to the lower levels.
+ *
+ * Return the index of the slot, zero meaning that the upper level
+ * must be cascaded too.
+ */
+
+static int dhcpd4_timer_cascade(binding_timer *timer, int level)
+{
+    int index = (timer->base >> (level * BINDING_TIMER_BITS)) & BINDING_TIMER_MASK;
+    address_binding *binding = LIST_FIRST(&timer->slots[level][index]);
+
+    LIST_INIT(&timer->slots[level][index]);
+
+    while (binding != NULL) {
+	address_binding *next = LIST_NEXT(binding, link);
+
+	dhcpd4_timer_put(timer, binding);
+	binding = next;
+    }
+
+    return index;
+}
+
+/*
+ * Run the timer wheel up to the current time: the pending and associated
+ * bindings whose lease time is over are set to EXPIRED, and their addresses
+ * are given back to the pool (but held for the same client).
+ *
+ * Only the slots of the elapsed seconds are visited.
+ */
+
+void dhcpd4_run_bindings_timer(binding_list *list, pool_indexes *indexes)
+{
+    binding_timer *timer = &list->timer;
+    uint32_t now = dhcpd4_bindings_time();
+
+    while ((int32_t)(now - timer->base) >= 0) {
+	int index = timer->base & BINDING_TIMER_MASK;
+	address_binding *binding;
+
+	if (timer->count == 0) { // nothing to expire, jump to now
+	    timer->base = now + 1;
+	    break;
+	}
+
+	if (index == 0 &&
+	    dhcpd4_timer_cascade(timer, 1) == 0 &&
+	    dhcpd4_timer_cascade(timer, 2) == 0)
+	    dhcpd4_timer_cascade(timer, 3);
+
+	while ((binding = LIST_FIRST(&timer->slots[0][index])) != NULL) {
+
+	    if ((int32_t)(binding->expiry - now) > 0) {
+		// beyond the span of the wheel when scheduled
+		LIST_REMOVE(binding, link);
+		dhcpd4_timer_put(timer, binding);
+		continue;
+	    }
+
+	    dhcpd4_timer_remove(list, binding);
+	    binding->status = EXPIRED;
+	    dhcpd4_journal_binding(binding, 0);
+
+	    if (!binding->is_static)
+		dhcpd4_release_address(indexes, binding->address, 1);
+	}
+
+	timer->base++;
+    }
+}
+
+/*
+ * Time before the timer wheel must run again, in milliseconds: up to
+ * the first slot holding a binding, either to expire it (first level)
+ * or to cascade it (upper levels). Return -1 if no binding is scheduled.
+ *
+ * The current slot of an upper level is cascaded when the wheel runs
+ * the start of its span: until then it is due at base, and once done
+ * a binding put in it since is due at its next turn, 64 slots on.
+ */
+
+int dhcpd4_bindings_timer_timeout(binding_list *list)
+{
+    binding_timer *timer = &list->timer;
+    int64_t now = k_uptime_get();
+    uint32_t expires = timer->base + BINDING_TIMER_SPAN;
+    int64_t timeout;
+    int level;
+
+    if (timer->count == 0)
+	return -1;
+
+    for (level = 0; level < BINDING_TIMER_LEVELS; level++) {
+	int shift = level * BINDING_TIMER_BITS;
+	// the current slot is not cascaded yet if base starts its span (always on the first level)
+	uint32_t first = (timer->base & ((1u << shift) - 1)) == 0 ? 0 : 1;
+	uint32_t k;
+
+	for (k = first; k < first + BINDING_TIMER_SLOTS; k++) {
+	    uint32_t slot = (timer->base >> shift) + k;
+
+	    if (!LIST_EMPTY(&timer->slots[level][slot & BINDING_TIMER_MASK])) {
+		if ((int32_t)((slot << shift) - expires) < 0)
+		    expires = slot << shift;
+		break;
+	    }
+	}
+    }
+
+    timeout = (int64_t)(int32_t)(expires - (uint32_t)(now / MSEC_PER_SEC)) * MSEC_PER_SEC -
+	now % MSEC_PER_SEC;
+
+    return timeout < 0 ? 0 : timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+/*
+ * Set the client identifier of a binding.
+ *
+ * Return 0 on success, -1 if out of memory (the binding is left untouched).
+ */
+
+static int dhcpd4_set_binding_cident(address_binding *binding, uint8_t *cident, uint8_t cident_len)
+{
+    uint8_t *spill = NULL;
+
+    if (cident_len > BINDING_CIDENT_INLINE) {
+	spill = dhcpd4_malloc(cident_len);
+
+	if (spill == NULL)
+	    return -1;
+
+	memcpy(spill, cident, cident_len);
+    }
+
+    if (binding->cident_len > BINDING_CIDENT_INLINE)
+	dhcpd4_free(binding->cident.spill);
+
+    binding->cident_len = cident_len;
+
+    if (spill != NULL)
+	binding->cident.spill = spill;
+    else
+	memcpy(binding->cident.data, cident, cident_len);
+
+    return 0;
 }
 
 /*
  * Create a new binding
- * 
+ *
  * The binding is added to the binding list,
  * and a pointer to the binding is returned for further manipulations.
  */
 
-address_binding *dhcpd4_add_binding(binding_list *list, uint32_t address,
+address_binding *dhcpd4_add_binding(binding_list *list, pool_indexes *indexes, uint32_t address,
 	     uint8_t *cident, uint8_t cident_len, int is_static)
 {
+    address_binding *binding;
+
+    if ((binding = dhcpd4_mem_alloc(DHCPD4_MEM_BINDING)) == NULL) {
+	LOG_ERR("[%s] Out of binding records", __FUNCTION__);
+	return NULL;
+    }
+
     // fill binding
 
-    address_binding *binding = dhcpd4_calloc(1, sizeof(*binding));
+    memset(binding, 0, sizeof(*binding));
 
-    binding->address = address;
-    binding->cident_len = cident_len;
-    memcpy(binding->cident, cident, cident_len);
+    if (dhcpd4_set_binding_cident(binding, cident, cident_len) != 0) {
+	dhcpd4_free(binding);
+	return NULL;
+    }
 
+    binding->address = address;
     binding->is_static = is_static;
 
-    // add to binding list
+    // add to binding list and indexes
+
+    if (dhcpd4_index_insert(&list->cident_index, binding) != 0) {
+	dhcpd4_free_binding(binding);
+	return NULL;
+    }
+
+    if (dhcpd4_address_index_insert(list, indexes, binding) != 0) {
+	dhcpd4_index_remove(&list->cident_index, binding);
+	dhcpd4_free_binding(binding);
+	return NULL;
+    }
+
+    LIST_INSERT_HEAD(&list->idle, binding, link);
+
+    if (is_static) // never given to a dynamic binding
+	dhcpd4_use_address(indexes, address);
 
-    LIST_INSERT_HEAD(list, binding, pointers);
-    
     return binding;
 }
 
 /*
- * Updated bindings status, i.e. set to EXPIRED the status of the 
- * expired bindings.
+ * Remove a binding from the binding list and deallocate it.
+ *
+ * Its address is given back to the pool.
  */
 
-void dhcpd4_update_bindings_statuses(binding_list *list)
+void dhcpd4_remove_binding(binding_list *list, pool_indexes *indexes, address_binding *binding)
 {
-    address_binding *binding, *binding_temp;
-    
-    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-	if(binding->binding_time + binding->lease_time < time(NULL)) {
-	    binding->status = EXPIRED;
-	}
-    }
+    binding->status = B_EMPTY;
+    dhcpd4_journal_binding(binding, 0);
+
+    dhcpd4_release_address(indexes, binding->address, 0);
+
+    dhcpd4_index_remove(&list->cident_index, binding);
+    dhcpd4_address_index_remove(list, indexes, binding);
+    dhcpd4_timer_remove(list, binding);
+
+    LIST_REMOVE(binding, link);
+    dhcpd4_free_binding(binding);
+}
+
+/*
+ * Change the status of a binding and start a new lease time.
+ *
+ * A PENDING or ASSOCIATED binding is scheduled to expire at the end of
+ * the lease time; a dynamic one takes its address from the pool, any
+ * other status gives it back (but holds it for the same client).
+ * The addresses of the static bindings are never given back.
+ */
+
+void dhcpd4_set_binding_status(binding_list *list, pool_indexes *indexes, address_binding *binding,
+			       int status, uint32_t lease_time)
+{
+    binding->status = status;
+    binding->expiry = dhcpd4_bindings_time() + lease_time;
+    dhcpd4_journal_binding(binding, lease_time);
+
+    if (status == PENDING || status == ASSOCIATED)
+	dhcpd4_timer_add(list, binding);
+    else
+	dhcpd4_timer_remove(list, binding);
+
+    if (binding->is_static)
+	return;
+
+    if (status == PENDING || status == ASSOCIATED)
+	dhcpd4_use_address(indexes, binding->address);
+    else
+	dhcpd4_release_address(indexes, binding->address, 1);
+}
+
+/*
+ * Extend the lease of an ASSOCIATED binding: only its expiry and its
+ * slot in the timer wheel change, its address is already in use.
+ */
+
+void dhcpd4_extend_binding(binding_list *list, address_binding *binding, uint32_t lease_time)
+{
+    binding->expiry = dhcpd4_bindings_time() + lease_time;
+    dhcpd4_timer_add(list, binding);
+    dhcpd4_journal_binding(binding, lease_time);
+}
+
+/*
+ * Give an existing binding to a new client identifier.
+ *
+ * Return 0 on success, -1 if out of memory (the binding is left untouched).
+ */
+
+static int dhcpd4_rekey_binding(binding_list *list, address_binding *binding,
+				uint8_t *cident, uint8_t cident_len)
+{
+    int ret;
+
+    dhcpd4_index_remove(&list->cident_index, binding);
+
+    ret = dhcpd4_set_binding_cident(binding, cident, cident_len);
+
+    // a slot has just been freed, no need to grow the index
+
+    dhcpd4_index_put(&list->cident_index, binding);
+
+    return ret;
 }
 
 /*
@@ -78,13 +817,21 @@ void dhcpd4_update_bindings_statuses(binding_list *list)
 address_binding *dhcpd4_search_binding(binding_list *list, uint8_t *cident, uint8_t cident_len,
 		int is_static, int status)
 {
-    address_binding *binding, *binding_temp;
-	
-    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
+    binding_index *index = &list->cident_index;
+    uint32_t mask = index->size - 1;
+    uint32_t i;
+
+    if (index->size == 0)
+	return NULL;
+
+    // walk the probe sequence up to the first free slot
+
+    for (i = dhcpd4_cident_hash(cident, cident_len) & mask; index->slots[i] != NULL; i = (i + 1) & mask) {
+	address_binding *binding = index->slots[i];
 
 	if((binding->is_static == is_static || is_static == STATIC_OR_DYNAMIC) &&
 	   binding->cident_len == cident_len &&
-	   memcmp(binding->cident, cident, cident_len) == 0) {
+	   memcmp(dhcpd4_binding_cident(binding), cident, cident_len) == 0) {
 
 	    if(status == 0)
 		return binding;
@@ -96,29 +843,96 @@ address_binding *dhcpd4_search_binding(binding_list *list, uint8_t *cident, uint
     return NULL;
 }
 
+/*
+ * Search a binding having the given address.
+ */
+
+address_binding *dhcpd4_search_binding_by_address(binding_list *list, pool_indexes *indexes, uint32_t address)
+{
+    binding_index *index = &list->address_index;
+    uint32_t mask = index->size - 1;
+    uint32_t offset, i;
+
+    if (indexes->bindings != NULL && dhcpd4_pool_offset(indexes, address, &offset) &&
+	indexes->bindings[offset] != NULL)
+	return indexes->bindings[offset];
+
+    if (index->size == 0)
+	return NULL;
+
+    for (i = dhcpd4_address_hash(address) & mask; index->slots[i] != NULL; i = (i + 1) & mask) {
+	if (index->slots[i]->address == address)
+	    return index->slots[i];
+    }
+
+    return NULL;
+}
+
 /*
  * Get an available free address
  *
+ * The search starts from the bitmap word of the last allocation and
+ * goes on a word at a time. If skip_held is true, the addresses still
+ * held by an old binding are not taken.
+ *
  * If a zero address is returned, no more address are available.
  */
 
-static uint32_t dhcpd4_take_free_address(pool_indexes *indexes)
+static uint32_t dhcpd4_take_free_address(pool_indexes *indexes, int skip_held)
 {
-    if(indexes->current <= indexes->last) {
+    uint32_t words = POOL_WORDS(indexes->size);
+    uint32_t n;
+
+    if (indexes->free == 0)
+	return 0;
 
-	uint32_t address = indexes->current;	
-	indexes->current = htonl(ntohl(indexes->current) + 1);
-	return address;
+    for (n = 0; n < words; n++) {
+	uint32_t w = indexes->cursor;
+	uint64_t busy = indexes->used[w] | (skip_held ? indexes->held[w] : 0);
+
+	if (busy != ~0ull) {
+	    uint32_t offset = w * POOL_WORD_BITS + __builtin_ctzll(~busy);
+	    return htonl(ntohl(indexes->first) + offset);
+	}
+
+	indexes->cursor = (w + 1 == words) ? 0 : w + 1;
+    }
+
+    return 0;
+}
 
+/*
+ * Create a dynamic binding for a free address, or take over the old binding
+ * still holding it.
+ */
+
+static address_binding *dhcpd4_bind_free_address(binding_list *list, pool_indexes *indexes, uint32_t address,
+						 uint8_t *cident, uint8_t cident_len)
+{
+    uint32_t offset;
+    address_binding *binding = NULL;
+
+    if (dhcpd4_pool_offset(indexes, address, &offset) &&
+	(POOL_WORD(indexes->held, offset) & POOL_BIT(offset)))
+	binding = dhcpd4_search_binding_by_address(list, indexes, address);
+
+    if (binding != NULL) {
+	if (dhcpd4_rekey_binding(list, binding, cident, cident_len) != 0)
+	    return NULL;
     } else
-	return 0;
+	binding = dhcpd4_add_binding(list, indexes, address, cident, cident_len, DYNAMIC);
+
+    if (binding != NULL)
+	dhcpd4_use_address(indexes, address);
+
+    return binding;
 }
 
 /*
  * Create a new dynamic binding or reuse an expired one.
  *
  * An attemp will be made to assign to the client the requested IP address
- * contained in the address option. An address equals to zero means that no 
+ * contained in the address option. An address equals to zero means that no
  * specific address has been requested.
  *
  * If the dynamic pool of addresses is full a NULL pointer will be returned.
@@ -127,55 +941,25 @@ static uint32_t dhcpd4_take_free_address(pool_indexes *indexes)
 address_binding *dhcpd4_new_dynamic_binding(binding_list *list, pool_indexes *indexes, uint32_t address,
 		     uint8_t *cident, uint8_t cident_len)
 {
-    address_binding *binding, *binding_temp;
-    address_binding *found_binding = NULL;
+    uint32_t offset;
 
-    if (address != 0) {
+    if (address != 0 && dhcpd4_pool_offset(indexes, address, &offset) &&
+	!(POOL_WORD(indexes->used, offset) & POOL_BIT(offset))) {
 
-	LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-	    // search a previous binding using the requested IP address
-
-	    if(binding->address == address) {
-		found_binding = binding;
-		break;
-	    }
-	}
+	// the requested IP address is available (maybe reuse an expired association)
+	return dhcpd4_bind_free_address(list, indexes, address, cident, cident_len);
     }
 
-    if(found_binding != NULL &&
-       !found_binding->is_static &&
-       found_binding->status != PENDING &&
-       found_binding->status != ASSOCIATED) {
-
-	// the requested IP address is available (reuse an expired association)
-	return found_binding;
-	
-    } else {
-
-	/* the requested IP address is already in use, or no address has been
-           requested, or the address requested has never been allocated
-           (we do not support this last case and just return the next
-           available address!). */
+    /* the requested IP address is already in use, or no address has been
+       requested: prefer the addresses never held by other clients. */
 
-	uint32_t address = dhcpd4_take_free_address(indexes);
+    address = dhcpd4_take_free_address(indexes, 1);
 
-	if(address != 0)
-	    return dhcpd4_add_binding(list, address, cident, cident_len, 0);
+    if (address == 0)
+	address = dhcpd4_take_free_address(indexes, 0);
 
-	else { // search any previously assigned address which is expired
-    
-	    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-		if(!binding->is_static &&
-		   found_binding->status != PENDING &&
-		   found_binding->status != ASSOCIATED)
-		    return binding;
-	    }
-
-	    // if executions reach here no more addresses are available
-	    return NULL;
-	}	
-    }
+    if (address == 0) // no more addresses are available
+	return NULL;
 
-    // execution should not reach here...
-    return NULL;
-}
\ No newline at end of file
+    return dhcpd4_bind_free_address(list, indexes, address, cident, cident_len);
+}
@@ -28,53 +28,151 @@ enum {
 };
 
 /*
- * IP address used to delimitate an address pool.
+ * IP address used to delimitate an address pool,
+ * and the allocation state of the addresses of the pool.
+ *
+ * Each address between first and last has a bit in the used bitmap
+ * (taken by a static, pending or associated binding) and a bit in the
+ * held bitmap (still recorded by an expired or released binding, so that
+ * its client can get it back).
  */
 
 struct pool_indexes {
     uint32_t first;    // first address of the pool
     uint32_t last;     // last address of the pool
-    uint32_t current;  // current available address
+
+    uint32_t size;     // number of addresses in the pool
+    uint32_t free;     // number of addresses not used
+    uint32_t cursor;   // bitmap word where the next search starts
+
+    uint64_t *used;    // bitmap of the used addresses
+    uint64_t *held;    // bitmap of the addresses held by old bindings
+
+    struct address_binding **bindings; // bindings by address offset (NULL if the pool is sparse)
 };
 
 typedef struct pool_indexes pool_indexes;
 
 /*
- * The bindings are organized as a double linked list
- * using the standard queue(3) library
+ * The bindings are compact records allocated from a memory slab.
+ *
+ * A client identifier up to BINDING_CIDENT_INLINE bytes (a MAC address)
+ * is kept in the record, a longer one is allocated apart.
+ *
+ * Each binding is linked, using the standard queue(3) library, either in
+ * a slot of the expiry timer wheel (if scheduled) or in the idle list.
  */
 
+#define BINDING_CIDENT_INLINE 6
+
+union binding_cident {
+    uint8_t data[BINDING_CIDENT_INLINE]; // client identifier, if not longer than BINDING_CIDENT_INLINE
+    uint8_t *spill;                      // client identifier allocated apart, if longer
+} __attribute__((packed));
+
 struct address_binding {
-    uint32_t address;     // address
-    uint8_t cident_len;   // client identifier len
-    uint8_t cident[256];  // client identifier
-    
-    time_t binding_time;  // time of binding
-    time_t lease_time;    // duration of lease
+    uint32_t address;       // address
+    uint32_t expiry;        // end of the lease (bindings time, in seconds)
 
-    int status;           // binding status
-    int is_static;        // check if it is a static binding
+    uint8_t cident_len;     // client identifier len
+    uint8_t status : 3;     // binding status
+    uint8_t is_static : 1;  // check if it is a static binding
+    uint8_t scheduled : 1;  // linked in the timer wheel
+    union binding_cident cident; // client identifier
 
-    LIST_ENTRY(address_binding) pointers; // list pointers, see queue(3)
+    LIST_ENTRY(address_binding) link; // timer wheel slot or idle list pointers, see queue(3)
 };
 
 typedef struct address_binding address_binding;
 
-typedef LIST_HEAD(binding_list_, address_binding) BINDING_LIST_HEAD;
+/*
+ * Get the client identifier of a binding.
+ */
+
+static inline const uint8_t *dhcpd4_binding_cident(const address_binding *binding)
+{
+    return binding->cident_len > BINDING_CIDENT_INLINE ? binding->cident.spill : binding->cident.data;
+}
+
+typedef LIST_HEAD(binding_list_head_, address_binding) BINDING_LIST_HEAD;
+
+/*
+ * Open addressing (linear probing) hash index over the bindings.
+ *
+ * The hash of the key of a binding is computed again when needed,
+ * so each slot is just a pointer.
+ */
+
+struct binding_index {
+    uint32_t size;              // number of slots, power of two (0 if not allocated)
+    uint32_t count;             // number of used slots
+    uint32_t (*hash)(const address_binding *binding); // hash of the key of a binding
+    address_binding **slots;    // slots array, NULL if the slot is free
+};
+
+typedef struct binding_index binding_index;
+
+/*
+ * Hierarchical timer wheel of the expiries of the pending and
+ * associated bindings, with a resolution of one second.
+ *
+ * Each level has 64 slots, and a slot of a level spans the time of
+ * all the slots of the previous level: the wheel covers 2^24 seconds.
+ */
+
+#define BINDING_TIMER_LEVELS 4
+#define BINDING_TIMER_BITS   6
+#define BINDING_TIMER_SLOTS  (1 << BINDING_TIMER_BITS)
+
+struct binding_timer {
+    uint32_t base;   // next second to run
+    uint32_t count;  // number of scheduled bindings
+    BINDING_LIST_HEAD slots[BINDING_TIMER_LEVELS][BINDING_TIMER_SLOTS];
+};
+
+typedef struct binding_timer binding_timer;
+
+/*
+ * The database of the bindings: the bindings not scheduled
+ * in the timer wheel and the indexes to search them quickly.
+ *
+ * The bindings of a dense pool are indexed by address in the
+ * pool_indexes array, all the others in the address hash index.
+ */
+
+struct binding_list_ {
+    BINDING_LIST_HEAD idle;       // bindings not in the timer wheel, see queue(3)
+    binding_index cident_index;   // bindings by (cident_len, cident)
+    binding_index address_index;  // bindings by address
+    binding_timer timer;          // expiries of the bindings
+};
+
 typedef struct binding_list_ binding_list;
-						 
+
 /*
  * Prototypes
  */
 
 void dhcpd4_init_binding_list(binding_list *list);
+void dhcpd4_delete_binding_list(binding_list *list);
+void dhcpd4_foreach_binding(binding_list *list, void (*f)(address_binding *binding, void *arg), void *arg);
+uint32_t dhcpd4_cident_hash(const uint8_t *cident, uint8_t cident_len);
+
+int dhcpd4_init_pool_indexes(pool_indexes *indexes, binding_list *list);
+void dhcpd4_delete_pool_indexes(pool_indexes *indexes);
+void dhcpd4_reserve_address(pool_indexes *indexes, uint32_t address);
 
-address_binding *dhcpd4_add_binding(binding_list *list, uint32_t address, uint8_t *cident, uint8_t cident_len, int is_static);
-void dhcpd4_remove_binding (address_binding *binding); //TODO
+address_binding *dhcpd4_add_binding(binding_list *list, pool_indexes *indexes, uint32_t address, uint8_t *cident, uint8_t cident_len, int is_static);
+void dhcpd4_remove_binding(binding_list *list, pool_indexes *indexes, address_binding *binding);
+void dhcpd4_set_binding_status(binding_list *list, pool_indexes *indexes, address_binding *binding, int status, uint32_t lease_time);
+void dhcpd4_extend_binding(binding_list *list, address_binding *binding, uint32_t lease_time);
 
-void dhcpd4_update_bindings_statuses(binding_list *list);
+uint32_t dhcpd4_bindings_time(void);
+void dhcpd4_run_bindings_timer(binding_list *list, pool_indexes *indexes);
+int dhcpd4_bindings_timer_timeout(binding_list *list);
 
 address_binding *dhcpd4_search_binding(binding_list *list, uint8_t *cident, uint8_t cident_len, int is_static, int status);
+address_binding *dhcpd4_search_binding_by_address(binding_list *list, pool_indexes *indexes, uint32_t address);
 address_binding *dhcpd4_new_dynamic_binding(binding_list *list, pool_indexes *indexes, uint32_t address, uint8_t *cident, uint8_t cident_len);
 
 #endif
\ No newline at end of file
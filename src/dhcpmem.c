@@ -6,11 +6,11 @@
  *
  */
 #include <string.h>
-#include <zephyr/kernel.h>
-#include <zephyr/device.h>
-#include <zephyr/devicetree.h>
+#include "platform.h"
 
 #include "dhcpmem.h"
+#include "options.h"
+#include "bindings.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic error "-Wall"
@@ -19,18 +19,118 @@
 #pragma GCC diagnostic error "-Wint-conversion"
 #pragma GCC diagnostic error "-Wincompatible-pointer-types"
 
-#define DHCP4_SERVER_BUFFER_SIZE (4096u*2u)
+#define DHCP4_SERVER_BUFFER_SIZE CONFIG_DHCPD_HEAP_SIZE
 
 static K_HEAP_DEFINE(dhcp4_server_mem_buffer, DHCP4_SERVER_BUFFER_SIZE);
-static K_MUTEX_DEFINE(dhcp4_server_mem_mutex);
+
+/*
+ * Size classes. A block is given back to its slab by its address.
+ *
+ * The slabs and the heap have their own spinlock: an allocation takes
+ * a constant time (except from the heap) and never sleeps.
+ */
+
+#define DHCPD4_MEM_BLOCK_SIZE(size) ROUND_UP(size, sizeof(void *))
+
+K_MEM_SLAB_DEFINE_STATIC(dhcpd4_scratch_slab, DHCPD4_MEM_BLOCK_SIZE(CONFIG_DHCPD_MEM_SCRATCH_SIZE),
+			 CONFIG_DHCPD_MEM_SCRATCH_BLOCKS, sizeof(void *));
+K_MEM_SLAB_DEFINE_STATIC(dhcpd4_option_slab, DHCPD4_MEM_BLOCK_SIZE(sizeof(dhcp_option)),
+			 CONFIG_DHCPD_MEM_OPTION_BLOCKS, sizeof(void *));
+K_MEM_SLAB_DEFINE_STATIC(dhcpd4_binding_slab, DHCPD4_MEM_BLOCK_SIZE(sizeof(address_binding)),
+			 CONFIG_DHCPD_MAX_BINDINGS, sizeof(void *));
+
+struct dhcpd4_mem_class {
+	struct k_mem_slab *slab; // NULL for the heap
+	size_t block_size;
+	uint32_t blocks;
+	atomic_t used;
+	atomic_t high;
+	atomic_t failures;
+};
+
+static struct dhcpd4_mem_class dhcpd4_mem_classes[DHCPD4_MEM_CLASSES] = {
+	[DHCPD4_MEM_SCRATCH] = {
+		.slab = &dhcpd4_scratch_slab,
+		.block_size = DHCPD4_MEM_BLOCK_SIZE(CONFIG_DHCPD_MEM_SCRATCH_SIZE),
+		.blocks = CONFIG_DHCPD_MEM_SCRATCH_BLOCKS,
+	},
+	[DHCPD4_MEM_OPTION] = {
+		.slab = &dhcpd4_option_slab,
+		.block_size = DHCPD4_MEM_BLOCK_SIZE(sizeof(dhcp_option)),
+		.blocks = CONFIG_DHCPD_MEM_OPTION_BLOCKS,
+	},
+	[DHCPD4_MEM_BINDING] = {
+		.slab = &dhcpd4_binding_slab,
+		.block_size = DHCPD4_MEM_BLOCK_SIZE(sizeof(address_binding)),
+		.blocks = CONFIG_DHCPD_MAX_BINDINGS,
+	},
+	[DHCPD4_MEM_HEAP] = {
+		.slab = NULL,
+		.block_size = 0,
+		.blocks = DHCP4_SERVER_BUFFER_SIZE,
+	},
+};
+
+/*
+ * Count a block taken from a class, and its high-water mark.
+ */
+
+static void *dhcpd4_mem_taken(struct dhcpd4_mem_class *class, void *block)
+{
+	atomic_val_t used, high;
+
+	if (block == NULL) {
+		atomic_inc(&class->failures);
+		return NULL;
+	}
+
+	used = atomic_inc(&class->used) + 1;
+
+	do {
+		high = atomic_get(&class->high);
+	} while (used > high && !atomic_cas(&class->high, high, used));
+
+	return block;
+}
+
+/*
+ * Take a block from the slab of a class.
+ *
+ * Return NULL if the slab is empty.
+ */
+
+void *dhcpd4_mem_alloc(int class)
+{
+	struct dhcpd4_mem_class *c = &dhcpd4_mem_classes[class];
+	void *block;
+
+	if (k_mem_slab_alloc(c->slab, &block, K_NO_WAIT) != 0)
+		block = NULL;
+
+	return dhcpd4_mem_taken(c, block);
+}
 
 void *dhcpd4_malloc(size_t size){
-	k_mutex_lock(&dhcp4_server_mem_mutex, K_FOREVER);
-	void * buffer = k_heap_alloc(&dhcp4_server_mem_buffer, size, K_NO_WAIT);
+	void *buffer = NULL;
+	int class;
+
+	// the smallest class holding the block, the heap if none or if empty
+
+	for (class = 0; class < DHCPD4_MEM_BINDING; class++) {
+		if (size <= dhcpd4_mem_classes[class].block_size) {
+			buffer = dhcpd4_mem_alloc(class);
+			break;
+		}
+	}
+
+	if (buffer == NULL) {
+		buffer = dhcpd4_mem_taken(&dhcpd4_mem_classes[DHCPD4_MEM_HEAP],
+					  k_heap_alloc(&dhcp4_server_mem_buffer, size, K_NO_WAIT));
+	}
+
 	if (!buffer) {
 		printk("out of memory dhcpd4_malloc");
 	}
-	k_mutex_unlock(&dhcp4_server_mem_mutex);
 	return buffer;
 }
 
@@ -41,17 +141,47 @@ void *dhcpd4_calloc(size_t nmemb, size_t size)
 
 	if (ret != NULL) {
 		(void)memset(ret, 0, size);
-	} else {
-		printk("out of memory dhcpd4_calloc");
 	}
 	return ret;
 }
 
 void _dhcpd4_free(void * ptr) {
-	if (ptr) {
-		k_mutex_lock(&dhcp4_server_mem_mutex, K_FOREVER);
-		k_heap_free(&dhcp4_server_mem_buffer, ptr);
-		k_mutex_unlock(&dhcp4_server_mem_mutex);
+	struct dhcpd4_mem_class *c;
+
+	if (!ptr) {
+		return;
+	}
+
+	for (c = dhcpd4_mem_classes; c->slab != NULL; c++) {
+		char *buffer = c->slab->buffer;
+
+		if ((char *)ptr >= buffer && (char *)ptr < buffer + c->blocks * c->block_size) {
+			k_mem_slab_free(c->slab, ptr);
+			atomic_dec(&c->used);
+			return;
+		}
+	}
+
+	k_heap_free(&dhcp4_server_mem_buffer, ptr);
+	atomic_dec(&c->used);
+}
+
+/*
+ * Get the usage of each size class.
+ */
+
+void dhcpd4_get_mem_stats(struct dhcpd4_mem_stats stats[DHCPD4_MEM_CLASSES])
+{
+	int i;
+
+	for (i = 0; i < DHCPD4_MEM_CLASSES; i++) {
+		struct dhcpd4_mem_class *c = &dhcpd4_mem_classes[i];
+
+		stats[i].block_size = c->block_size;
+		stats[i].blocks = c->blocks;
+		stats[i].used = atomic_get(&c->used);
+		stats[i].high = atomic_get(&c->high);
+		stats[i].failures = atomic_get(&c->failures);
 	}
 }
 
@@ -8,8 +8,32 @@
 #ifndef ZEPHYR_DHCPMEM_H
 #define ZEPHYR_DHCPMEM_H
 #include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Size classes of the allocator: memory slabs of fixed size blocks,
+ * the heap being used for the larger blocks and when a slab is empty.
+ */
+
+enum {
+	DHCPD4_MEM_SCRATCH = 0, // small buffers: client identifiers, option values, strings
+	DHCPD4_MEM_OPTION,      // option records (dhcp_option)
+	DHCPD4_MEM_BINDING,     // binding records (address_binding), never taken from the heap
+	DHCPD4_MEM_HEAP,        // the heap
+	DHCPD4_MEM_CLASSES
+};
+
+struct dhcpd4_mem_stats {
+	uint32_t block_size; // size of a block (0 for the heap)
+	uint32_t blocks;     // number of blocks (size of the heap in bytes)
+	uint32_t used;       // blocks in use (allocations, for the heap)
+	uint32_t high;       // highest number of blocks in use
+	uint32_t failures;   // allocations failed (or taken from the heap)
+};
 
 void *dhcpd4_malloc(size_t size);
+void *dhcpd4_mem_alloc(int class);
+void dhcpd4_get_mem_stats(struct dhcpd4_mem_stats stats[DHCPD4_MEM_CLASSES]);
 void *dhcpd4_calloc(size_t nmemb, size_t size);
 
 #define dhcpd4_free(buffer) \
@@ -11,9 +11,11 @@ LOG_MODULE_REGISTER(dhcp4server, LOG_LEVEL_DBG);
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <zephyr/net/net_if.h>
 #include "dhcpserver.h"
+#include "engine.h"
 #include "bindings.h"
 #include "args.h"
 #include "dhcp.h"
@@ -22,6 +24,13 @@ LOG_MODULE_REGISTER(dhcp4server, LOG_LEVEL_DBG);
 #include "arpa/inet.h"
 #include "zephyr/net/ethernet.h"
 #include "dhcpmem.h"
+#include "prefixes.h"
+#include "journal.h"
+#include "stats.h"
+#include "events.h"
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+#include "snapshot.h"
+#endif
 #include <zephyr/net/net_core.h>
 #include <zephyr/net/net_pkt.h>
 #include <zephyr/net/net_if.h>
@@ -30,6 +39,67 @@ LOG_MODULE_REGISTER(dhcp4server, LOG_LEVEL_DBG);
 #define DHCPV4_SERVER_PORT	67
 #define DHCPV4_CLIENT_PORT	68
 
+#define DHCPD4_IPV4_HDR_SIZE		20
+
+#define DHCPD4_BROADCAST_FLAG		0x8000
+
+#define DHCPD4_TASK_PRIO              21u
+// stack of the server thread and of each worker, the requests being
+// in static buffers (dhcpd4_msg, dhcpd4_rx_slab): see DHCPD_STACK_SIZE
+#define DHCPD4_TASK_STK_SIZE         CONFIG_DHCPD_STACK_SIZE
+
+/*
+ * Events of the control channel of the server.
+ */
+
+enum {
+    DHCPD4_EVENT_STOP     = 's', // stop the server
+    DHCPD4_EVENT_RELOAD   = 'r', // compile again the pool options
+    DHCPD4_EVENT_TIMER    = 't', // run the bindings timer
+    DHCPD4_EVENT_SNAPSHOT = 'p', // append the bindings to the lease snapshot
+};
+
+/*
+ * IP and UDP headers of a reply.
+ */
+
+struct dhcpd4_ip_udp_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t len;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t proto;
+    uint16_t chksum;
+    uint32_t src;
+    uint32_t dst;
+
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t udp_len;
+    uint16_t udp_chksum;
+} __attribute__((packed));
+
+/*
+ * Headers of the replies sent on an interface, with the
+ * checksum of the fields that do not change.
+ */
+
+struct dhcpd4_reply_template {
+    struct net_if *iface;
+    int ifindex;
+    struct dhcpd4_ip_udp_hdr hdr; // source address being the server id on the interface
+    uint32_t sum;
+};
+
+/*
+ * Interfaces served, read only while the server runs.
+ */
+
+static struct dhcpd4_reply_template dhcpd4_interfaces[CONFIG_DHCPD_MAX_INTERFACES];
+static int dhcpd4_interface_count;
+
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic error "-Wall"
@@ -38,512 +108,1472 @@ LOG_MODULE_REGISTER(dhcp4server, LOG_LEVEL_DBG);
 #pragma GCC diagnostic error "-Wint-conversion"
 #pragma GCC diagnostic error "-Wincompatible-pointer-types"
 
-extern int net_ipv4_create(struct net_pkt *pkt,
-		    const struct in_addr *src,
-		    const struct in_addr *dst);
+/*
+ * Packets of the replies, reserved for the server.
+ */
+
+NET_PKT_SLAB_DEFINE(dhcpd4_reply_pkts, CONFIG_DHCPD_REPLY_PKT_COUNT);
+NET_BUF_POOL_FIXED_DEFINE(dhcpd4_reply_bufs, CONFIG_DHCPD_REPLY_PKT_COUNT,
+			  sizeof(struct dhcpd4_ip_udp_hdr) + sizeof(dhcpd_message),
+			  CONFIG_NET_BUF_USER_DATA_SIZE, NULL);
+
+/*
+ * Replies by destination, and replies dropped.
+ */
+
+enum {
+    DHCPD4_REPLY_BROADCAST,
+    DHCPD4_REPLY_UNICAST,
+    DHCPD4_REPLY_RELAYED,
+    DHCPD4_REPLY_DROPPED,
+    DHCPD4_REPLY_COUNTERS
+};
+
+static atomic_t dhcpd4_reply_counters[DHCPD4_REPLY_COUNTERS];
+
+void dhcpd4_get_reply_counters(struct dhcpd4_reply_counters *counters)
+{
+    counters->broadcast = atomic_get(&dhcpd4_reply_counters[DHCPD4_REPLY_BROADCAST]);
+    counters->unicast = atomic_get(&dhcpd4_reply_counters[DHCPD4_REPLY_UNICAST]);
+    counters->relayed = atomic_get(&dhcpd4_reply_counters[DHCPD4_REPLY_RELAYED]);
+    counters->dropped = atomic_get(&dhcpd4_reply_counters[DHCPD4_REPLY_DROPPED]);
+}
+
+/*
+ * One's complement sum of 16 bits words, as stored in memory.
+ */
+
+static uint32_t dhcpd4_sum16(const void *data, size_t len, uint32_t sum)
+{
+    const uint8_t *p = data;
+    uint16_t word;
+
+    for (; len > 1; len -= 2, p += 2) {
+	memcpy(&word, p, sizeof(word));
+	sum += word;
+    }
+
+    return sum;
+}
+
+static uint16_t dhcpd4_fold16(uint32_t sum)
+{
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum;
+}
+
+/*
+ * Build the IP/UDP header template of the replies sent on an interface.
+ */
+
+static void dhcpd4_init_reply_template(struct dhcpd4_reply_template *tmpl, struct net_if *iface)
+{
+    memset(tmpl, 0, sizeof(*tmpl));
+
+    tmpl->iface = iface;
+    tmpl->ifindex = net_if_get_by_iface(iface);
+
+    tmpl->hdr.vhl = 0x45; // IPv4, 20 bytes header
+    tmpl->hdr.ttl = 0xFF;
+    tmpl->hdr.proto = IPPROTO_UDP;
+    tmpl->hdr.src = iface->config.ip.ipv4->unicast[0].address.in_addr.s_addr;
+
+    tmpl->hdr.src_port = htons(DHCPV4_SERVER_PORT);
+    tmpl->hdr.dst_port = htons(DHCPV4_CLIENT_PORT);
+
+    // the fields patched for each reply are still zero
+
+    tmpl->sum = dhcpd4_sum16(&tmpl->hdr, DHCPD4_IPV4_HDR_SIZE, 0);
+}
+
+/*
+ * Serve an interface, if not already served.
+ *
+ * Return 0 on success, -1 if the interface has no IPv4 address
+ * or if too many interfaces are served.
+ */
+
+static int dhcpd4_add_interface(struct net_if *iface)
+{
+    int i;
+
+    for (i = 0; i < dhcpd4_interface_count; i++) {
+	if (dhcpd4_interfaces[i].iface == iface)
+	    return 0;
+    }
+
+    if (iface->config.ip.ipv4 == NULL || !iface->config.ip.ipv4->unicast[0].is_used) {
+	LOG_ERR("No IPv4 address on interface %d", net_if_get_by_iface(iface));
+	return -1;
+    }
+
+    if (dhcpd4_interface_count == CONFIG_DHCPD_MAX_INTERFACES) {
+	LOG_ERR("More than %d interfaces", CONFIG_DHCPD_MAX_INTERFACES);
+	return -1;
+    }
+
+    dhcpd4_init_reply_template(&dhcpd4_interfaces[dhcpd4_interface_count++], iface);
+
+    return 0;
+}
+
+/*
+ * Get the interface served of an interface index.
+ *
+ * Return NULL if the interface is not served.
+ */
+
+static struct dhcpd4_reply_template *dhcpd4_search_interface(int ifindex)
+{
+    int i;
+
+    for (i = 0; i < dhcpd4_interface_count; i++) {
+	if (dhcpd4_interfaces[i].ifindex == ifindex)
+	    return &dhcpd4_interfaces[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the packet of a reply from the header template of its interface,
+ * patching only the lengths, the destination and the IP checksum.
+ *
+ * The UDP checksum is not computed (zero is allowed over IPv4).
+ *
+ * Return NULL if no reply packet is available: the reply is dropped,
+ * the server never waits for the network buffers.
+ */
+
+static struct net_pkt *dhcpd4_create_message(struct dhcpd4_reply_template *tmpl,
+					     uint32_t dst,
+					     uint16_t dst_port,
+					     uint8_t * data,
+					     size_t size)
+{
+    struct dhcpd4_ip_udp_hdr hdr = tmpl->hdr;
+    struct net_pkt *pkt;
+    struct net_buf *buf;
+
+    pkt = net_pkt_alloc_from_slab(&dhcpd4_reply_pkts, K_NO_WAIT);
+
+    if (!pkt)
+	goto drop;
+
+    buf = net_buf_alloc_len(&dhcpd4_reply_bufs, sizeof(hdr) + size, K_NO_WAIT);
+
+    if (!buf) {
+	net_pkt_unref(pkt);
+	goto drop;
+    }
+
+    net_pkt_append_buffer(pkt, buf);
+
+    net_pkt_set_iface(pkt, tmpl->iface);
+    net_pkt_set_family(pkt, AF_INET);
+    net_pkt_set_ip_hdr_len(pkt, DHCPD4_IPV4_HDR_SIZE);
+    net_pkt_set_ipv4_ttl(pkt, hdr.ttl);
+
+    hdr.len = htons(sizeof(hdr) + size);
+    hdr.dst = dst;
+    hdr.chksum = ~dhcpd4_fold16(dhcpd4_sum16(&hdr.dst, sizeof(hdr.dst),
+					      tmpl->sum + hdr.len));
+    hdr.dst_port = dst_port;
+    hdr.udp_len = htons(sizeof(hdr) - DHCPD4_IPV4_HDR_SIZE + size);
+
+    net_pkt_cursor_init(pkt);
+
+    if (net_pkt_write(pkt, &hdr, sizeof(hdr)) ||
+	net_pkt_write(pkt, data, size)) {
+	LOG_ERR("Message creation failed");
+	net_pkt_unref(pkt);
+	return NULL;
+    }
+
+    net_pkt_cursor_init(pkt);
+
+    return pkt;
+
+drop:
+    LOG_WRN("Reply dropped, no packet available (%u drops)",
+	    (unsigned)atomic_inc(&dhcpd4_reply_counters[DHCPD4_REPLY_DROPPED]) + 1);
+    dhcpd4_count(DHCPD4_STAT_DROP_PACKET);
+
+    return NULL;
+}
+
+/*
+ * Network related routines
+ */
+
+#if defined(CONFIG_NET_ARP)
+extern void net_arp_update(struct net_if *iface, struct in_addr *src,
+			   struct net_eth_addr *hwaddr, bool gratuitous, bool force);
+#endif
+
+/*
+ * Record the hardware address of the client of a reply in the ARP
+ * cache, so that the reply can be sent to an address not configured
+ * yet by the client.
+ *
+ * Return false if not possible (the reply must be broadcast).
+ */
+
+static bool dhcpd4_seed_arp(struct dhcpd4_reply_template *tmpl, dhcpd_msg *msg)
+{
+#if defined(CONFIG_NET_ARP)
+    struct in_addr yiaddr = { .s_addr = msg->hdr.yiaddr };
+
+    if (msg->hdr.htype != ETHERNET || msg->hdr.hlen != ETHERNET_LEN)
+	return false;
+
+    net_arp_update(tmpl->iface, &yiaddr, (struct net_eth_addr *)msg->hdr.chaddr, false, true);
+
+    return true;
+#else
+    ARG_UNUSED(tmpl);
+    ARG_UNUSED(msg);
+
+    return false;
+#endif
+}
+
+/*
+ * Select the destination of a reply (RFC 2131 4.1):
+ *
+ * - through the relay agent at giaddr (on the server port), a NAK
+ *   having the broadcast flag set;
+ * - else unicast to ciaddr, set by a client having an address;
+ * - else broadcast if asked by the client, or for a NAK;
+ * - else unicast to yiaddr, at chaddr.
+ */
+
+static uint32_t dhcpd4_reply_destination(struct dhcpd4_reply_template *tmpl, dhcpd_msg *msg,
+					 uint8_t type, uint16_t *port)
+{
+    *port = htons(DHCPV4_CLIENT_PORT);
+
+    if (msg->hdr.giaddr != 0) {
+	if (type == DHCP_NAK)
+	    msg->hdr.flags |= htons(DHCPD4_BROADCAST_FLAG);
+
+	*port = htons(DHCPV4_SERVER_PORT);
+	atomic_inc(&dhcpd4_reply_counters[DHCPD4_REPLY_RELAYED]);
+	return msg->hdr.giaddr;
+    }
+
+    if (type != DHCP_NAK) {
+	if (msg->hdr.ciaddr != 0) {
+	    atomic_inc(&dhcpd4_reply_counters[DHCPD4_REPLY_UNICAST]);
+	    return msg->hdr.ciaddr;
+	}
+
+	if (!(msg->hdr.flags & htons(DHCPD4_BROADCAST_FLAG)) && msg->hdr.yiaddr != 0 &&
+	    dhcpd4_seed_arp(tmpl, msg)) {
+	    atomic_inc(&dhcpd4_reply_counters[DHCPD4_REPLY_UNICAST]);
+	    return msg->hdr.yiaddr;
+	}
+    }
+
+    atomic_inc(&dhcpd4_reply_counters[DHCPD4_REPLY_BROADCAST]);
+    return htonl(INADDR_BROADCAST);
+}
+
+/*
+ * Create the packet of the reply built in msg, sent on the interface
+ * of the request.
+ *
+ * Return NULL on error or if the reply has been dropped.
+ */
+
+static struct net_pkt *dhcpd4_create_dhcp_reply(dhcpd_msg *msg, uint8_t type)
+{
+
+    size_t len;
+    uint32_t dst;
+    uint16_t port;
+
+    len = DHCP_HEADER_SIZE + msg->opts_len;
+
+    dst = dhcpd4_reply_destination(msg->tmpl, msg, type, &port);
+    return dhcpd4_create_message(msg->tmpl, dst, port, (uint8_t *)&msg->hdr, len);
+}
+
+/*
+ * Send the reply packets created for a batch of requests, back to back.
+ */
+
+static void dhcpd4_send_dhcp_replies(struct net_pkt **pkts, const uint32_t *starts, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (net_send_data(pkts[i]) < 0) {
+            LOG_ERR("Reply not sent");
+            net_pkt_unref(pkts[i]);
+            continue;
+        }
+
+        dhcpd4_count_latency(starts[i]);
+    }
+}
+
+#if defined(CONFIG_DHCPD_JOURNAL)
+
+/*
+ * State of the restore of the leases: the snapshot, if any,
+ * then the journal records written after it.
+ */
+
+struct dhcpd4_restore {
+    int restored;   // lease records applied
+    bool snapshot;  // a snapshot was restored
+    uint32_t seq;   // first journal record not applied to the snapshot
+    uint32_t next;  // sequence number after the last journal record
+};
+
+/*
+ * Apply a lease record to the pool of its address.
+ *
+ * The lease time left is counted again from the start of the server,
+ * the time spent before the reboot being unknown.
+ */
+
+static void dhcpd4_restore_lease(const dhcpd4_lease_record *record, void *arg)
+{
+    struct dhcpd4_restore *restore = arg;
+    int n = dhcpd4_lookup_pool(record->address);
+    address_pool *pool;
+    address_binding *binding, *other;
+
+    if (n < 0)
+	return;
+
+    pool = dhcpd4_pools[n];
+
+    if (ntohl(record->address) < ntohl(pool->indexes.first) ||
+	ntohl(record->address) > ntohl(pool->indexes.last))
+	return; // not in the pool any more
+
+    binding = dhcpd4_search_binding_by_address(&pool->bindings, &pool->indexes, record->address);
+
+    if (binding != NULL && binding->is_static)
+	return;
+
+    if (binding != NULL && (binding->cident_len != record->cident_len ||
+			    memcmp(dhcpd4_binding_cident(binding), record->cident, record->cident_len) != 0)) {
+	dhcpd4_remove_binding(&pool->bindings, &pool->indexes, binding); // address taken over
+	binding = NULL;
+    }
+
+    if (record->status != ASSOCIATED) {
+	if (binding != NULL && record->status == B_EMPTY)
+	    dhcpd4_remove_binding(&pool->bindings, &pool->indexes, binding);
+	else if (binding != NULL)
+	    dhcpd4_set_binding_status(&pool->bindings, &pool->indexes, binding, record->status, 0);
+	return;
+    }
+
+    other = dhcpd4_search_binding(&pool->bindings, (uint8_t *)record->cident, record->cident_len, DYNAMIC, 0);
+
+    if (other != NULL && other != binding) // the client moved to another address
+	dhcpd4_remove_binding(&pool->bindings, &pool->indexes, other);
+
+    if (binding == NULL)
+	binding = dhcpd4_add_binding(&pool->bindings, &pool->indexes, record->address,
+				     (uint8_t *)record->cident, record->cident_len, DYNAMIC);
+
+    if (binding == NULL) {
+	LOG_ERR("Lease of %s not restored", str_ip(record->address));
+	return;
+    }
+
+    dhcpd4_set_binding_status(&pool->bindings, &pool->indexes, binding, ASSOCIATED, record->lease);
+    restore->restored++;
+}
+
+/*
+ * Apply a record of the journal, unless written before the snapshot.
+ */
+
+static void dhcpd4_replay_lease(const dhcpd4_lease_record *record, void *arg)
+{
+    struct dhcpd4_restore *restore = arg;
+
+    if (restore->snapshot && (int32_t)(record->seq - restore->seq) < 0)
+	return; // already applied to the snapshot
+
+    if ((int32_t)(record->seq + 1 - restore->next) > 0)
+	restore->next = record->seq + 1;
+
+    dhcpd4_restore_lease(record, arg);
+}
+
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+
+static int64_t dhcpd4_snapshot_deadline = -1; // next periodic snapshot, -1 if none
+
+/*
+ * Write a snapshot of the bindings of the pools.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_snapshot_pools(void)
+{
+    int i;
+
+    if (dhcpd4_snapshot_begin(dhcpd4_journal_get_seq()) != 0)
+	return -1;
+
+    for (i = 0; i < dhcpd4_pool_count; i++)
+	dhcpd4_snapshot_append_list(&dhcpd4_pools[i]->bindings);
+
+    return dhcpd4_snapshot_end();
+}
+
+#endif
+
+/*
+ * Restore the leases in the pools, before their indexes are built:
+ * the last snapshot first, then the journal records written after it.
+ * The journal is then compacted: to a new snapshot if the snapshot
+ * partition is available, to the leases still associated otherwise.
+ */
+
+static void dhcpd4_restore_leases(void)
+{
+    struct dhcpd4_restore restore = { .restored = 0, .snapshot = false, .seq = 0, .next = 0 };
+    bool written = true;
+    int i;
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+    bool snapshot;
+#endif
+
+    if (dhcpd4_journal_init() != 0)
+	return;
+
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+    snapshot = dhcpd4_snapshot_init() == 0;
+    dhcpd4_snapshot_deadline = -1;
+
+    if (snapshot && dhcpd4_snapshot_restore(dhcpd4_restore_lease, &restore, &restore.seq) >= 0) {
+	restore.snapshot = true;
+	restore.next = restore.seq;
+    }
+#endif
+
+    if (dhcpd4_journal_replay(dhcpd4_replay_lease, &restore) != 0)
+	LOG_ERR("Lease journal not read, leases lost");
+
+    dhcpd4_journal_set_seq(restore.next);
+
+    LOG_INF("%d lease records restored", restore.restored);
+
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+    if (snapshot) {
+	if (dhcpd4_snapshot_pools() != 0 || dhcpd4_journal_clear() != 0)
+	    LOG_ERR("Lease journal not compacted");
+
+	dhcpd4_snapshot_deadline = k_uptime_get() + CONFIG_DHCPD_SNAPSHOT_INTERVAL * MSEC_PER_SEC;
+	return;
+    }
+#endif
+
+    // the leases written after the older records, dropped only then
+
+    dhcpd4_journal_compact_begin();
+
+    for (i = 0; i < dhcpd4_pool_count; i++) {
+	if (dhcpd4_journal_append_list(&dhcpd4_pools[i]->bindings) != 0) {
+	    LOG_ERR("Leases of subnet %s not written to the journal", str_ip(dhcpd4_pools[i]->subnet));
+	    written = false;
+	}
+    }
+
+    if (dhcpd4_journal_compact_end(written) != 0)
+	LOG_ERR("Lease journal not compacted");
+}
+
+#endif
+
+/*
+ * Serve a request received in msg (see dhcpd4_serve_message()),
+ * and create the packet of its reply.
+ *
+ * Return the reply packet, or NULL if there is no reply.
+ */
+
+static struct net_pkt *dhcpd4_serve_request(struct dhcpd4_shard *shards, dhcpd_msg *msg, size_t len,
+					     struct sockaddr_in *client_sock)
+{
+    struct net_pkt *pkt;
+    uint8_t type = dhcpd4_serve_message(shards, msg, len, client_sock);
+
+    if (type == 0)
+	return NULL;
+
+    if ((pkt = dhcpd4_create_dhcp_reply(msg, type)) != NULL)
+	dhcpd4_count(type == DHCP_OFFER ? DHCPD4_STAT_TX_OFFER :
+		     type == DHCP_NAK ? DHCPD4_STAT_TX_NAK : DHCPD4_STAT_TX_ACK);
+
+    return pkt;
+}
+
+/*
+ * Serve the interfaces of the pools: the interface of the server,
+ * and the interfaces set with the device index of the other pools.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_init_interfaces(void)
+{
+    struct net_if *iface;
+    int i;
+
+    dhcpd4_interface_count = 0;
+
+    for (i = 0; i < dhcpd4_pool_count; i++) {
+	if (dhcpd4_pools[i]->device_index <= 0)
+	    continue; // pool of relayed requests only
+
+	if ((iface = net_if_get_by_index(dhcpd4_pools[i]->device_index)) == NULL) {
+	    LOG_ERR("Invalid interface index %d", dhcpd4_pools[i]->device_index);
+	    return -1;
+	}
+
+	if (dhcpd4_add_interface(iface) != 0)
+	    return -1;
+    }
+
+    return dhcpd4_interface_count > 0 ? 0 : -1;
+}
+
+/*
+ * Receive a queued request, without waiting, with the interface
+ * served it was received on (msg->tmpl, NULL if not served) and
+ * whether it was broadcast (msg->broadcast).
+ *
+ * Return its length, or -1 if no request is queued.
+ */
+
+static ssize_t dhcpd4_receive_datagram(int s, dhcpd_msg *msg, struct sockaddr_in *client_sock)
+{
+    union {
+	struct cmsghdr hdr;
+	uint8_t buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    } control;
+    struct iovec iov = { .iov_base = &msg->hdr, .iov_len = sizeof(msg->hdr) };
+    struct msghdr mh = {
+	.msg_name = client_sock,
+	.msg_namelen = sizeof(*client_sock),
+	.msg_iov = &iov,
+	.msg_iovlen = 1,
+	.msg_control = &control,
+	.msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t len;
+
+    msg->tmpl = NULL;
+    msg->broadcast = false;
+
+    if ((len = recvmsg(s, &mh, MSG_DONTWAIT)) < 0)
+	return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+	    struct in_pktinfo info;
+
+	    memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+	    msg->tmpl = dhcpd4_search_interface(info.ipi_ifindex);
+	    msg->broadcast = net_ipv4_is_addr_bcast(msg->tmpl != NULL ? msg->tmpl->iface : NULL,
+						    &info.ipi_addr);
+	}
+    }
+
+    msg->server_id = msg->tmpl != NULL ? msg->tmpl->hdr.src : 0;
+
+    return len;
+}
+
+/*
+ * Open a socket bound to the server port, receiving the interface and
+ * the destination of each request. With more than one worker, each
+ * worker opens its own (SO_REUSEPORT).
+ *
+ * Return the socket, or -1 on error.
+ */
+
+static int dhcpd4_open_socket(void)
+{
+    struct sockaddr_in server_sock = {
+	.sin_family = AF_INET,
+	.sin_addr.s_addr = htonl(INADDR_ANY),
+	.sin_port = htons(DHCPV4_SERVER_PORT),
+    };
+    int s, on = 1;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+	LOG_ERR("server: socket() error %s", strerror(errno));
+	return -1;
+    }
+
+    // the receiving interface of each request selects its pool and server id
+
+    if (setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) == -1) {
+	LOG_ERR("server: setsockopt() IP_PKTINFO %s", strerror(errno));
+	close(s);
+	return -1;
+    }
+
+#if CONFIG_DHCPD_WORKERS > 1
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+	LOG_ERR("server: setsockopt() SO_REUSEPORT %s", strerror(errno));
+	close(s);
+	return -1;
+    }
+#endif
+
+    if (bind(s, (struct sockaddr *)&server_sock, sizeof(server_sock)) == -1) {
+	LOG_ERR("server: bind() %s", strerror(errno));
+	close(s);
+	return -1;
+    }
+
+    return s;
+}
+
+/*
+ * Histogram of the number of requests served at each wakeup (of the
+ * server thread or of any worker): bucket i counts the batches of 2^i
+ * up to 2^(i+1)-1 requests.
+ */
+
+static atomic_t dhcpd4_batch_histogram[DHCPD4_BATCH_BUCKETS];
+
+static void dhcpd4_count_batch(int count)
+{
+    int i;
+
+    if (count == 0)
+	return;
+
+    for (i = 0; count > 1 && i < DHCPD4_BATCH_BUCKETS - 1; i++)
+	count >>= 1;
+
+    atomic_inc(&dhcpd4_batch_histogram[i]);
+}
+
+void dhcpd4_get_batch_histogram(uint32_t histogram[DHCPD4_BATCH_BUCKETS])
+{
+    int i;
+
+    for (i = 0; i < DHCPD4_BATCH_BUCKETS; i++)
+	histogram[i] = atomic_get(&dhcpd4_batch_histogram[i]);
+}
+
+#if CONFIG_DHCPD_WORKERS > 1
+
+/*
+ * Worker threads, each one serving the requests of its shards.
+ *
+ * Each worker receives the requests on a socket of its own, bound to
+ * the server port with SO_REUSEPORT, in a buffer of dhcpd4_rx_slab:
+ * the network stack delivers a broadcast request to every socket, and
+ * a unicast one (renewal, relayed request) to one of them. A worker
+ * serves the requests of its clients, ignores the broadcast ones of the
+ * other workers, which receive them too, and forwards the unicast ones
+ * to the worker of their client, which frees the buffer.
+ */
+
+struct dhcpd4_rx {
+    dhcpd_msg msg;                  // the request, then its reply
+    size_t len;                     // length of the request
+    struct sockaddr_in client_sock; // sender of the request
+    uint32_t start;                 // reception of the request (hardware cycles)
+};
+
+struct dhcpd4_work {
+    struct dhcpd4_rx *rx; // request forwarded, or NULL
+    char event;           // control event if there is no request
+};
 
-extern int net_udp_create(struct net_pkt *pkt, uint16_t src_port, uint16_t dst_port);
+/*
+ * Bindings and addresses of the shard of a worker in a pool.
+ */
+
+struct dhcpd4_shard_tables {
+    binding_list bindings;
+    pool_indexes indexes;
+    dhcp_option_blob option_blob;
+};
+
+struct dhcpd4_worker {
+    struct dhcpd4_shard *shards;        // one per pool
+    struct dhcpd4_shard_tables *tables; // of the shards
 
-extern int net_ipv4_finalize(struct net_pkt *pkt, uint8_t next_header_proto);
+    int s;           // socket of the requests
+    int doorbell[2]; // written on [1] after a work is put in queue, see dhcpd4_post_worker()
 
+    struct k_msgq queue; // of struct dhcpd4_work
+    struct dhcpd4_work queue_buffer[CONFIG_DHCPD_WORKER_QUEUE];
+    struct k_thread thread;
+};
+
+// the requests queued, and the one received by each worker
+K_MEM_SLAB_DEFINE_STATIC(dhcpd4_rx_slab, sizeof(struct dhcpd4_rx),
+			 CONFIG_DHCPD_WORKERS * (CONFIG_DHCPD_WORKER_QUEUE + 1), sizeof(void *));
+static K_THREAD_STACK_ARRAY_DEFINE(dhcpd4_worker_stks, CONFIG_DHCPD_WORKERS, DHCPD4_TASK_STK_SIZE);
+
+static struct dhcpd4_worker dhcpd4_workers[CONFIG_DHCPD_WORKERS];
+static atomic_t dhcpd4_rx_drops; // requests dropped, worker busy
+
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+static K_SEM_DEFINE(dhcpd4_snapshot_done, 0, CONFIG_DHCPD_WORKERS); // workers done appending to the snapshot
+#endif
 
 /*
- * Global pool
+ * Get the worker serving a client.
+ *
+ * The high bits of the hash are used: the low ones place the client
+ * in the bindings index of its shard.
  */
 
-static address_pool dhcpd4_pool;
-address_pool *dhcpd4_get_pool(void) {
-	return &dhcpd4_pool;
+static struct dhcpd4_worker *dhcpd4_client_worker(const uint8_t *cident, uint8_t cident_len)
+{
+    uint64_t hash = dhcpd4_cident_hash(cident, cident_len);
+
+    return &dhcpd4_workers[(hash * CONFIG_DHCPD_WORKERS) >> 32];
 }
+
 /*
- * Helper functions
+ * Move a binding of a pool (whose index is passed) to the shard of its
+ * client, with its status and the lease time left.
  */
 
-static char *
-str_ip (uint32_t ip)
+static void dhcpd4_move_binding(address_binding *binding, void *arg)
 {
-    static char addrstr[INET_ADDRSTRLEN];
-    return inet_ntop(AF_INET, &ip, addrstr, sizeof(addrstr));
+    int n = POINTER_TO_INT(arg);
+    address_pool *pool = dhcpd4_pools[n];
+    uint8_t cident[UINT8_MAX];
+    uint8_t cident_len = binding->cident_len;
+    uint32_t address = binding->address;
+    int is_static = binding->is_static;
+    int status = binding->status;
+    int32_t lease = binding->expiry - dhcpd4_bindings_time();
+    struct dhcpd4_shard *shard;
+
+    memcpy(cident, dhcpd4_binding_cident(binding), cident_len);
+    dhcpd4_remove_binding(&pool->bindings, &pool->indexes, binding);
+
+    shard = &dhcpd4_client_worker(cident, cident_len)->shards[n];
+
+    if ((binding = dhcpd4_add_binding(shard->bindings, shard->indexes, address, cident, cident_len,
+				      is_static)) == NULL) {
+	LOG_ERR("Binding of %s lost", str_ip(address));
+	return;
+    }
+
+    if (status != B_EMPTY)
+	dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, status, MAX(lease, 0));
 }
 
-static char *
-str_mac (uint8_t *mac)
+/*
+ * Reserve the address of a static or restored binding of a shard in
+ * the range of the other shards of the same pool (whose index is passed).
+ *
+ * A restored address is reserved until the next start, even after
+ * the end of its lease.
+ */
+
+static void dhcpd4_reserve_static_address(address_binding *binding, void *arg)
 {
-    static char str[128];
+    int n = POINTER_TO_INT(arg);
+    int i;
 
-    sprintf(str, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x",
-	    mac[0], mac[1], mac[2],
-	    mac[3], mac[4], mac[5]);
+    if (!binding->is_static && binding->status != ASSOCIATED)
+	return;
 
-    return str;
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++)
+	dhcpd4_reserve_address(dhcpd4_workers[i].shards[n].indexes, binding->address);
 }
 
-static char *
-str_status (int status)
+/*
+ * Give a static binding of a shard back to its relay pool, which keeps
+ * it for the next start (see dhcpd4_delete_pools()).
+ */
+
+static void dhcpd4_return_static_binding(address_binding *binding, void *arg)
 {
-    switch(status) {
-    case B_EMPTY:
-	return "empty";
-    case PENDING:
-	return "pending";
-    case ASSOCIATED:
-	return "associated";
-    case RELEASED:
-	return "released";
-    case EXPIRED:
-	return "expired";
-    default:
-	return NULL;
+    address_pool *pool = arg;
+
+    if (binding->is_static &&
+	dhcpd4_add_binding(&pool->bindings, &pool->indexes, binding->address,
+			   (uint8_t *)dhcpd4_binding_cident(binding), binding->cident_len, STATIC) == NULL)
+	LOG_ERR("Static binding of %s lost", str_ip(binding->address));
+}
+
+static void dhcpd4_delete_workers(void)
+{
+    int i, n;
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_worker *worker = &dhcpd4_workers[i];
+
+	for (n = 0; worker->tables != NULL && n < dhcpd4_pool_count; n++) {
+	    if (n != 0) // relay pool
+		dhcpd4_foreach_binding(&worker->tables[n].bindings, dhcpd4_return_static_binding,
+				       dhcpd4_pools[n]);
+
+	    dhcpd4_delete_binding_list(&worker->tables[n].bindings);
+	    dhcpd4_delete_pool_indexes(&worker->tables[n].indexes);
+	    dhcpd4_delete_option_blob(&worker->tables[n].option_blob);
+	}
+
+	dhcpd4_free(worker->shards);
+	dhcpd4_free(worker->tables);
     }
 }
 
-static struct net_pkt *dhcpd4_create_message(struct net_if *iface,
-				       const struct in_addr *src,
-				       const struct in_addr *dst,
-				       uint8_t * data,
-				       size_t size);
+/*
+ * Split a pool among the shards of the workers: the addresses
+ * in contiguous ranges, the bindings by client.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_split_pool(int n)
+{
+    address_pool *pool = dhcpd4_pools[n];
+    uint32_t first = ntohl(pool->indexes.first);
+    uint32_t last = ntohl(pool->indexes.last);
+    uint64_t size = (uint64_t)last - first + 1;
+    int i;
+
+    if (first == 0 || last < first || size < CONFIG_DHCPD_WORKERS) {
+	LOG_ERR("Invalid address pool of subnet %s for %d workers",
+		str_ip(pool->subnet), CONFIG_DHCPD_WORKERS);
+	return -1;
+    }
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_shard *shard = &dhcpd4_workers[i].shards[n];
+	struct dhcpd4_shard_tables *tables = &dhcpd4_workers[i].tables[n];
+
+	dhcpd4_init_binding_list(&tables->bindings);
+
+	tables->indexes.first = htonl(first + size * i / CONFIG_DHCPD_WORKERS);
+	tables->indexes.last = htonl(first + size * (i + 1) / CONFIG_DHCPD_WORKERS - 1);
+
+	shard->pool = pool;
+	shard->bindings = &tables->bindings;
+	shard->indexes = &tables->indexes;
+	shard->option_blob = &tables->option_blob;
+	shard->deadline = 0;
+    }
+
+    dhcpd4_foreach_binding(&pool->bindings, dhcpd4_move_binding, INT_TO_POINTER(n));
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_shard *shard = &dhcpd4_workers[i].shards[n];
+
+	if (dhcpd4_init_pool_indexes(shard->indexes, shard->bindings) != 0 ||
+	    dhcpd4_compile_option_list(shard->option_blob, &pool->options) != 0) {
+	    LOG_ERR("Out of memory for the pool of subnet %s", str_ip(pool->subnet));
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++)
+	dhcpd4_foreach_binding(dhcpd4_workers[i].shards[n].bindings,
+			       dhcpd4_reserve_static_address, INT_TO_POINTER(n));
+
+    return 0;
+}
 
 /*
- * Network related routines
+ * Allocate the shards of the workers and split the pools among them.
+ *
+ * Return 0 on success, -1 on error.
  */
 
-static int dhcpd4_send_dhcp_reply(dhcpd_msg *reply)
+static int dhcpd4_init_workers(void)
 {
+    int i, n;
 
-    size_t len = dhcpd4_serialize_option_list(&reply->opts, reply->hdr.options,
-					      sizeof(reply->hdr) - DHCP_HEADER_SIZE);
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_worker *worker = &dhcpd4_workers[i];
 
-    len += DHCP_HEADER_SIZE;
-    address_pool *dhcpd4_addr_pool = dhcpd4_get_pool();
-    struct net_if *iface = net_if_get_by_index(dhcpd4_addr_pool->device_index);
-    if (iface) {
-        struct in_addr src = iface->config.ip.ipv4->unicast[0].address.in_addr;
-        struct net_pkt *pkt = dhcpd4_create_message(iface, &src, net_ipv4_broadcast_address(),
-                                (uint8_t *)reply, len);
-        if (!pkt) {
-            goto fail;
-        }
+	worker->shards = dhcpd4_calloc(dhcpd4_pool_count, sizeof(*worker->shards));
+	worker->tables = dhcpd4_calloc(dhcpd4_pool_count, sizeof(*worker->tables));
 
-        if (net_send_data(pkt) < 0) {
-            goto fail;
-        } else {
-            //printk("dhcpd4 packet sent, size=%u\n", len);
-        }
-        return 0;
-    } else {
-	    LOG_ERR("Invalid interface index %d", dhcpd4_addr_pool->device_index);
+	if (worker->shards == NULL || worker->tables == NULL) {
+	    LOG_ERR("Out of memory for the shards of the workers");
+	    dhcpd4_delete_workers();
+	    return -1;
+	}
     }
-fail:
-    return -1;
+
+    for (n = 0; n < dhcpd4_pool_count; n++) {
+	if (dhcpd4_split_pool(n) != 0) {
+	    dhcpd4_delete_workers();
+	    return -1;
+	}
+    }
+
+    return 0;
 }
 
 /*
- * Message handling routines.
+ * Wake a worker to read its queue, after a work is put in it. The
+ * doorbell does not block: when full, the worker is already woken.
  */
 
-static uint8_t dhcpd4_expand_request(dhcpd_msg *request, size_t len)
+static void dhcpd4_post_worker(struct dhcpd4_worker *worker)
 {
-    dhcpd4_init_option_list(&request->opts);
-    
-    if (request->hdr.hlen < 1 || request->hdr.hlen > 16)
-	return 0;
+    char ring = 0;
 
-    if(dhcpd4_parse_options_to_list(&request->opts, (dhcp_option *)request->hdr.options,
-				     len - DHCP_HEADER_SIZE) == 0)
-	return 0;
-    
-    dhcp_option *type_opt = dhcpd4_search_option(&request->opts, DHCP_MESSAGE_TYPE);
-    
-    if (type_opt == NULL)
-	return 0;
+    send(worker->doorbell[1], &ring, sizeof(ring), 0);
+}
 
-    uint8_t type = type_opt->data[0];
-    
-    return type;
+static void dhcpd4_drop_request(void)
+{
+    LOG_WRN("Request dropped, workers busy (%u drops)",
+	    (unsigned)atomic_inc(&dhcpd4_rx_drops) + 1);
+    dhcpd4_count(DHCPD4_STAT_DROP_BUSY);
 }
 
-static int dhcpd4_init_reply(dhcpd_msg *request, dhcpd_msg *reply)
+/*
+ * Receive a queued request on the socket of a worker, without waiting,
+ * and serve it if its client is served by the worker. Otherwise the
+ * request is ignored if broadcast, forwarded to the worker of its
+ * client if not. A request is dropped if no buffer is available or if
+ * the queue of its worker is full.
+ *
+ * Return -1 if no request is queued, 0 otherwise: *pkt is set to
+ * the reply packet, or NULL if there is no reply.
+ */
+
+static int dhcpd4_worker_receive(struct dhcpd4_worker *worker, struct net_pkt **pkt)
 {
-    memset(&reply->hdr, 0, sizeof(reply->hdr));
+    struct dhcpd4_worker *owner;
+    struct dhcpd4_rx *rx;
+    struct dhcpd4_work work = { .event = 0 };
+    ssize_t len;
 
-    dhcpd4_init_option_list(&reply->opts);
-    
-    reply->hdr.op = BOOTREPLY;
+    *pkt = NULL;
 
-    reply->hdr.htype = request->hdr.htype;
-    reply->hdr.hlen  = request->hdr.hlen;
+    if (k_mem_slab_alloc(&dhcpd4_rx_slab, (void **)&rx, K_NO_WAIT) != 0) {
+	char byte;
 
-    reply->hdr.xid   = request->hdr.xid;
-    reply->hdr.flags = request->hdr.flags;
-     
-    reply->hdr.giaddr = request->hdr.giaddr;
-    
-    memcpy(reply->hdr.chaddr, request->hdr.chaddr, request->hdr.hlen);
+	if (recv(worker->s, &byte, sizeof(byte), MSG_DONTWAIT) < 0) // the rest of the datagram dropped
+	    return -1;
 
-    return 1;
-}
+	dhcpd4_drop_request();
+	return 0;
+    }
 
-static void dhcpd4_fill_requested_dhcp_options(dhcp_option *requested_opts, dhcp_option_list *reply_opts)
-{
-    uint8_t len = requested_opts->len;
-    uint8_t *id = requested_opts->data;
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    int i;
-    for (i = 0; i < len; i++) {
-	    
-	if(id[i] != 0) {
-	    dhcp_option *opt = dhcpd4_search_option(&dhcpd4_addr_pool->options, id[i]);
+    rx->start = k_cycle_get_32();
+    len = dhcpd4_receive_datagram(worker->s, &rx->msg, &rx->client_sock);
 
-	    if(opt != NULL)
-		    dhcpd4_append_option(reply_opts, opt);
-	}
-	    
+    if (len < 0) {
+	k_mem_slab_free(&dhcpd4_rx_slab, rx);
+	return -1;
     }
-}
 
-static int dhcpd4_fill_dhcp_reply(dhcpd_msg *request, dhcpd_msg *reply,
-		 address_binding *binding, uint8_t type)
-{
-    static dhcp_option type_opt, server_id_opt;
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    type_opt.id = DHCP_MESSAGE_TYPE;
-    type_opt.len = 1;
-    type_opt.data[0] = type;
-    dhcpd4_append_option(&reply->opts, &type_opt);
+    if (len < DHCP_HEADER_SIZE + 5 || rx->msg.hdr.op != BOOTREQUEST ||
+	rx->msg.hdr.hlen < 1 || rx->msg.hdr.hlen > 16) {
+	if (!rx->msg.broadcast || worker == &dhcpd4_workers[0]) // counted once
+	    dhcpd4_count(DHCPD4_STAT_MALFORMED);
 
-    server_id_opt.id = SERVER_IDENTIFIER;
-    server_id_opt.len = 4;
-    memcpy(server_id_opt.data, &dhcpd4_addr_pool->server_id, sizeof(dhcpd4_addr_pool->server_id));
-    dhcpd4_append_option(&reply->opts, &server_id_opt);
-    
-    if(binding != NULL) {
-	reply->hdr.yiaddr = binding->address;
+	k_mem_slab_free(&dhcpd4_rx_slab, rx);
+	return 0;
     }
-    
-    if (type != DHCP_NAK) {
-	dhcp_option *requested_opts = dhcpd4_search_option(&request->opts, PARAMETER_REQUEST_LIST);
 
-	if (requested_opts)
-	    dhcpd4_fill_requested_dhcp_options(requested_opts, &reply->opts);
+    owner = dhcpd4_client_worker(rx->msg.hdr.chaddr, rx->msg.hdr.hlen);
+
+    if (owner == worker || rx->msg.broadcast) {
+	if (owner == worker)
+	    *pkt = dhcpd4_serve_request(worker->shards, &rx->msg, len, &rx->client_sock);
+
+	k_mem_slab_free(&dhcpd4_rx_slab, rx);
+	return 0;
+    }
+
+    rx->len = len;
+    work.rx = rx;
+
+    if (k_msgq_put(&owner->queue, &work, K_NO_WAIT) == 0) {
+	dhcpd4_post_worker(owner);
+	return 0;
     }
-    
-    return type;
+
+    k_mem_slab_free(&dhcpd4_rx_slab, rx);
+    dhcpd4_drop_request();
+
+    return 0;
 }
 
-static int dhcpd4_serve_dhcp_discover(dhcpd_msg *request, dhcpd_msg *reply)
+/*
+ * Serve the requests forwarded to a worker and handle its control
+ * events, in order.
+ *
+ * Return false if the worker must stop.
+ */
+
+static bool dhcpd4_worker_queue(struct dhcpd4_worker *worker)
 {
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    address_binding *binding = dhcpd4_search_binding(&dhcpd4_addr_pool->bindings, request->hdr.chaddr,
-						     request->hdr.hlen, STATIC, B_EMPTY);
+    struct dhcpd4_work work;
+    struct net_pkt *pkt;
+    char rings[16];
+    uint32_t start;
+    int n;
+
+    while (recv(worker->doorbell[0], rings, sizeof(rings), MSG_DONTWAIT) == sizeof(rings))
+	;
+
+    while (k_msgq_get(&worker->queue, &work, K_NO_WAIT) == 0) {
+	if (work.rx == NULL) {
+	    if (work.event == DHCPD4_EVENT_STOP)
+		return false;
+
+	    if (work.event == DHCPD4_EVENT_RELOAD) {
+		for (n = 0; n < dhcpd4_pool_count; n++)
+		    dhcpd4_reload_shard(&worker->shards[n]);
+	    }
+
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+	    if (work.event == DHCPD4_EVENT_SNAPSHOT) {
+		for (n = 0; n < dhcpd4_pool_count; n++)
+		    dhcpd4_snapshot_append_list(worker->shards[n].bindings);
 
-    if (binding) { // a static binding has been configured for this client
+		k_sem_give(&dhcpd4_snapshot_done);
+	    }
+#endif
 
-        log_info("Offer %s to %s (static), %s status %sexpired",
-                 str_ip(binding->address), str_mac(request->hdr.chaddr),
-                 str_status(binding->status),
-                 binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
-            
-        if (binding->binding_time + binding->lease_time < time(NULL)) {
-	    binding->status = PENDING;
-	    binding->binding_time = time(NULL);
-	    binding->lease_time = dhcpd4_addr_pool->pending_time;
+	    continue;
 	}
-            
-        return dhcpd4_fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
 
+	pkt = dhcpd4_serve_request(worker->shards, &work.rx->msg, work.rx->len, &work.rx->client_sock);
+	start = work.rx->start;
+	k_mem_slab_free(&dhcpd4_rx_slab, work.rx);
+
+	if (pkt != NULL)
+	    dhcpd4_send_dhcp_replies(&pkt, &start, 1);
     }
 
-    else { // use dynamic pool
+    return true;
+}
 
-        /* If an address is available, the new address
-           SHOULD be chosen as follows: */
+/*
+ * Serve the requests of the clients of a worker, as the server thread
+ * does with a single worker (see dhcpd4_message_dispatcher()). The
+ * bindings timers of its shards run after every wakeup.
+ */
 
-	binding = dhcpd4_search_binding(&dhcpd4_addr_pool->bindings, request->hdr.chaddr, request->hdr.hlen,
-					DYNAMIC, B_EMPTY);
+static void dhcpd4_worker_task(void *p1, void *p2, void *p3)
+{
+    struct dhcpd4_worker *worker = p1;
+    struct pollfd fds[2] = {
+	{ .fd = worker->s,           .events = POLLIN },
+	{ .fd = worker->doorbell[0], .events = POLLIN },
+    };
 
-        if (binding) {
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
 
-            /* The client's current address as recorded in the client's current
-               binding, ELSE */
+    while (true) {
+	struct net_pkt *pkts[MIN(CONFIG_DHCPD_RX_BATCH, CONFIG_DHCPD_REPLY_PKT_COUNT)];
+	uint32_t starts[ARRAY_SIZE(pkts)]; // reception of the request of each reply
+	int count, replies;
 
-            /* The client's previous address as recorded in the client's (now
-               expired or released) binding, if that address is in the server's
-               pool of available addresses and not already allocated, ELSE */
+	int timeout = dhcpd4_run_shard_timers(worker->shards, dhcpd4_pool_count);
 
-	    log_info("Offer %s to %s, %s status %sexpired",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr),
-		     str_status(binding->status),
-		     binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
+	if (poll(fds, ARRAY_SIZE(fds), timeout) <= 0)
+	    continue;
 
-	    if (binding->binding_time + binding->lease_time < time(NULL)) {
-		binding->status = PENDING;
-		binding->binding_time = time(NULL);
-		binding->lease_time = dhcpd4_addr_pool->pending_time;
-	    }
-	    
-            return dhcpd4_fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
-
-        } else {
-
-	    /* The address requested in the 'Requested IP Address' option, if that
-	       address is valid and not already allocated, ELSE */
-
-	    /* A new address allocated from the server's pool of available
-	       addresses; the address is selected based on the subnet from which
-	       the message was received (if 'giaddr' is 0) or on the address of
-	       the relay agent that forwarded the message ('giaddr' when not 0). */
-
-	    // TODO: extract requested IP address
-	    uint32_t address = 0;
-	    dhcp_option *address_opt = dhcpd4_search_option(&request->opts, REQUESTED_IP_ADDRESS);
-
-	    if(address_opt != NULL)
-		memcpy(&address, address_opt->data, sizeof(address));
-	    
-	    binding = dhcpd4_new_dynamic_binding(&dhcpd4_addr_pool->bindings, &dhcpd4_addr_pool->indexes, address,
-						 request->hdr.chaddr, request->hdr.hlen);
-
-	    if (binding == NULL) {
-		log_info("Can not offer an address to %s, no address available.",
-			 str_mac(request->hdr.chaddr));
-		
-		return 0;
-	    }
+	if ((fds[1].revents & POLLIN) && !dhcpd4_worker_queue(worker))
+	    break;
 
-	    log_info("Offer %s to %s, %s status %sexpired",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr),
-		     str_status(binding->status),
-		     binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
-	    
-	    if (binding->binding_time + binding->lease_time < time(NULL)) {
-		binding->status = PENDING;
-		binding->binding_time = time(NULL);
-		binding->lease_time = dhcpd4_addr_pool->pending_time;
-	    }
+	if (!(fds[0].revents & POLLIN))
+	    continue;
+
+	for (count = 0, replies = 0; count < CONFIG_DHCPD_RX_BATCH; count++) {
+	    starts[replies] = k_cycle_get_32();
 
-	    return dhcpd4_fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
+	    if (dhcpd4_worker_receive(worker, &pkts[replies]) != 0)
+		break; // no more requests queued
+
+	    if (pkts[replies] != NULL && ++replies == ARRAY_SIZE(pkts)) {
+		dhcpd4_send_dhcp_replies(pkts, starts, replies);
+		replies = 0;
+	    }
 	}
 
+	dhcpd4_send_dhcp_replies(pkts, starts, replies);
+	dhcpd4_count_batch(count);
     }
-
-    // should NOT reach here...
 }
 
-static int dhcpd4_serve_dhcp_request(dhcpd_msg *request, dhcpd_msg *reply)
+static void dhcpd4_close_workers(void)
 {
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    address_binding *binding = dhcpd4_search_binding(&dhcpd4_addr_pool->bindings, request->hdr.chaddr,
-						     request->hdr.hlen, STATIC_OR_DYNAMIC, PENDING);
+    int i;
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_worker *worker = &dhcpd4_workers[i];
+
+	if (worker->s >= 0)
+	    close(worker->s);
 
-    uint32_t server_id = 0;
-    dhcp_option *server_id_opt = dhcpd4_search_option(&request->opts, SERVER_IDENTIFIER);
+	if (worker->doorbell[0] >= 0)
+	    close(worker->doorbell[0]);
 
-    if(server_id_opt != NULL)
-	memcpy(&server_id, server_id_opt->data, sizeof(server_id));
-    
-    if (server_id == dhcpd4_addr_pool->server_id) { // this request is an answer to our offer
+	if (worker->doorbell[1] >= 0)
+	    close(worker->doorbell[1]);
 
-	if (binding != NULL) {
+	worker->s = worker->doorbell[0] = worker->doorbell[1] = -1;
+    }
+}
+
+/*
+ * Open the sockets of the workers and start them.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_start_workers(void)
+{
+    int i;
 
-	    log_info("Ack %s to %s, associated",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr));
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++)
+	dhcpd4_workers[i].s = dhcpd4_workers[i].doorbell[0] = dhcpd4_workers[i].doorbell[1] = -1;
 
-	    binding->status = ASSOCIATED;
-	    binding->lease_time = dhcpd4_addr_pool->lease_time;
-	    
-	    return dhcpd4_fill_dhcp_reply(request, reply, binding, DHCP_ACK);
-	
-	} else {
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_worker *worker = &dhcpd4_workers[i];
 
-	    log_info("Nak to %s, not associated",
-		     str_mac(request->hdr.chaddr));
-		    
-	    return dhcpd4_fill_dhcp_reply(request, reply, NULL, DHCP_NAK);
+	if ((worker->s = dhcpd4_open_socket()) == -1) {
+	    dhcpd4_close_workers();
+	    return -1;
 	}
 
-    } else if (server_id != 0) { // answer to the offer of another server
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, worker->doorbell) == -1 ||
+	    fcntl(worker->doorbell[1], F_SETFL, O_NONBLOCK) == -1) {
+	    LOG_ERR("server: worker socketpair() error %s", strerror(errno));
+	    dhcpd4_close_workers();
+	    return -1;
+	}
+    }
 
-	log_info("Clearing %s of %s, accepted another server offer",
-		 str_ip(binding->address), str_mac(request->hdr.chaddr));
-		    
-	binding->status = B_EMPTY;
-	binding->lease_time = 0;
-	
-	return 0;
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	struct dhcpd4_worker *worker = &dhcpd4_workers[i];
 
+	k_msgq_init(&worker->queue, (char *)worker->queue_buffer,
+		    sizeof(struct dhcpd4_work), CONFIG_DHCPD_WORKER_QUEUE);
+	k_thread_create(&worker->thread, dhcpd4_worker_stks[i],
+			K_THREAD_STACK_SIZEOF(dhcpd4_worker_stks[i]), dhcpd4_worker_task,
+			worker, NULL, NULL, DHCPD4_TASK_PRIO, 0, K_NO_WAIT);
+	k_thread_name_set(&worker->thread, "dhcpd4 worker");
     }
 
-    // malformed request...
     return 0;
 }
 
-static int dhcpd4_serve_dhcp_decline(dhcpd_msg *request, dhcpd_msg *reply)
-{
-    ARG_UNUSED(reply);
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    address_binding *binding = dhcpd4_search_binding(&dhcpd4_addr_pool->bindings, request->hdr.chaddr,
-						     request->hdr.hlen, STATIC_OR_DYNAMIC, PENDING);
+/*
+ * Send a control event to all the workers, after the requests
+ * already queued.
+ */
 
-    if(binding != NULL) {
-	log_info("Declined %s by %s",
-		 str_ip(binding->address), str_mac(request->hdr.chaddr));
+static void dhcpd4_post_workers(char event)
+{
+    struct dhcpd4_work work = { .rx = NULL, .event = event };
+    int i;
 
-	binding->status = B_EMPTY;
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	k_msgq_put(&dhcpd4_workers[i].queue, &work, K_FOREVER);
+	dhcpd4_post_worker(&dhcpd4_workers[i]);
     }
+}
 
-    return 0;
+#if defined(CONFIG_DHCPD_SNAPSHOT)
+
+/*
+ * Write a snapshot of the bindings of all the shards: each worker
+ * appends its own, after the requests already queued.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_snapshot_workers(void)
+{
+    int i;
+
+    if (dhcpd4_snapshot_begin(dhcpd4_journal_get_seq()) != 0)
+	return -1;
+
+    dhcpd4_post_workers(DHCPD4_EVENT_SNAPSHOT);
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++)
+	k_sem_take(&dhcpd4_snapshot_done, K_FOREVER);
+
+    return dhcpd4_snapshot_end();
 }
 
-static int dhcpd4_serve_dhcp_release(dhcpd_msg *request, dhcpd_msg *reply)
+#endif
+
+/*
+ * Stop the workers, then free the requests forwarded to a worker
+ * already stopped.
+ */
+
+static void dhcpd4_stop_workers(void)
 {
-    ARG_UNUSED(reply);
-    address_pool * dhcpd4_addr_pool = dhcpd4_get_pool();
-    address_binding *binding = dhcpd4_search_binding(
-	    &dhcpd4_addr_pool->bindings, request->hdr.chaddr, request->hdr.hlen, STATIC_OR_DYNAMIC, ASSOCIATED);
+    struct dhcpd4_work work;
+    int i;
+
+    dhcpd4_post_workers(DHCPD4_EVENT_STOP);
 
-    if(binding != NULL) {
-	log_info("Released %s by %s",
-		 str_mac(request->hdr.chaddr), str_ip(binding->address));
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++)
+	k_thread_join(&dhcpd4_workers[i].thread, K_FOREVER);
 
-	binding->status = RELEASED;
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+	while (k_msgq_get(&dhcpd4_workers[i].queue, &work, K_NO_WAIT) == 0) {
+	    if (work.rx != NULL)
+		k_mem_slab_free(&dhcpd4_rx_slab, work.rx);
+	}
     }
 
-    return 0;
+    dhcpd4_close_workers();
 }
 
-static int dhcpd4_serve_dhcp_inform(dhcpd_msg *request, dhcpd_msg *reply)
+#endif /* CONFIG_DHCPD_WORKERS > 1 */
+
+/*
+ * Handle an event of the control channel.
+ *
+ * Return false if the server must stop.
+ */
+
+static bool dhcpd4_control_event(int ctrl)
 {
-    log_info("Info to %s", str_mac(request->hdr.chaddr));
-    return dhcpd4_fill_dhcp_reply(request, reply, NULL, DHCP_ACK);
+    char event;
+#if CONFIG_DHCPD_WORKERS == 1
+    int i;
+#endif
+
+    if (recv(ctrl, &event, sizeof(event), 0) != sizeof(event))
+	return false; // channel closed
+
+    switch (event) {
+
+    case DHCPD4_EVENT_STOP:
+	return false;
+
+    case DHCPD4_EVENT_RELOAD:
+#if CONFIG_DHCPD_WORKERS > 1
+	dhcpd4_post_workers(DHCPD4_EVENT_RELOAD);
+#else
+	for (i = 0; i < dhcpd4_pool_count; i++)
+	    dhcpd4_reload_shard(&dhcpd4_shards[i]);
+#endif
+	break;
+
+    case DHCPD4_EVENT_TIMER:
+	break; // the bindings timer runs after every wakeup
+
+    default:
+	LOG_ERR("Invalid control event 0x%02x", event);
+	break;
+    }
+
+    return true;
 }
 
 /*
- * Dispatch client DHCP messages to the correct handling routines
+ * Receive a queued request, without waiting, and serve it (with a
+ * single worker, see dhcpd4_worker_receive() otherwise).
+ *
+ * Return -1 if no request is queued, 0 otherwise: *pkt is set to
+ * the reply packet, or NULL if there is no reply.
  */
 
-static void dhcpd4_message_dispatcher(int s, bool * stop)
+static int dhcpd4_serve_datagram(int s, dhcpd_msg *msg, struct net_pkt **pkt)
 {
-    if (!stop)
-	return ;
+    struct sockaddr_in client_sock;
+    ssize_t len;
 
-    while (!(*stop)) {
-        struct sockaddr_in client_sock;
-        socklen_t slen = sizeof(client_sock);
-        size_t len;
+    *pkt = NULL;
 
-        dhcpd_msg request;
-        dhcpd_msg reply;
+    if ((len = dhcpd4_receive_datagram(s, msg, &client_sock)) < 0)
+	return -1;
 
-        uint8_t type;
+    *pkt = dhcpd4_serve_request(dhcpd4_shards, msg, len, &client_sock);
 
-        fd_set readfds;
-        struct timeval timeout;
+    return 0;
+}
 
-        timeout.tv_usec = 100000;
-        timeout.tv_sec  = 0;
+#if defined(CONFIG_DHCPD_SNAPSHOT)
 
-        FD_ZERO(&readfds);
-        FD_SET(s, &readfds);
+/*
+ * Write the periodic lease snapshot when due. The journal records
+ * written before are dropped when the journal is full.
+ *
+ * Return the timeout of the next wakeup, shortened to the next snapshot.
+ */
 
-        int ready = select(s+1, &readfds, NULL, NULL, &timeout);
+static int dhcpd4_run_snapshot_timer(int timeout)
+{
+    int64_t now = k_uptime_get();
+    int64_t next;
+
+    if (dhcpd4_snapshot_deadline < 0)
+	return timeout;
+
+    if (dhcpd4_snapshot_deadline <= now) {
+#if CONFIG_DHCPD_WORKERS > 1
+	if (dhcpd4_snapshot_workers() != 0)
+#else
+	if (dhcpd4_snapshot_pools() != 0)
+#endif
+	    LOG_ERR("Lease snapshot not written");
+
+	now = k_uptime_get();
+	dhcpd4_snapshot_deadline = now + CONFIG_DHCPD_SNAPSHOT_INTERVAL * MSEC_PER_SEC;
+    }
 
-        if (ready == 0) {
-            continue ;
-        } else if (ready == -1) {
-            LOG_ERR("%s: Error on select ()",__func__);
-        }
+    next = dhcpd4_snapshot_deadline - now;
 
-        if((len = recvfrom(s, &request.hdr, sizeof(request.hdr), 0, (struct sockaddr *)&client_sock, &slen)) < DHCP_HEADER_SIZE + 5) {
-            continue; // TODO: check the magic number 300
-        }
+    return timeout >= 0 && timeout < next ? timeout : (int)MIN(next, INT32_MAX);
+}
 
-        if(request.hdr.op != BOOTREQUEST)
-            continue;
+#else
 
-        if((type = dhcpd4_expand_request(&request, len)) == 0) {
-            log_error("%s.%u: invalid request received",
-                  str_ip(client_sock.sin_addr.s_addr), ntohs(client_sock.sin_port));
-            continue;
-        }
-        dhcpd4_init_reply(&request, &reply);
-        switch (type) {
+static inline int dhcpd4_run_snapshot_timer(int timeout)
+{
+    return timeout;
+}
 
-        case DHCP_DISCOVER:
-                type = dhcpd4_serve_dhcp_discover(&request, &reply);
-            break;
+#endif
 
-        case DHCP_REQUEST:
-            type = dhcpd4_serve_dhcp_request(&request, &reply);
-            break;
+/*
+ * Dispatch client DHCP messages to the correct handling routines
+ *
+ * The server sleeps until a message or a control event is received,
+ * or until the next expiry of the bindings timer. At each wakeup up to
+ * CONFIG_DHCPD_RX_BATCH queued requests are served, then their replies
+ * are sent together. With more than one worker, s is -1 (ignored by
+ * poll()): the workers receive the requests on their own sockets.
+ */
 
-        case DHCP_DECLINE:
-            type = dhcpd4_serve_dhcp_decline(&request, &reply);
-            break;
+static dhcpd_msg dhcpd4_msg; // request served by the server thread, then its reply
 
-        case DHCP_RELEASE:
-            type = dhcpd4_serve_dhcp_release(&request, &reply);
-            break;
+static void dhcpd4_message_dispatcher(int s, int ctrl)
+{
+    struct pollfd fds[2] = {
+	{ .fd = s,    .events = POLLIN },
+	{ .fd = ctrl, .events = POLLIN },
+    };
 
-        case DHCP_INFORM:
-            type = dhcpd4_serve_dhcp_inform(&request, &reply);
-            break;
+    while (true) {
+        struct net_pkt *pkts[MIN(CONFIG_DHCPD_RX_BATCH, CONFIG_DHCPD_REPLY_PKT_COUNT)];
+        uint32_t starts[ARRAY_SIZE(pkts)]; // reception of the request of each reply
+        int count, replies;
 
-        default:
-            LOG_ERR("%s.%u: request with invalid DHCP message type option 0x%02x",
-               str_ip(client_sock.sin_addr.s_addr), ntohs(client_sock.sin_port),type);
-            break;
+        int timeout = dhcpd4_run_shard_timers(dhcpd4_shards, dhcpd4_pool_count);
+        int ready = poll(fds, ARRAY_SIZE(fds), dhcpd4_run_snapshot_timer(timeout));
+
+        if (ready == 0) {
+            continue ;
+        } else if (ready == -1) {
+            LOG_ERR("%s: Error on poll ()",__func__);
+            continue ;
         }
 
-        if(type != 0) {
-            dhcpd4_send_dhcp_reply(&reply);
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !dhcpd4_control_event(ctrl))
+            break;
+
+        if (!(fds[0].revents & POLLIN))
+            continue ;
+
+        for (count = 0, replies = 0; count < CONFIG_DHCPD_RX_BATCH; count++) {
+            starts[replies] = k_cycle_get_32();
+
+            if (dhcpd4_serve_datagram(s, &dhcpd4_msg, &pkts[replies]) != 0)
+                break; // no more requests queued
+
+            if (pkts[replies] != NULL && ++replies == ARRAY_SIZE(pkts)) {
+                dhcpd4_send_dhcp_replies(pkts, starts, replies);
+                replies = 0;
+            }
         }
-        dhcpd4_delete_option_list(&request.opts);
-        dhcpd4_delete_option_list(&reply.opts);
 
+        dhcpd4_send_dhcp_replies(pkts, starts, replies);
+        dhcpd4_count_batch(count);
     }
 
 }
 
-static void dhcpd4_task (bool *stop, void *p2, void *p3)
+static void dhcpd4_task (void *ctrl, void *p2, void *p3)
 {
     ARG_UNUSED(p2);
     ARG_UNUSED(p3);
     LOG_INF("dpcpd4 started");
-    int s;
-    struct sockaddr_in server_sock;
-
-     if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-          LOG_ERR("server: socket() error %s", strerror(errno));
-	  return ;
-     }
-
-     server_sock.sin_family = AF_INET;
-     server_sock.sin_addr.s_addr = htonl(INADDR_ANY);
-     server_sock.sin_port = htons(67);
+    int s = -1;
 
-     if (bind(s, (struct sockaddr *) &server_sock, sizeof(server_sock)) == -1) {
-         LOG_ERR("server: bind() %s", strerror(errno));
-         close(s);
+#if CONFIG_DHCPD_WORKERS > 1
+     if (dhcpd4_start_workers() != 0)
 	 return;
-     }
+#else
+     if ((s = dhcpd4_open_socket()) == -1)
+	 return;
+#endif
 
-     LOG_INF("dhcpd4 server: listening on %d", ntohs(server_sock.sin_port));
+     LOG_INF("dhcpd4 server: listening on %d, %d interfaces, %d workers", DHCPV4_SERVER_PORT,
+	     dhcpd4_interface_count, CONFIG_DHCPD_WORKERS);
 
      /* Message processing loop */
 
-     dhcpd4_message_dispatcher(s, stop);
+     dhcpd4_message_dispatcher(s, POINTER_TO_INT(ctrl));
 
+#if CONFIG_DHCPD_WORKERS > 1
+     dhcpd4_stop_workers();
+#else
      close(s);
+#endif
      LOG_INF("dpcpd4 finished");
 }
 
-#define DHCPD4_TASK_PRIO              21u
-#define DHCPD4_TASK_STK_SIZE         2048u
-
 struct k_thread dhcpd4_task_thread_data;
 static K_THREAD_STACK_DEFINE(dhcpd4_task_stk, DHCPD4_TASK_STK_SIZE);
 static k_tid_t dhcpd4_tid = NULL;
-static bool dhcpd4_task_stop = false;
+static int dhcpd4_ctrl[2] = { -1, -1 }; // control channel, read by the server on [0]
+
+/*
+ * Send an event to the server on the control channel.
+ */
+
+static int dhcpd4_notify(char event)
+{
+    if (dhcpd4_ctrl[1] < 0)
+	return -1;
+
+    return send(dhcpd4_ctrl[1], &event, sizeof(event), 0) == sizeof(event) ? 0 : -1;
+}
+
+static void dhcpd4_close_control(void)
+{
+    if (dhcpd4_ctrl[0] >= 0)
+	close(dhcpd4_ctrl[0]);
+
+    if (dhcpd4_ctrl[1] >= 0)
+	close(dhcpd4_ctrl[1]);
+
+    dhcpd4_ctrl[0] = dhcpd4_ctrl[1] = -1;
+}
+
 int dhcpd4_start(struct net_if *iface)
 {
 
@@ -559,11 +1589,9 @@ int dhcpd4_start(struct net_if *iface)
      dhcpd4_init_option_list(&dhcpd4_addr_pool->options);
 
      if (!iface) {
-	 if (dhcpd4_addr_pool->device_index < 0) {
-	    iface=net_if_get_default();
-	 }
+	 iface=net_if_get_default();
      }
-     dhcpd4_addr_pool->device_index=net_if_get_by_iface(iface);
+     dhcpd4_addr_pool->device_index = iface ? net_if_get_by_iface(iface) : -1;
 
      if (TAILQ_EMPTY(&(dhcpd4_addr_pool->options))) {
 	 int result = 0;
@@ -580,80 +1608,114 @@ int dhcpd4_start(struct net_if *iface)
 	 if (first && last) {
 	    dhcpd4_addr_pool->indexes.first = *first;
 	    dhcpd4_addr_pool->indexes.last = *last;
-	    dhcpd4_addr_pool->indexes.current = *first;
 	 }
 	 dhcpd4_free(first);
 	 dhcpd4_free(last);
      }
 
-     if (dhcpd4_addr_pool->device_index>0) {
-	 dhcpd4_addr_pool->server_id=iface->config.ip.ipv4->unicast[0].address.in_addr.s_addr;
-	 dhcpd4_task_stop = false;
-	 dhcpd4_tid = k_thread_create(&dhcpd4_task_thread_data, dhcpd4_task_stk,
-			 K_THREAD_STACK_SIZEOF(dhcpd4_task_stk), (k_thread_entry_t)dhcpd4_task,
-			 &dhcpd4_task_stop, 0, 0, DHCPD4_TASK_PRIO, 0, K_NO_WAIT);
-	 if (dhcpd4_tid) {
-	    k_thread_name_set(&dhcpd4_task_thread_data, "dhcpd4 Task");
-	    return 0;
-	 }
+     if (dhcpd4_init_pools(dhcpd4_addr_pool) != 0) {
+	 LOG_ERR("dhcpd not started. Out of memory for the pools");
 	 return -1;
+     }
 
+#if defined(CONFIG_DHCPD_JOURNAL)
+     dhcpd4_restore_leases();
+#endif
+
+#if CONFIG_DHCPD_WORKERS > 1
+     if (dhcpd4_init_workers() != 0) {
+#else
+     if (dhcpd4_init_shards() != 0) {
+#endif
+	 LOG_ERR("dhcpd not started. Invalid address pool");
+	 dhcpd4_delete_pools();
+	 return -1;
      }
-     LOG_ERR("dhcpd not started. Invalid interface index");
-     return -1;
-}
 
-int dhcpd4_stop(void) {
-     dhcpd4_task_stop = true;
-     k_thread_join(&dhcpd4_task_thread_data, K_FOREVER);
-     dhcpd4_tid=NULL;
-     LOG_WRN("dhcpd thread joined");
-     return 0;
-}
+     if (dhcpd4_addr_pool->device_index <= 0 || dhcpd4_init_interfaces() != 0) {
+	 LOG_ERR("dhcpd not started. Invalid interface index");
+	 goto fail;
+     }
 
+     dhcpd4_addr_pool->server_id = dhcpd4_interfaces[0].hdr.src;
 
-struct net_pkt *dhcpd4_create_message(struct net_if *iface,
-				       const struct in_addr *src,
-				       const struct in_addr *dst,
-				       uint8_t * data,
-				       size_t size){
-     NET_PKT_DATA_ACCESS_DEFINE(dhcp_access, struct dhcpd_msg);
-     const struct in_addr *addr;
-     struct net_pkt *pkt;
+     dhcpd4_journal_start();
 
-     if (src == NULL) {
-	    addr = net_ipv4_unspecified_address();
-     } else {
-	    addr = src;
+     if (socketpair(AF_UNIX, SOCK_STREAM, 0, dhcpd4_ctrl) == -1) {
+	 LOG_ERR("dhcpd not started. socketpair() error %s", strerror(errno));
+	 dhcpd4_ctrl[0] = dhcpd4_ctrl[1] = -1;
+	 goto fail;
      }
 
-     pkt = net_pkt_alloc_with_buffer(iface, size, AF_INET,
-				     IPPROTO_UDP, K_FOREVER);
-     if (!pkt) {
-	    goto fail;
+     dhcpd4_tid = k_thread_create(&dhcpd4_task_thread_data, dhcpd4_task_stk,
+				  K_THREAD_STACK_SIZEOF(dhcpd4_task_stk), (k_thread_entry_t)dhcpd4_task,
+				  INT_TO_POINTER(dhcpd4_ctrl[0]), 0, 0, DHCPD4_TASK_PRIO, 0, K_NO_WAIT);
+     if (dhcpd4_tid) {
+	 k_thread_name_set(&dhcpd4_task_thread_data, "dhcpd4 Task");
+	 return 0;
      }
 
-     net_pkt_set_ipv4_ttl(pkt, 0xFF);
+     dhcpd4_close_control();
+     dhcpd4_journal_stop();
 
-     if (net_ipv4_create(pkt, addr, dst) ||
-	    net_udp_create(pkt, htons(DHCPV4_SERVER_PORT),
-			htons(DHCPV4_CLIENT_PORT))) {
-	    goto fail;
-     }
+fail:
+#if CONFIG_DHCPD_WORKERS > 1
+     dhcpd4_delete_workers();
+#endif
+     dhcpd4_delete_pools();
+     return -1;
+}
 
-     net_pkt_get_data(pkt, &dhcp_access);
+int dhcpd4_stop(void) {
+     dhcpd4_notify(DHCPD4_EVENT_STOP);
+     k_thread_join(&dhcpd4_task_thread_data, K_FOREVER);
+     dhcpd4_tid=NULL;
+     dhcpd4_close_control();
+     dhcpd4_journal_stop();
+#if CONFIG_DHCPD_WORKERS > 1
+     dhcpd4_delete_workers();
+#endif
+     dhcpd4_delete_pools();
+     LOG_WRN("dhcpd thread joined");
+     return 0;
+}
 
-     net_pkt_write(pkt,data, size);
+int dhcpd4_reload(void) {
+     return dhcpd4_notify(DHCPD4_EVENT_RELOAD);
+}
 
-     net_pkt_cursor_init(pkt);
+int dhcpd4_running(void) {
+     return dhcpd4_tid != NULL;
+}
 
-     net_ipv4_finalize(pkt, IPPROTO_UDP);
+/*
+ * Get the addresses of a pool, and the addresses still free, added
+ * over the shards of the pool.
+ *
+ * Return -1 if the server is stopped or if there is no such pool.
+ */
 
-     return pkt;
+int dhcpd4_get_pool_usage(int n, struct dhcpd4_pool_usage *usage)
+{
+    struct dhcpd4_shard *shard;
+    int i;
 
-fail:
-     LOG_ERR("Message creation failed");
-     net_pkt_unref(pkt);
+    if (dhcpd4_tid == NULL || n < 0 || n >= dhcpd4_pool_count)
+	return -1;
+
+    usage->subnet = dhcpd4_pools[n]->subnet;
+    usage->size = 0;
+    usage->free = 0;
+
+    for (i = 0; i < CONFIG_DHCPD_WORKERS; i++) {
+#if CONFIG_DHCPD_WORKERS > 1
+	shard = &dhcpd4_workers[i].shards[n];
+#else
+	shard = &dhcpd4_shards[n];
+#endif
+	usage->size += shard->indexes->size;
+	usage->free += shard->indexes->free;
+    }
 
-     return NULL;
-}
\ No newline at end of file
+    return 0;
+}
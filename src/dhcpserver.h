@@ -9,22 +9,30 @@
 #include "options.h"
 #include "bindings.h"
 
+struct net_if;
+
 /*
  * Global association pool.
  *
  * The (static or dynamic) associations tables of the DHCP server,
  * are maintained in this global structure.
  *
+ * It serves the subnet of the interface; each subnet of another
+ * interface (device_index) or reached through relay agents has its
+ * own pool, added with dhcpd4_add_pool(). The added pools are kept
+ * with their static bindings when the server stops.
+ *
  * Note: all the IP addresses are in host order,
  *       to allow an easy manipulation.
  */
 
 struct address_pool {
-    uint32_t server_id; // this server id (IP address)
+    uint32_t server_id; // this server id (IP address of the interface)
+    uint32_t subnet;    // network of the pool, selected by longest prefix match
     uint32_t netmask;   // network mask
     uint32_t gateway;   // network gateway
 
-    int32_t device_index;    // network device index to use
+    int32_t device_index;    // network device index to use, 0 for relayed requests only
 
     pool_indexes indexes;  // used to delimitate a pool of available addresses
 
@@ -32,23 +40,69 @@ struct address_pool {
     time_t pending_time; // duration of a binding in the pending state
 
     dhcp_option_list options; // options for this pool, see queue
+    dhcp_option_blob option_blob; // options for this pool, compiled at start
     
     binding_list bindings; // associated addresses, see queue(3)
+
+    LIST_ENTRY(address_pool) link; // pools of the relayed subnets, see queue(3)
 };
 
 typedef struct address_pool address_pool;
 address_pool *dhcpd4_get_pool(void);
+int dhcpd4_add_pool(address_pool *pool);
 /*
- * Internal representation of a DHCP message,
- * with options parsed into a list...
+ * DHCP message buffer: a received request, with its options indexed
+ * in place, then rewritten into the reply, with its options serialized
+ * directly in the options section.
  */
 
+struct dhcpd4_reply_template;
+
 struct dhcpd_msg {
     dhcpd_message hdr;
-    dhcp_option_list opts;
+    struct dhcpd4_reply_template *tmpl; // headers of the replies on the receiving interface
+    uint32_t server_id;     // address of the receiving interface, 0 if not served
+    bool broadcast;         // request sent to a broadcast address
+    dhcp_option_table opts; // options of the request
+    size_t opts_len;        // length of the options of the reply
 };
 
 typedef struct dhcpd_msg dhcpd_msg;
 int dhcpd4_start(struct net_if *iface);
 int dhcpd4_stop();
+int dhcpd4_reload(void);
+int dhcpd4_running(void);
+
+/*
+ * Histogram of the number of requests served at each wakeup.
+ */
+
+#define DHCPD4_BATCH_BUCKETS 8
+
+void dhcpd4_get_batch_histogram(uint32_t histogram[DHCPD4_BATCH_BUCKETS]);
+
+/*
+ * Replies sent by destination (see RFC 2131 4.1), and replies dropped.
+ */
+
+struct dhcpd4_reply_counters {
+    uint32_t broadcast; // to 255.255.255.255
+    uint32_t unicast;   // to the address of the client (ciaddr or yiaddr)
+    uint32_t relayed;   // to a relay agent (giaddr)
+    uint32_t dropped;   // no packet available
+};
+
+void dhcpd4_get_reply_counters(struct dhcpd4_reply_counters *counters);
+
+/*
+ * Addresses of a pool (split among the workers).
+ */
+
+struct dhcpd4_pool_usage {
+    uint32_t subnet; // subnet of the pool (network order)
+    uint32_t size;   // addresses of the pool
+    uint32_t free;   // addresses not used
+};
+
+int dhcpd4_get_pool_usage(int n, struct dhcpd4_pool_usage *usage);
 #endif
\ No newline at end of file
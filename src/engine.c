@@ -0,0 +1,843 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <string.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcpmem.h"
+#include "prefixes.h"
+#include "logging.h"
+#include "stats.h"
+#include "events.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Protocol engine of the server: the pools and the serving of the
+ * requests, independent of the network stack and of the threads.
+ * The transport (dhcpserver.c on Zephyr, host/dhcpd4_posix.c on a
+ * host) receives the requests and sends the replies.
+ */
+
+#define DHCPD4_DEFAULT_LEASE_TIME	3600 // seconds
+#define DHCPD4_DEFAULT_PENDING_TIME	30   // seconds
+
+/*
+ * Global pool
+ */
+
+static address_pool dhcpd4_pool;
+address_pool *dhcpd4_get_pool(void) {
+	return &dhcpd4_pool;
+}
+
+/*
+ * Parse an option of a pool, given by its name and value,
+ * and append it to the options of the pool.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_parse_and_add_option(address_pool *pool, char * name, char * value)
+{
+
+    dhcp_option *option = dhcpd4_calloc(1, sizeof(*option));
+    if (!option) {
+	    return -1;
+    }
+    uint8_t id = dhcpd4_parse_option(option, name, value);
+    if (id == 0) {
+	    LOG_ERR("error: invalid dhcp option specified: %s,%s", name, value);
+	    dhcpd4_option_free(&option);
+	    return -1;
+    }
+    return dhcpd4_append_option(&pool->options, option);
+}
+
+/*
+ * Message handling routines.
+ */
+
+static uint8_t dhcpd4_expand_request(dhcpd_msg *msg, size_t len)
+{
+    if (msg->hdr.hlen < 1 || msg->hdr.hlen > 16)
+	return 0;
+
+    if(dhcpd4_parse_options_to_table(&msg->opts, msg->hdr.options,
+				     len - DHCP_HEADER_SIZE) == 0)
+	return 0;
+    
+    dhcp_raw_option *type_opt = dhcpd4_table_option(&msg->opts, DHCP_MESSAGE_TYPE);
+    
+    if (type_opt == NULL)
+	return 0;
+
+    uint8_t type = type_opt->data[0];
+    
+    return type;
+}
+
+/*
+ * Rewrite the header of a request into the header of its reply.
+ *
+ * The htype, hlen, xid, flags, giaddr and chaddr fields are kept,
+ * the options are emptied (the magic cookie is already there):
+ * the options of the request can not be accessed any more.
+ */
+
+static void dhcpd4_init_reply(dhcpd_msg *msg)
+{
+    msg->hdr.op = BOOTREPLY;
+    msg->hdr.hops = 0;
+
+    msg->hdr.secs = 0;
+
+    msg->hdr.ciaddr = 0;
+    msg->hdr.yiaddr = 0;
+    msg->hdr.siaddr = 0;
+
+    memset(msg->hdr.chaddr + msg->hdr.hlen, 0, sizeof(msg->hdr.chaddr) - msg->hdr.hlen);
+    memset(msg->hdr.sname, 0, sizeof(msg->hdr.sname));
+    memset(msg->hdr.file, 0, sizeof(msg->hdr.file));
+
+    msg->opts_len = sizeof(option_magic);
+}
+
+/*
+ * Room left for the options of a reply, the END option excluded.
+ */
+
+static size_t dhcpd4_reply_room(dhcpd_msg *msg)
+{
+    return sizeof(msg->hdr.options) - 1 - msg->opts_len;
+}
+
+static void dhcpd4_fill_requested_dhcp_options(struct dhcpd4_shard *shard, uint8_t *id, uint8_t len, dhcpd_msg *msg)
+{
+    int i;
+    for (i = 0; i < len; i++) {
+	    
+	if(id[i] != 0)
+	    msg->opts_len += dhcpd4_serialize_blob_option(shard->option_blob, id[i],
+							  msg->hdr.options + msg->opts_len,
+							  dhcpd4_reply_room(msg));
+	    
+    }
+}
+
+/*
+ * Turn a request into its reply, in place.
+ */
+
+static int dhcpd4_fill_dhcp_reply(struct dhcpd4_shard *shard, dhcpd_msg *msg, address_binding *binding, uint8_t type)
+{
+    uint8_t requested[255];
+    uint8_t requested_len = 0;
+
+    if (type != DHCP_NAK) { // save the parameter request list, overwritten by the reply
+	dhcp_raw_option *requested_opts = dhcpd4_table_option(&msg->opts, PARAMETER_REQUEST_LIST);
+
+	if (requested_opts) {
+	    requested_len = requested_opts->len;
+	    memcpy(requested, requested_opts->data, requested_len);
+	}
+    }
+
+    dhcpd4_init_reply(msg);
+
+    msg->opts_len += dhcpd4_serialize_option(msg->hdr.options + msg->opts_len, dhcpd4_reply_room(msg),
+					     DHCP_MESSAGE_TYPE, 1, &type);
+    msg->opts_len += dhcpd4_serialize_option(msg->hdr.options + msg->opts_len, dhcpd4_reply_room(msg),
+					     SERVER_IDENTIFIER, 4, &msg->server_id);
+    
+    if(binding != NULL) {
+	uint32_t lease_time = htonl(shard->pool->lease_time);
+	int i;
+
+	msg->hdr.yiaddr = binding->address;
+
+	msg->opts_len += dhcpd4_serialize_option(msg->hdr.options + msg->opts_len, dhcpd4_reply_room(msg),
+						 IP_ADDRESS_LEASE_TIME, 4, &lease_time);
+
+	for (i = 0; i < requested_len; i++) { // already there
+	    if (requested[i] == IP_ADDRESS_LEASE_TIME)
+		requested[i] = PAD;
+	}
+    }
+    
+    dhcpd4_fill_requested_dhcp_options(shard, requested, requested_len, msg);
+    
+    return type;
+}
+
+/*
+ * Queue the lease event of a request, to be logged out of the path
+ * of the reply (see events.c).
+ */
+
+static void dhcpd4_post_lease_event(dhcpd_msg *msg, uint8_t type, uint32_t address,
+				    address_binding *binding)
+{
+    dhcpd4_lease_event_post(type, msg->hdr.xid, msg->hdr.chaddr, msg->hdr.hlen, address,
+			    binding ? binding->status : B_EMPTY,
+			    binding && binding->is_static ? DHCPD4_LEASE_EVENT_STATIC : 0);
+}
+
+/*
+ * Offer the address of a binding. A binding not already in use
+ * (whose lease is over, or released) becomes PENDING again.
+ */
+
+static int dhcpd4_offer_binding(struct dhcpd4_shard *shard, dhcpd_msg *msg, address_binding *binding)
+{
+    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_OFFER, binding->address, binding);
+
+    if (binding->status != PENDING && binding->status != ASSOCIATED)
+	dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, PENDING,
+				  shard->pool->pending_time);
+
+    return dhcpd4_fill_dhcp_reply(shard, msg, binding, DHCP_OFFER);
+}
+
+static int dhcpd4_serve_dhcp_discover(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    address_binding *binding = dhcpd4_search_binding(shard->bindings, msg->hdr.chaddr,
+						     msg->hdr.hlen, STATIC, B_EMPTY);
+
+    if (binding) { // a static binding has been configured for this client
+
+        return dhcpd4_offer_binding(shard, msg, binding);
+
+    }
+
+    else { // use dynamic pool
+
+        /* If an address is available, the new address
+           SHOULD be chosen as follows: */
+
+	binding = dhcpd4_search_binding(shard->bindings, msg->hdr.chaddr, msg->hdr.hlen,
+					DYNAMIC, B_EMPTY);
+
+        if (binding) {
+
+            /* The client's current address as recorded in the client's current
+               binding, ELSE */
+
+            /* The client's previous address as recorded in the client's (now
+               expired or released) binding, if that address is in the server's
+               pool of available addresses and not already allocated, ELSE */
+
+            return dhcpd4_offer_binding(shard, msg, binding);
+
+        } else {
+
+	    /* The address requested in the 'Requested IP Address' option, if that
+	       address is valid and not already allocated, ELSE */
+
+	    /* A new address allocated from the server's pool of available
+	       addresses; the address is selected based on the subnet from which
+	       the message was received (if 'giaddr' is 0) or on the address of
+	       the relay agent that forwarded the message ('giaddr' when not 0). */
+
+	    // TODO: extract requested IP address
+	    uint32_t address = 0;
+	    dhcp_raw_option *address_opt = dhcpd4_table_option(&msg->opts, REQUESTED_IP_ADDRESS);
+
+	    if(address_opt != NULL)
+		memcpy(&address, address_opt->data, sizeof(address));
+	    
+	    binding = dhcpd4_new_dynamic_binding(shard->bindings, shard->indexes, address,
+						 msg->hdr.chaddr, msg->hdr.hlen);
+
+	    if (binding == NULL) {
+		dhcpd4_post_lease_event(msg, DHCPD4_LEASE_NO_ADDRESS, 0, NULL);
+		
+		return 0;
+	    }
+
+	    return dhcpd4_offer_binding(shard, msg, binding);
+	}
+
+    }
+
+    // should NOT reach here...
+}
+
+/*
+ * Search the binding of the client of a request, the static one first.
+ */
+
+static address_binding *dhcpd4_client_binding(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    address_binding *binding = dhcpd4_search_binding(shard->bindings, msg->hdr.chaddr,
+						     msg->hdr.hlen, STATIC, B_EMPTY);
+
+    if (binding == NULL)
+	binding = dhcpd4_search_binding(shard->bindings, msg->hdr.chaddr,
+					msg->hdr.hlen, DYNAMIC, B_EMPTY);
+
+    return binding;
+}
+
+/*
+ * Associate the address of a binding to its client for a new lease.
+ *
+ * An ASSOCIATED binding takes the fast path: its lease is just extended.
+ */
+
+static int dhcpd4_ack_binding(struct dhcpd4_shard *shard, dhcpd_msg *msg, address_binding *binding)
+{
+    uint32_t ciaddr = msg->hdr.ciaddr;
+    int type;
+
+    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_ACK, binding->address, binding);
+
+    if (binding->status == ASSOCIATED)
+	dhcpd4_extend_binding(shard->bindings, binding, shard->pool->lease_time);
+    else
+	dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, ASSOCIATED,
+				  shard->pool->lease_time);
+
+    type = dhcpd4_fill_dhcp_reply(shard, msg, binding, DHCP_ACK);
+
+    msg->hdr.ciaddr = ciaddr; // kept in the ack of a renewal
+
+    return type;
+}
+
+/*
+ * Serve a request, according to the state of the client (RFC 2131 4.3.2):
+ *
+ * SELECTING    the server identifier is set, the request answers an offer;
+ * INIT-REBOOT  the requested address is set and ciaddr is zero, the client
+ *              verifies its previous address;
+ * RENEWING     ciaddr is set, the client extends its lease (sent to this
+ * REBINDING    server at T1, broadcast at T2).
+ *
+ * A client without any binding is not answered, except in the SELECTING
+ * state, another server may know it.
+ */
+
+static int dhcpd4_serve_dhcp_request(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    address_binding *binding = dhcpd4_client_binding(shard, msg);
+
+    uint32_t server_id = 0;
+    dhcp_raw_option *server_id_opt = dhcpd4_table_option(&msg->opts, SERVER_IDENTIFIER);
+
+    if(server_id_opt != NULL)
+	memcpy(&server_id, server_id_opt->data, sizeof(server_id));
+
+    uint32_t address = 0;
+    dhcp_raw_option *address_opt = dhcpd4_table_option(&msg->opts, REQUESTED_IP_ADDRESS);
+
+    if(address_opt != NULL)
+	memcpy(&address, address_opt->data, sizeof(address));
+
+    if (server_id == msg->server_id) { // SELECTING, this request is an answer to our offer
+
+	if (binding != NULL && (binding->status == PENDING || binding->status == ASSOCIATED) &&
+	    (address == 0 || address == binding->address))
+	    return dhcpd4_ack_binding(shard, msg, binding);
+
+	dhcpd4_post_lease_event(msg, DHCPD4_LEASE_NAK, 0, binding);
+
+	return dhcpd4_fill_dhcp_reply(shard, msg, NULL, DHCP_NAK);
+
+    } else if (server_id != 0) { // SELECTING, answer to the offer of another server
+
+	if (binding != NULL && binding->status == PENDING) {
+	    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_CLEAR, binding->address, binding);
+
+	    dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, B_EMPTY, 0);
+	}
+
+	return 0;
+
+    } else if (msg->hdr.ciaddr == 0) { // INIT-REBOOT
+
+	if (address == 0 || binding == NULL)
+	    return 0;
+
+	if (address != binding->address ||
+	    ((address ^ shard->pool->subnet) & shard->pool->netmask) != 0) {
+	    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_NAK, address, binding);
+
+	    return dhcpd4_fill_dhcp_reply(shard, msg, NULL, DHCP_NAK);
+	}
+
+	return dhcpd4_ack_binding(shard, msg, binding);
+
+    } else { // RENEWING or REBINDING
+
+	if (binding == NULL)
+	    return 0;
+
+	if (msg->hdr.ciaddr != binding->address) {
+	    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_NAK, msg->hdr.ciaddr, binding);
+
+	    return dhcpd4_fill_dhcp_reply(shard, msg, NULL, DHCP_NAK);
+	}
+
+	return dhcpd4_ack_binding(shard, msg, binding);
+    }
+}
+
+static int dhcpd4_serve_dhcp_decline(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    address_binding *binding = NULL;
+
+    uint32_t address = 0;
+    dhcp_raw_option *address_opt = dhcpd4_table_option(&msg->opts, REQUESTED_IP_ADDRESS);
+
+    if(address_opt != NULL)
+	memcpy(&address, address_opt->data, sizeof(address));
+
+    if (address != 0) { // the declined address must be bound to this client
+	binding = dhcpd4_search_binding_by_address(shard->bindings, shard->indexes,
+						   address);
+
+	if (binding != NULL &&
+	    (binding->cident_len != msg->hdr.hlen ||
+	     memcmp(dhcpd4_binding_cident(binding), msg->hdr.chaddr, msg->hdr.hlen) != 0))
+	    binding = NULL;
+
+    } else
+	binding = dhcpd4_search_binding(shard->bindings, msg->hdr.chaddr,
+					msg->hdr.hlen, STATIC_OR_DYNAMIC, PENDING);
+
+    if(binding != NULL &&
+       (binding->status == PENDING || binding->status == ASSOCIATED)) {
+	dhcpd4_post_lease_event(msg, DHCPD4_LEASE_DECLINE, binding->address, binding);
+
+	if (binding->is_static)
+	    dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, B_EMPTY, 0);
+	else
+	    dhcpd4_remove_binding(shard->bindings, shard->indexes, binding);
+    }
+
+    return 0;
+}
+
+static int dhcpd4_serve_dhcp_release(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    address_binding *binding = dhcpd4_search_binding(
+	    shard->bindings, msg->hdr.chaddr, msg->hdr.hlen, STATIC_OR_DYNAMIC, ASSOCIATED);
+
+    if(binding != NULL) {
+	dhcpd4_post_lease_event(msg, DHCPD4_LEASE_RELEASE, binding->address, binding);
+
+	dhcpd4_set_binding_status(shard->bindings, shard->indexes, binding, RELEASED, 0);
+    }
+
+    return 0;
+}
+
+static int dhcpd4_serve_dhcp_inform(struct dhcpd4_shard *shard, dhcpd_msg *msg)
+{
+    uint32_t ciaddr = msg->hdr.ciaddr;
+    int type;
+
+    dhcpd4_post_lease_event(msg, DHCPD4_LEASE_INFORM, msg->hdr.ciaddr, NULL);
+    type = dhcpd4_fill_dhcp_reply(shard, msg, NULL, DHCP_ACK);
+
+    msg->hdr.ciaddr = ciaddr; // the ack is sent to the address of the client
+
+    return type;
+}
+
+/*
+ * Pools of the subnets reached through relay agents,
+ * served from the next start of the server, and kept
+ * with their static bindings when it stops.
+ */
+
+static LIST_HEAD(, address_pool) dhcpd4_relay_pools = LIST_HEAD_INITIALIZER(dhcpd4_relay_pools);
+
+/*
+ * Pools served (the pool of the interface first) and the table
+ * selecting the pool of a request, read only while the server runs.
+ */
+
+address_pool **dhcpd4_pools;
+int dhcpd4_pool_count;
+static prefix_table dhcpd4_prefixes;
+
+struct dhcpd4_shard *dhcpd4_shards; // shards of the server thread, one per pool
+
+/*
+ * Add the pool of a relayed subnet, delimited by its subnet
+ * and netmask fields.
+ *
+ * Return 0 on success, -1 if the subnet already has a pool.
+ */
+
+int dhcpd4_add_pool(address_pool *pool)
+{
+    address_pool *other;
+
+    pool->subnet &= pool->netmask;
+
+    LIST_FOREACH(other, &dhcpd4_relay_pools, link) {
+	if (other->subnet == pool->subnet && other->netmask == pool->netmask)
+	    return -1;
+    }
+
+    LIST_INSERT_HEAD(&dhcpd4_relay_pools, pool, link);
+
+    return 0;
+}
+
+/*
+ * Keep a static binding of a relay pool, reset as configured,
+ * and delete any other binding.
+ */
+
+static void dhcpd4_keep_static_binding(address_binding *binding, void *arg)
+{
+    address_pool *pool = arg;
+
+    if (binding->is_static)
+	dhcpd4_set_binding_status(&pool->bindings, &pool->indexes, binding, B_EMPTY, 0);
+    else
+	dhcpd4_remove_binding(&pool->bindings, &pool->indexes, binding);
+}
+
+/*
+ * Delete the bindings and the indexes of the pools served. The relay
+ * pools stay registered with their static bindings, to be served
+ * again from the next start; the pool of the interface is set up
+ * again by each start.
+ */
+
+void dhcpd4_delete_pools(void)
+{
+    int i;
+
+    for (i = 0; dhcpd4_pools != NULL && i < dhcpd4_pool_count; i++) {
+	address_pool *pool = dhcpd4_pools[i];
+
+	if (i == 0)
+	    dhcpd4_delete_binding_list(&pool->bindings);
+	else
+	    dhcpd4_foreach_binding(&pool->bindings, dhcpd4_keep_static_binding, pool);
+
+	dhcpd4_delete_pool_indexes(&pool->indexes);
+	dhcpd4_delete_option_blob(&pool->option_blob);
+    }
+
+    dhcpd4_free(dhcpd4_pools);
+    dhcpd4_free(dhcpd4_shards);
+    dhcpd4_delete_prefix_table(&dhcpd4_prefixes);
+    dhcpd4_pool_count = 0;
+}
+
+/*
+ * Collect the pools to serve and build their prefix table. The pool
+ * of the interface covers the subnet of its SUBNET_MASK option, or all
+ * the addresses if no netmask is known.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+int dhcpd4_init_pools(address_pool *pool)
+{
+    address_pool *relay;
+    dhcp_option *netmask;
+    prefix_entry *prefixes;
+    int i, ret = -1;
+
+    if (pool->netmask == 0 && (netmask = dhcpd4_search_option(&pool->options, SUBNET_MASK)) != NULL &&
+	netmask->len == sizeof(pool->netmask))
+	memcpy(&pool->netmask, netmask->data, sizeof(pool->netmask));
+
+    pool->subnet = pool->indexes.first & pool->netmask;
+
+    dhcpd4_pool_count = 1;
+    LIST_FOREACH(relay, &dhcpd4_relay_pools, link)
+	dhcpd4_pool_count++;
+
+    dhcpd4_pools = dhcpd4_calloc(dhcpd4_pool_count, sizeof(*dhcpd4_pools));
+    dhcpd4_shards = dhcpd4_calloc(dhcpd4_pool_count, sizeof(*dhcpd4_shards));
+    prefixes = dhcpd4_calloc(dhcpd4_pool_count, sizeof(*prefixes));
+
+    if (dhcpd4_pools != NULL && dhcpd4_shards != NULL && prefixes != NULL) {
+	dhcpd4_pools[0] = pool;
+
+	i = 1;
+	LIST_FOREACH(relay, &dhcpd4_relay_pools, link)
+	    dhcpd4_pools[i++] = relay;
+
+	for (i = 0; i < dhcpd4_pool_count; i++) {
+	    address_pool *p = dhcpd4_pools[i];
+
+	    if (p->lease_time == 0)
+		p->lease_time = DHCPD4_DEFAULT_LEASE_TIME;
+
+	    if (p->pending_time == 0)
+		p->pending_time = DHCPD4_DEFAULT_PENDING_TIME;
+
+	    prefixes[i].network = p->subnet;
+	    prefixes[i].netmask = p->netmask;
+	    prefixes[i].value = i;
+
+	    dhcpd4_shards[i].pool = p;
+	    dhcpd4_shards[i].bindings = &p->bindings;
+	    dhcpd4_shards[i].indexes = &p->indexes;
+	    dhcpd4_shards[i].option_blob = &p->option_blob;
+	    dhcpd4_shards[i].deadline = 0;
+	}
+
+	ret = dhcpd4_build_prefix_table(&dhcpd4_prefixes, prefixes, dhcpd4_pool_count);
+    }
+
+    dhcpd4_free(prefixes);
+
+    if (ret != 0)
+	dhcpd4_delete_pools();
+
+    return ret;
+}
+
+/*
+ * Get the index of the pool holding an address, by longest prefix match.
+ *
+ * Return -1 if no pool holds the address.
+ */
+
+int dhcpd4_lookup_pool(uint32_t address)
+{
+    return dhcpd4_lookup_prefix(&dhcpd4_prefixes, address);
+}
+
+/*
+ * Select the shard of the pool serving a request: the pool of the
+ * longest prefix holding the address of the relay agent, or the
+ * address of the receiving interface if the request is not relayed.
+ *
+ * Return NULL if no pool serves the request.
+ */
+
+static struct dhcpd4_shard *dhcpd4_select_shard(struct dhcpd4_shard *shards, dhcpd_msg *msg)
+{
+    uint32_t key = msg->hdr.giaddr != 0 ? msg->hdr.giaddr : msg->server_id;
+    int n = dhcpd4_lookup_prefix(&dhcpd4_prefixes, key);
+
+    return n < 0 ? NULL : &shards[n];
+}
+
+/*
+ * Run the bindings timers of the shards whose deadline is over,
+ * and compute their next deadline. A shard whose bindings changed
+ * has a zero deadline.
+ *
+ * Return the time before the first deadline in milliseconds,
+ * or -1 if no binding is scheduled.
+ */
+
+int dhcpd4_run_shard_timers(struct dhcpd4_shard *shards, int count)
+{
+    int64_t now = k_uptime_get();
+    int64_t next = -1;
+    int i;
+
+    for (i = 0; i < count; i++) {
+	struct dhcpd4_shard *shard = &shards[i];
+
+	if (shard->deadline >= 0 && shard->deadline <= now) {
+	    int timeout;
+
+	    dhcpd4_run_bindings_timer(shard->bindings, shard->indexes);
+
+	    timeout = dhcpd4_bindings_timer_timeout(shard->bindings);
+	    shard->deadline = timeout < 0 ? -1 : now + timeout;
+	}
+
+	if (shard->deadline >= 0 && (next < 0 || shard->deadline < next))
+	    next = shard->deadline;
+    }
+
+    return next < 0 ? -1 : (int)MIN(next - now, INT32_MAX);
+}
+
+/*
+ * Compile again the pool options used by a shard.
+ */
+
+void dhcpd4_reload_shard(struct dhcpd4_shard *shard)
+{
+    if (dhcpd4_compile_option_list(shard->option_blob, &shard->pool->options) != 0)
+	LOG_ERR("Out of memory reloading the pool options");
+    else
+	LOG_INF("Pool options reloaded");
+}
+
+/*
+ * Serve a request received in msg, in place, from the shards
+ * of a thread (one per pool).
+ *
+ * No memory is allocated for the request: its options are indexed in
+ * msg and the reply is written over it, so a request dropped on any
+ * path leaves nothing to free. Only a new binding takes a record.
+ *
+ * Return the DHCP message type of the reply left in msg, its options
+ * ending at msg->opts_len, or 0 if there is no reply.
+ */
+
+uint8_t dhcpd4_serve_message(struct dhcpd4_shard *shards, dhcpd_msg *msg, size_t len,
+			     const struct sockaddr_in *client_sock)
+{
+    struct dhcpd4_shard *shard;
+    uint8_t type, request;
+
+    if (len < DHCP_HEADER_SIZE + 5 || msg->hdr.op != BOOTREQUEST) {
+	dhcpd4_count(DHCPD4_STAT_MALFORMED);
+	return 0; // TODO: check the magic number 300
+    }
+
+    if (msg->server_id == 0) {
+	dhcpd4_count(DHCPD4_STAT_DROP_INTERFACE);
+	return 0; // received on an interface not served
+    }
+
+    if((type = dhcpd4_expand_request(msg, len)) == 0) {
+	log_error("%s.%u: invalid request received",
+		  str_ip(client_sock->sin_addr.s_addr), ntohs(client_sock->sin_port));
+	dhcpd4_count(DHCPD4_STAT_MALFORMED);
+	return 0;
+    }
+
+    if ((shard = dhcpd4_select_shard(shards, msg)) == NULL) {
+	log_info("%s.%u: no pool for the relay agent %s",
+		 str_ip(client_sock->sin_addr.s_addr), ntohs(client_sock->sin_port),
+		 str_ip(msg->hdr.giaddr));
+	dhcpd4_count(DHCPD4_STAT_DROP_POOL);
+	return 0;
+    }
+
+    request = type;
+
+    switch (type) {
+
+    case DHCP_DISCOVER:
+	dhcpd4_count(DHCPD4_STAT_RX_DISCOVER);
+	type = dhcpd4_serve_dhcp_discover(shard, msg);
+	break;
+
+    case DHCP_REQUEST:
+	dhcpd4_count(DHCPD4_STAT_RX_REQUEST);
+	type = dhcpd4_serve_dhcp_request(shard, msg);
+	break;
+
+    case DHCP_DECLINE:
+	dhcpd4_count(DHCPD4_STAT_RX_DECLINE);
+	type = dhcpd4_serve_dhcp_decline(shard, msg);
+	break;
+
+    case DHCP_RELEASE:
+	dhcpd4_count(DHCPD4_STAT_RX_RELEASE);
+	type = dhcpd4_serve_dhcp_release(shard, msg);
+	break;
+
+    case DHCP_INFORM:
+	dhcpd4_count(DHCPD4_STAT_RX_INFORM);
+	type = dhcpd4_serve_dhcp_inform(shard, msg);
+	break;
+
+    default:
+	LOG_ERR("%s.%u: request with invalid DHCP message type option 0x%02x",
+		str_ip(client_sock->sin_addr.s_addr), ntohs(client_sock->sin_port),type);
+	dhcpd4_count(DHCPD4_STAT_RX_OTHER);
+	type = 0;
+	break;
+    }
+
+    shard->deadline = 0; // its bindings may have been scheduled
+
+    if (type == 0) {
+	// no reply is due to a DECLINE, a RELEASE, or an unknown type (RX_OTHER)
+	if (request == DHCP_DISCOVER || request == DHCP_REQUEST || request == DHCP_INFORM)
+	    dhcpd4_count(DHCPD4_STAT_DROP_IGNORED);
+	return 0;
+    }
+
+    msg->hdr.options[msg->opts_len++] = END; // room always left by dhcpd4_reply_room()
+
+    return type;
+}
+
+/*
+ * Serve a request with no socket nor thread, on the shards of the
+ * server thread: the pools must be set up (dhcpd4_init_pools() and
+ * dhcpd4_init_shards()) and served by the caller only, the server
+ * being stopped. The request is copied, and its reply written in out,
+ * whose size is passed in out_len.
+ *
+ * Return the DHCP message type of the reply, its length set in out_len,
+ * 0 if there is no reply, or -1 if out is too small for the reply.
+ */
+
+int dhcpd4_handle(const uint8_t *req, size_t len, uint8_t *out, size_t *out_len,
+		  const dhcpd4_rxinfo *rxinfo)
+{
+    static dhcpd_msg msg; // not on the stack of the caller (a shell command)
+    struct sockaddr_in client_sock = {
+	.sin_family = AF_INET,
+	.sin_addr.s_addr = rxinfo->src_addr,
+	.sin_port = rxinfo->src_port,
+    };
+    uint8_t type;
+    size_t reply_len;
+
+    len = MIN(len, sizeof(msg.hdr)); // as a datagram truncated by the socket
+
+    memcpy(&msg.hdr, req, len);
+    msg.tmpl = NULL;
+    msg.server_id = rxinfo->server_id;
+
+    if ((type = dhcpd4_serve_message(dhcpd4_shards, &msg, len, &client_sock)) == 0) {
+	*out_len = 0;
+	return 0;
+    }
+
+    reply_len = DHCP_HEADER_SIZE + msg.opts_len;
+
+    if (reply_len > *out_len)
+	return -1;
+
+    memcpy(out, &msg.hdr, reply_len);
+    *out_len = reply_len;
+
+    return type;
+}
+
+/*
+ * Allocate the indexes and compile the options of the pools.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_init_shards(void)
+{
+    int i;
+
+    for (i = 0; i < dhcpd4_pool_count; i++) {
+	address_pool *pool = dhcpd4_pools[i];
+
+	if (dhcpd4_init_pool_indexes(&pool->indexes, &pool->bindings) != 0) {
+	    LOG_ERR("Invalid address pool of subnet %s", str_ip(pool->subnet));
+	    return -1;
+	}
+
+	if (dhcpd4_compile_option_list(&pool->option_blob, &pool->options) != 0) {
+	    LOG_ERR("Out of memory for the options of subnet %s", str_ip(pool->subnet));
+	    return -1;
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "dhcpserver.h"
+
+/*
+ * Bindings and addresses served by a thread.
+ *
+ * With a single worker, the shard is the pool itself. With
+ * CONFIG_DHCPD_WORKERS workers, the clients are split among the shards
+ * by a hash of their hardware address, and the pool addresses in as many
+ * ranges: each worker updates only its shard, without any lock, the
+ * pool configuration being read only while the server runs.
+ */
+
+struct dhcpd4_shard {
+    address_pool *pool;            // configuration of the pool
+    binding_list *bindings;        // bindings of the clients of the shard
+    pool_indexes *indexes;         // addresses of the shard
+    dhcp_option_blob *option_blob; // options of the pool
+    int64_t deadline;              // uptime of the next run of the bindings timer, -1 if none
+};
+
+/*
+ * Pools served (the pool of the interface first), and the shards
+ * of the server thread, one per pool, read only while the server runs.
+ */
+
+extern address_pool **dhcpd4_pools;
+extern int dhcpd4_pool_count;
+extern struct dhcpd4_shard *dhcpd4_shards;
+
+/*
+ * Reception of a request passed to dhcpd4_handle(), as known from
+ * its datagram (addresses and port in network order).
+ */
+
+struct dhcpd4_rxinfo {
+    uint32_t server_id; // address of the receiving interface, 0 if not served
+    uint32_t src_addr;  // source of the request
+    uint16_t src_port;
+};
+
+typedef struct dhcpd4_rxinfo dhcpd4_rxinfo;
+
+/* Prototypes */
+
+int dhcpd4_parse_and_add_option(address_pool *pool, char * name, char * value);
+
+int dhcpd4_init_pools(address_pool *pool);
+int dhcpd4_init_shards(void);
+void dhcpd4_delete_pools(void);
+int dhcpd4_lookup_pool(uint32_t address);
+
+uint8_t dhcpd4_serve_message(struct dhcpd4_shard *shards, dhcpd_msg *msg, size_t len,
+			     const struct sockaddr_in *client_sock);
+int dhcpd4_handle(const uint8_t *req, size_t len, uint8_t *out, size_t *out_len,
+		  const dhcpd4_rxinfo *rxinfo);
+int dhcpd4_run_shard_timers(struct dhcpd4_shard *shards, int count);
+void dhcpd4_reload_shard(struct dhcpd4_shard *shard);
+
+#endif
@@ -0,0 +1,252 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "events.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+#define DHCPD4_LEASE_EVENTS_MASK (CONFIG_DHCPD_LEASE_EVENTS - 1)
+
+BUILD_ASSERT((CONFIG_DHCPD_LEASE_EVENTS & DHCPD4_LEASE_EVENTS_MASK) == 0,
+	     "CONFIG_DHCPD_LEASE_EVENTS must be a power of two");
+
+/*
+ * Bounded ring of several producers, without lock: the position of
+ * the next event is taken by compare and swap, then the sequence
+ * number of its slot tells the consumer when the event is written.
+ *
+ * The slot of the position pos is free when its sequence number is pos,
+ * full when it is pos + 1, and free again for the next round when it is
+ * pos + CONFIG_DHCPD_LEASE_EVENTS. A slot keeps its sequence number less
+ * its index, so that the ring is ready when zeroed.
+ */
+
+struct dhcpd4_lease_slot {
+    atomic_t seq;             // sequence number, less the index of the slot
+    dhcpd4_lease_event event;
+};
+
+static struct dhcpd4_lease_slot dhcpd4_lease_ring[CONFIG_DHCPD_LEASE_EVENTS];
+static atomic_t dhcpd4_lease_head;  // position of the next event posted
+static uint32_t dhcpd4_lease_tail;  // position of the next event drained
+static atomic_t dhcpd4_lease_lost;  // events lost, ring full
+static K_MUTEX_DEFINE(dhcpd4_lease_drain_lock);
+
+#if defined(CONFIG_DHCPD_LEASE_EVENTS_LOG)
+static void dhcpd4_lease_log_wake(void);
+#endif
+
+static uint32_t dhcpd4_lease_slot_seq(uint32_t pos, struct dhcpd4_lease_slot **slot)
+{
+    *slot = &dhcpd4_lease_ring[pos & DHCPD4_LEASE_EVENTS_MASK];
+
+    return (uint32_t)atomic_get(&(*slot)->seq) + (pos & DHCPD4_LEASE_EVENTS_MASK);
+}
+
+/*
+ * Queue a lease event, without waiting: the event is lost
+ * (and counted) if the ring is full.
+ */
+
+void dhcpd4_lease_event_post(uint8_t type, uint32_t xid, const uint8_t *chaddr, uint8_t hlen,
+			     uint32_t address, uint8_t status, uint8_t flags)
+{
+    struct dhcpd4_lease_slot *slot;
+    uint32_t pos;
+    int32_t diff;
+
+    do {
+	pos = (uint32_t)atomic_get(&dhcpd4_lease_head);
+	diff = (int32_t)(dhcpd4_lease_slot_seq(pos, &slot) - pos);
+
+	if (diff < 0) {
+	    atomic_inc(&dhcpd4_lease_lost);
+	    return;
+	}
+    } while (diff > 0 || !atomic_cas(&dhcpd4_lease_head, (atomic_val_t)pos, (atomic_val_t)(pos + 1)));
+
+    slot->event.time = k_uptime_get_32();
+    slot->event.xid = xid;
+    slot->event.address = address;
+    slot->event.type = type;
+    slot->event.status = status;
+    slot->event.flags = flags;
+    slot->event.hlen = hlen;
+    memset(slot->event.chaddr, 0, sizeof(slot->event.chaddr));
+    memcpy(slot->event.chaddr, chaddr, MIN(hlen, sizeof(slot->event.chaddr)));
+
+    atomic_set(&slot->seq, (atomic_val_t)(pos + 1 - (pos & DHCPD4_LEASE_EVENTS_MASK)));
+
+#if defined(CONFIG_DHCPD_LEASE_EVENTS_LOG)
+    dhcpd4_lease_log_wake();
+#endif
+}
+
+/*
+ * Pass the queued events to f, oldest first, and get the number of
+ * events lost since the last drain.
+ *
+ * Return the number of events drained.
+ */
+
+int dhcpd4_lease_events_drain(void (*f)(const dhcpd4_lease_event *event, void *arg), void *arg,
+			      uint32_t *lost)
+{
+    struct dhcpd4_lease_slot *slot;
+    dhcpd4_lease_event event;
+    int count = 0;
+
+    k_mutex_lock(&dhcpd4_lease_drain_lock, K_FOREVER);
+
+    for (;;) {
+	uint32_t pos = dhcpd4_lease_tail;
+
+	if (dhcpd4_lease_slot_seq(pos, &slot) != pos + 1)
+	    break; // empty, or event being written
+
+	event = slot->event;
+	atomic_set(&slot->seq, (atomic_val_t)(pos + CONFIG_DHCPD_LEASE_EVENTS - (pos & DHCPD4_LEASE_EVENTS_MASK)));
+	dhcpd4_lease_tail = pos + 1;
+
+	f(&event, arg);
+	count++;
+    }
+
+    *lost = (uint32_t)atomic_clear(&dhcpd4_lease_lost);
+
+    k_mutex_unlock(&dhcpd4_lease_drain_lock);
+
+    return count;
+}
+
+static const char *dhcpd4_lease_status(int status)
+{
+    switch(status) {
+    case B_EMPTY:
+	return "empty";
+    case PENDING:
+	return "pending";
+    case ASSOCIATED:
+	return "associated";
+    case RELEASED:
+	return "released";
+    case EXPIRED:
+	return "expired";
+    default:
+	return "?";
+    }
+}
+
+/*
+ * Format a lease event in buf.
+ *
+ * Return the length of the text, as snprintf().
+ */
+
+int dhcpd4_lease_event_format(const dhcpd4_lease_event *event, char *buf, size_t len)
+{
+    char ip[INET_ADDRSTRLEN];
+    char mac[18];
+
+    inet_ntop(AF_INET, &event->address, ip, sizeof(ip));
+    snprintf(mac, sizeof(mac), "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x",
+	     event->chaddr[0], event->chaddr[1], event->chaddr[2],
+	     event->chaddr[3], event->chaddr[4], event->chaddr[5]);
+
+    switch (event->type) {
+
+    case DHCPD4_LEASE_OFFER:
+	return snprintf(buf, len, "Offer %s to %s%s, %s status", ip, mac,
+			event->flags & DHCPD4_LEASE_EVENT_STATIC ? " (static)" : "",
+			dhcpd4_lease_status(event->status));
+
+    case DHCPD4_LEASE_NO_ADDRESS:
+	return snprintf(buf, len, "Can not offer an address to %s, no address available.", mac);
+
+    case DHCPD4_LEASE_ACK:
+	return snprintf(buf, len, "Ack %s to %s, associated", ip, mac);
+
+    case DHCPD4_LEASE_NAK:
+	if (event->address == 0)
+	    return snprintf(buf, len, "Nak to %s, not associated", mac);
+
+	return snprintf(buf, len, "Nak %s to %s, not its address", ip, mac);
+
+    case DHCPD4_LEASE_CLEAR:
+	return snprintf(buf, len, "Clearing %s of %s, accepted another server offer", ip, mac);
+
+    case DHCPD4_LEASE_DECLINE:
+	return snprintf(buf, len, "Declined %s by %s", ip, mac);
+
+    case DHCPD4_LEASE_RELEASE:
+	return snprintf(buf, len, "Released %s by %s", ip, mac);
+
+    case DHCPD4_LEASE_INFORM:
+	return snprintf(buf, len, "Info to %s", mac);
+
+    default:
+	return snprintf(buf, len, "Event %u of %s", event->type, mac);
+    }
+}
+
+#if defined(CONFIG_DHCPD_LEASE_EVENTS_LOG)
+
+/*
+ * Log the queued lease events. The log thread sleeps until an event
+ * is posted to an empty ring, then waits CONFIG_DHCPD_LEASE_EVENTS_LOG_MS
+ * for the events that follow, to log them together.
+ */
+
+static atomic_t dhcpd4_lease_log_armed; // the log thread is woken up, and has not drained yet
+static K_SEM_DEFINE(dhcpd4_lease_log_sem, 0, 1);
+
+static void dhcpd4_lease_log_wake(void)
+{
+    if (atomic_cas(&dhcpd4_lease_log_armed, 0, 1))
+	k_sem_give(&dhcpd4_lease_log_sem);
+}
+
+static void dhcpd4_log_lease_event(const dhcpd4_lease_event *event, void *arg)
+{
+    char text[80];
+
+    ARG_UNUSED(arg);
+
+    dhcpd4_lease_event_format(event, text, sizeof(text));
+    LOG_INF("%s (xid 0x%08x)", text, event->xid);
+}
+
+static void dhcpd4_lease_log_task(void *p1, void *p2, void *p3)
+{
+    uint32_t lost;
+
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    while (true) {
+	k_sem_take(&dhcpd4_lease_log_sem, K_FOREVER);
+	k_sleep(K_MSEC(CONFIG_DHCPD_LEASE_EVENTS_LOG_MS));
+
+	// an event posted from now on wakes the thread up again
+
+	atomic_clear(&dhcpd4_lease_log_armed);
+	dhcpd4_lease_events_drain(dhcpd4_log_lease_event, NULL, &lost);
+
+	if (lost != 0)
+	    LOG_WRN("%u lease events lost (ring full)", lost);
+    }
+}
+
+K_THREAD_DEFINE(dhcpd4_lease_log, 1024, dhcpd4_lease_log_task, NULL, NULL, NULL,
+		K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Header of the lease events: compact binary records of the decisions
+ * of the server, queued by the workers in a lock-free ring, then
+ * formatted and logged by a thread of low priority (or printed by the
+ * shell), out of the path of the replies.
+ */
+
+enum {
+    DHCPD4_LEASE_OFFER = 0,   // address offered
+    DHCPD4_LEASE_NO_ADDRESS,  // no address left to offer
+    DHCPD4_LEASE_ACK,         // address associated
+    DHCPD4_LEASE_NAK,         // address refused (0 if the client has none)
+    DHCPD4_LEASE_CLEAR,       // offer cleared, the client selected another server
+    DHCPD4_LEASE_DECLINE,     // address declined by the client
+    DHCPD4_LEASE_RELEASE,     // address released by the client
+    DHCPD4_LEASE_INFORM,      // configuration sent to a client with an address
+};
+
+#define DHCPD4_LEASE_EVENT_STATIC 0x01 // static binding
+
+struct dhcpd4_lease_event {
+    uint32_t time;      // uptime (ms)
+    uint32_t xid;       // transaction ID of the request
+    uint32_t address;   // address of the event (network order)
+    uint8_t type;       // DHCPD4_LEASE_*
+    uint8_t status;     // status of the binding before the event
+    uint8_t flags;      // DHCPD4_LEASE_EVENT_*
+    uint8_t hlen;       // hardware address len
+    uint8_t chaddr[6];  // hardware address of the client (truncated)
+};
+
+typedef struct dhcpd4_lease_event dhcpd4_lease_event;
+
+/* Prototypes */
+
+void dhcpd4_lease_event_post(uint8_t type, uint32_t xid, const uint8_t *chaddr, uint8_t hlen,
+			     uint32_t address, uint8_t status, uint8_t flags);
+int dhcpd4_lease_event_format(const dhcpd4_lease_event *event, char *buf, size_t len);
+int dhcpd4_lease_events_drain(void (*f)(const dhcpd4_lease_event *event, void *arg), void *arg,
+			      uint32_t *lost);
+
+#endif
@@ -0,0 +1,437 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <string.h>
+#include "bindings.h"
+#include "journal.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * The journal is kept in the dhcpd_partition flash partition,
+ * or in the storage partition if the board has none.
+ */
+
+#if FIXED_PARTITION_EXISTS(dhcpd_partition)
+#define DHCPD4_JOURNAL_PARTITION FIXED_PARTITION_ID(dhcpd_partition)
+#else
+#define DHCPD4_JOURNAL_PARTITION FIXED_PARTITION_ID(storage_partition)
+#endif
+
+#define DHCPD4_JOURNAL_MAGIC   0x44484344 // "DHCD"
+#define DHCPD4_JOURNAL_VERSION 2 // 2: sequence number in the records
+
+#define DHCPD4_JOURNAL_STK_SIZE 1024u
+
+// longest record written, padded to the write alignment of the flash
+#define DHCPD4_JOURNAL_WRITE_MAX 128u
+
+static struct fcb dhcpd4_fcb;
+static struct flash_sector dhcpd4_journal_sectors[CONFIG_DHCPD_JOURNAL_SECTORS];
+static bool dhcpd4_journal_mounted;
+static bool dhcpd4_journal_workq_started;
+static bool dhcpd4_journal_compacting;                   // no sector dropped while compacting
+static struct flash_sector *dhcpd4_journal_compact_from; // first sector written by the compaction
+
+/*
+ * Group commit: the records are buffered, and the commit thread writes
+ * a whole buffer at once while the other one is filled.
+ */
+
+static dhcpd4_lease_record dhcpd4_journal_buffers[2][CONFIG_DHCPD_JOURNAL_BUFFER];
+static uint32_t dhcpd4_journal_count[2]; // records in each buffer
+static int dhcpd4_journal_fill;          // buffer being filled
+static uint32_t dhcpd4_journal_seq;      // sequence number of the next record
+static struct k_spinlock dhcpd4_journal_lock;
+
+static atomic_t dhcpd4_journal_started;
+static atomic_t dhcpd4_journal_lost; // records not buffered since the last commit
+
+static K_THREAD_STACK_DEFINE(dhcpd4_journal_stk, DHCPD4_JOURNAL_STK_SIZE);
+static struct k_work_q dhcpd4_journal_workq;
+
+static void dhcpd4_journal_commit(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(dhcpd4_journal_work, dhcpd4_journal_commit);
+
+/*
+ * Fill the lease record of a binding.
+ */
+
+void dhcpd4_lease_record_of(dhcpd4_lease_record *record, const address_binding *binding, uint32_t lease_time)
+{
+    memset(record, 0, sizeof(*record));
+    record->status = binding->status;
+    record->cident_len = binding->cident_len;
+    record->address = binding->address;
+    record->lease = binding->status == ASSOCIATED ? lease_time : 0;
+    memcpy(record->cident, dhcpd4_binding_cident(binding), binding->cident_len);
+}
+
+/*
+ * Mount the journal partition and start the commit thread.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_journal_init(void)
+{
+    uint32_t count = ARRAY_SIZE(dhcpd4_journal_sectors);
+    int ret;
+
+    if (dhcpd4_journal_mounted)
+	return 0;
+
+    ret = flash_area_get_sectors(DHCPD4_JOURNAL_PARTITION, &count, dhcpd4_journal_sectors);
+
+    if (ret != 0 && ret != -ENOMEM) { // -ENOMEM: more sectors than used
+	LOG_ERR("Lease journal partition not available (%d)", ret);
+	return -1;
+    }
+
+    dhcpd4_fcb.f_magic = DHCPD4_JOURNAL_MAGIC;
+    dhcpd4_fcb.f_version = DHCPD4_JOURNAL_VERSION;
+    dhcpd4_fcb.f_sectors = dhcpd4_journal_sectors;
+    dhcpd4_fcb.f_sector_cnt = count;
+    dhcpd4_fcb.f_scratch_cnt = 0;
+
+    if ((ret = fcb_init(DHCPD4_JOURNAL_PARTITION, &dhcpd4_fcb)) != 0) {
+	LOG_ERR("Lease journal not initialized (%d)", ret);
+	return -1;
+    }
+
+    if (ROUND_UP(sizeof(dhcpd4_lease_record), MAX(dhcpd4_fcb.f_align, 1)) > DHCPD4_JOURNAL_WRITE_MAX) {
+	LOG_ERR("Lease journal not initialized, flash write alignment %u not supported", dhcpd4_fcb.f_align);
+	return -1;
+    }
+
+    if (!dhcpd4_journal_workq_started) {
+	k_work_queue_start(&dhcpd4_journal_workq, dhcpd4_journal_stk,
+			   K_THREAD_STACK_SIZEOF(dhcpd4_journal_stk), K_LOWEST_APPLICATION_THREAD_PRIO, NULL);
+	k_thread_name_set(&dhcpd4_journal_workq.thread, "dhcpd4 journal");
+	dhcpd4_journal_workq_started = true;
+    }
+
+    dhcpd4_journal_mounted = true;
+
+    return 0;
+}
+
+/*
+ * Forget the journal, as at a reboot: the records stay in flash and
+ * the next dhcpd4_journal_init() mounts the journal again. Recording
+ * must be stopped.
+ */
+
+void dhcpd4_journal_unmount(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&dhcpd4_journal_lock);
+
+    dhcpd4_journal_count[0] = dhcpd4_journal_count[1] = 0;
+    dhcpd4_journal_seq = 0;
+    k_spin_unlock(&dhcpd4_journal_lock, key);
+
+    memset(&dhcpd4_fcb, 0, sizeof(dhcpd4_fcb));
+    dhcpd4_journal_mounted = false;
+}
+
+/*
+ * Append a record to the journal, dropping the oldest sector if full
+ * (unless compacting: the older records are kept until the end of it).
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int dhcpd4_journal_write(const dhcpd4_lease_record *record)
+{
+    uint8_t data[DHCPD4_JOURNAL_WRITE_MAX] __aligned(4);
+    uint16_t size = DHCPD4_LEASE_HEADER_SIZE + record->cident_len;
+    uint16_t len = ROUND_UP(size, MAX(dhcpd4_fcb.f_align, 1)); // not beyond data, see dhcpd4_journal_init()
+    struct fcb_entry loc;
+    int ret;
+
+    memcpy(data, record, size);
+    memset(data + size, 0, len - size);
+
+    ret = fcb_append(&dhcpd4_fcb, len, &loc);
+
+    if (ret == -ENOSPC && !dhcpd4_journal_compacting) {
+	LOG_WRN("Lease journal full, oldest records dropped");
+
+	if (fcb_rotate(&dhcpd4_fcb) == 0)
+	    ret = fcb_append(&dhcpd4_fcb, len, &loc);
+    }
+
+    if (ret != 0 ||
+	flash_area_write(dhcpd4_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), data, len) != 0 ||
+	fcb_append_finish(&dhcpd4_fcb, &loc) != 0)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Write the buffer filled since the last commit.
+ */
+
+static void dhcpd4_journal_commit(struct k_work *work)
+{
+    k_spinlock_key_t key;
+    uint32_t count, lost, failed = 0;
+    uint32_t i;
+    int n;
+
+    ARG_UNUSED(work);
+
+    key = k_spin_lock(&dhcpd4_journal_lock);
+    n = dhcpd4_journal_fill;
+    count = dhcpd4_journal_count[n];
+    dhcpd4_journal_count[n] = 0;
+    dhcpd4_journal_fill = !n;
+    k_spin_unlock(&dhcpd4_journal_lock, key);
+
+    // the buffer is filled again only after the next commit
+
+    for (i = 0; i < count; i++) {
+	if (dhcpd4_journal_write(&dhcpd4_journal_buffers[n][i]) != 0)
+	    failed++;
+    }
+
+    lost = atomic_set(&dhcpd4_journal_lost, 0);
+
+    if (failed != 0 || lost != 0)
+	LOG_ERR("%u lease records not written, %u lost (journal buffer full)", failed, lost);
+}
+
+/*
+ * Buffer a record of the new status of a binding. The records of the
+ * static bindings and of the PENDING ones are not needed to restore
+ * the leases.
+ */
+
+void dhcpd4_journal_binding(const address_binding *binding, uint32_t lease_time)
+{
+    dhcpd4_lease_record *record;
+    k_spinlock_key_t key;
+
+    if (binding->is_static || binding->status == PENDING || !atomic_get(&dhcpd4_journal_started))
+	return;
+
+    if (binding->cident_len > DHCPD4_LEASE_CIDENT_MAX) {
+	atomic_inc(&dhcpd4_journal_lost);
+	return;
+    }
+
+    key = k_spin_lock(&dhcpd4_journal_lock);
+
+    if (dhcpd4_journal_count[dhcpd4_journal_fill] == CONFIG_DHCPD_JOURNAL_BUFFER) {
+	k_spin_unlock(&dhcpd4_journal_lock, key);
+	atomic_inc(&dhcpd4_journal_lost);
+	return;
+    }
+
+    record = &dhcpd4_journal_buffers[dhcpd4_journal_fill][dhcpd4_journal_count[dhcpd4_journal_fill]++];
+
+    dhcpd4_lease_record_of(record, binding, lease_time);
+    record->seq = dhcpd4_journal_seq++;
+
+    k_spin_unlock(&dhcpd4_journal_lock, key);
+
+    // no effect if the commit is already scheduled
+
+    k_work_schedule_for_queue(&dhcpd4_journal_workq, &dhcpd4_journal_work,
+			      K_MSEC(CONFIG_DHCPD_JOURNAL_COMMIT_MS));
+}
+
+/*
+ * Check a record of the journal and pass it to the replay function.
+ */
+
+struct dhcpd4_journal_replay {
+    void (*f)(const dhcpd4_lease_record *record, void *arg);
+    void *arg;
+    uint32_t invalid; // records skipped
+};
+
+static int dhcpd4_journal_replay_entry(struct fcb_entry_ctx *ctx, void *arg)
+{
+    struct dhcpd4_journal_replay *replay = arg;
+    dhcpd4_lease_record record;
+    uint16_t len = MIN(ctx->loc.fe_data_len, sizeof(record));
+
+    memset(&record, 0, sizeof(record));
+
+    if (len < DHCPD4_LEASE_HEADER_SIZE ||
+	flash_area_read(ctx->fap, FCB_ENTRY_FA_DATA_OFF(ctx->loc), &record, len) != 0 ||
+	record.cident_len > DHCPD4_LEASE_CIDENT_MAX ||
+	DHCPD4_LEASE_HEADER_SIZE + record.cident_len > len ||
+	record.status > RELEASED || record.status == PENDING) {
+	replay->invalid++;
+	return 0;
+    }
+
+    replay->f(&record, replay->arg);
+
+    return 0;
+}
+
+/*
+ * Replay the journal, calling f for each record, oldest first.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_journal_replay(void (*f)(const dhcpd4_lease_record *record, void *arg), void *arg)
+{
+    struct dhcpd4_journal_replay replay = { .f = f, .arg = arg, .invalid = 0 };
+
+    if (fcb_walk(&dhcpd4_fcb, NULL, dhcpd4_journal_replay_entry, &replay) != 0)
+	return -1;
+
+    if (replay.invalid != 0)
+	LOG_WRN("%u invalid lease records skipped", replay.invalid);
+
+    return 0;
+}
+
+/*
+ * Erase the journal.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_journal_clear(void)
+{
+    return fcb_clear(&dhcpd4_fcb) == 0 ? 0 : -1;
+}
+
+/*
+ * Write at once the record of an ASSOCIATED binding.
+ */
+
+struct dhcpd4_journal_append {
+    uint32_t now;
+    int ret;
+};
+
+static void dhcpd4_journal_append_binding(address_binding *binding, void *arg)
+{
+    struct dhcpd4_journal_append *append = arg;
+    dhcpd4_lease_record record;
+
+    if (binding->is_static || binding->status != ASSOCIATED ||
+	binding->cident_len > DHCPD4_LEASE_CIDENT_MAX)
+	return;
+
+    dhcpd4_lease_record_of(&record, binding,
+			   (int32_t)(binding->expiry - append->now) > 0 ? binding->expiry - append->now : 0);
+    record.seq = dhcpd4_journal_seq++;
+
+    if (dhcpd4_journal_write(&record) != 0)
+	append->ret = -1;
+}
+
+/*
+ * Write at once the records of the ASSOCIATED bindings of a list,
+ * to compact the journal (see dhcpd4_journal_compact_begin()).
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_journal_append_list(binding_list *list)
+{
+    struct dhcpd4_journal_append append = { .now = dhcpd4_bindings_time(), .ret = 0 };
+
+    dhcpd4_foreach_binding(list, dhcpd4_journal_append_binding, &append);
+
+    return append.ret;
+}
+
+/*
+ * Start compacting the journal: the records written by
+ * dhcpd4_journal_append_list() until dhcpd4_journal_compact_end()
+ * follow the older ones, which are kept until then.
+ */
+
+void dhcpd4_journal_compact_begin(void)
+{
+    dhcpd4_journal_compacting = true;
+    dhcpd4_journal_compact_from = dhcpd4_fcb.f_active.fe_sector;
+}
+
+/*
+ * End the compaction: if the records were all written, drop the
+ * sectors before the first one written by the compaction. A reboot
+ * at any time replays the older records then the compacted ones.
+ *
+ * Return 0 on success, -1 if not compacted or on error.
+ */
+
+int dhcpd4_journal_compact_end(bool written)
+{
+    dhcpd4_journal_compacting = false;
+
+    if (!written)
+	return -1;
+
+    while (dhcpd4_fcb.f_oldest != dhcpd4_journal_compact_from) {
+	if (fcb_rotate(&dhcpd4_fcb) != 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Sequence number of the next record: the records before
+ * are already applied to the bindings.
+ */
+
+uint32_t dhcpd4_journal_get_seq(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&dhcpd4_journal_lock);
+    uint32_t seq = dhcpd4_journal_seq;
+
+    k_spin_unlock(&dhcpd4_journal_lock, key);
+
+    return seq;
+}
+
+/*
+ * Set the sequence number of the next record, after a replay.
+ */
+
+void dhcpd4_journal_set_seq(uint32_t seq)
+{
+    k_spinlock_key_t key = k_spin_lock(&dhcpd4_journal_lock);
+
+    dhcpd4_journal_seq = seq;
+    k_spin_unlock(&dhcpd4_journal_lock, key);
+}
+
+/*
+ * Start recording the transitions of the bindings.
+ */
+
+void dhcpd4_journal_start(void)
+{
+    if (dhcpd4_journal_mounted)
+	atomic_set(&dhcpd4_journal_started, 1);
+}
+
+/*
+ * Stop recording, and write the records still buffered.
+ */
+
+void dhcpd4_journal_stop(void)
+{
+    struct k_work_sync sync;
+
+    if (!atomic_set(&dhcpd4_journal_started, 0))
+	return;
+
+    k_work_flush_delayable(&dhcpd4_journal_work, &sync);
+}
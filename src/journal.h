@@ -0,0 +1,71 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bindings.h"
+
+/*
+ * Header of the persistent lease journal.
+ *
+ * The transitions of the dynamic bindings (except to PENDING) are
+ * appended to a flash circular buffer, so that the leases survive a
+ * reboot. The records are buffered and written together at most every
+ * CONFIG_DHCPD_JOURNAL_COMMIT_MS, by a thread of their own.
+ */
+
+#define DHCPD4_LEASE_CIDENT_MAX 32 // longest client identifier recorded
+
+/*
+ * A lease record: a record of the journal, written up to the end of its
+ * client identifier, or a record of the snapshot (see snapshot.h).
+ */
+
+struct dhcpd4_lease_record {
+    uint8_t status;     // new status of the binding, B_EMPTY if removed
+    uint8_t cident_len; // client identifier len
+    uint16_t reserved;
+    uint32_t seq;       // sequence number of a journal record
+    uint32_t address;   // address of the binding (network order)
+    uint32_t lease;     // lease time left (seconds), for an ASSOCIATED binding
+    uint8_t cident[DHCPD4_LEASE_CIDENT_MAX]; // client identifier
+} __attribute__((packed));
+
+typedef struct dhcpd4_lease_record dhcpd4_lease_record;
+
+#define DHCPD4_LEASE_HEADER_SIZE offsetof(dhcpd4_lease_record, cident)
+
+/* Prototypes */
+
+#if defined(CONFIG_DHCPD_JOURNAL)
+
+void dhcpd4_lease_record_of(dhcpd4_lease_record *record, const address_binding *binding, uint32_t lease_time);
+
+int dhcpd4_journal_init(void);
+void dhcpd4_journal_unmount(void);
+int dhcpd4_journal_replay(void (*f)(const dhcpd4_lease_record *record, void *arg), void *arg);
+int dhcpd4_journal_clear(void);
+int dhcpd4_journal_append_list(binding_list *list);
+void dhcpd4_journal_compact_begin(void);
+int dhcpd4_journal_compact_end(bool written);
+uint32_t dhcpd4_journal_get_seq(void);
+void dhcpd4_journal_set_seq(uint32_t seq);
+
+void dhcpd4_journal_start(void);
+void dhcpd4_journal_stop(void);
+void dhcpd4_journal_binding(const address_binding *binding, uint32_t lease_time);
+
+#else
+
+static inline void dhcpd4_journal_start(void) {}
+static inline void dhcpd4_journal_stop(void) {}
+static inline void dhcpd4_journal_binding(const address_binding *binding, uint32_t lease_time)
+{
+    (void)binding;
+    (void)lease_time;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include "arpa/inet.h"
+#include "dhcpserver.h"
+#include "dhcp.h"
+#include "options.h"
+#include "loadgen.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Load generator: virtual clients running DISCOVER/REQUEST/RENEW/RELEASE
+ * cycles against the running server, through its socket, from the
+ * DHCP client port of the same network stack.
+ *
+ * Up to CONFIG_DHCPD_LOADGEN_WINDOW clients run at the same time, each
+ * one waiting for the reply of its request; a client starts when another
+ * one has done its cycles. The replies come back to the generator when
+ * they are broadcast, so the clients set the broadcast flag, and renew
+ * as in the INIT-REBOOT state (requested address, ciaddr zero): the same
+ * path of the server as a RENEWING request, whose ack would be sent to
+ * ciaddr. On native_sim, the server is run on the loopback interface
+ * (CONFIG_NET_LOOPBACK), having an address of the pool subnet.
+ *
+ * The hardware address of a client is built from its index and the seed,
+ * and its transaction IDs from its slot and a sequence number: a run is
+ * reproducible from its parameters.
+ */
+
+#define DHCPD4_LOADGEN_TIMEOUT_MS 1000
+#define DHCPD4_LOADGEN_BROADCAST_FLAG 0x8000
+
+enum {
+    DHCPD4_LOADGEN_IDLE = 0, // slot free
+    DHCPD4_LOADGEN_DISCOVER, // waiting for the offer
+    DHCPD4_LOADGEN_REQUEST,  // waiting for the ack of the offered address
+    DHCPD4_LOADGEN_RENEW,    // waiting for the ack of the renewal
+    DHCPD4_LOADGEN_RELEASE,  // no reply
+};
+
+struct dhcpd4_loadgen_client {
+    uint32_t client;   // index of the client
+    uint32_t cycles;   // cycles done
+    uint32_t address;  // address offered, then leased (network order)
+    uint32_t sent;     // cycle counter at the request
+    int64_t deadline;  // uptime of the timeout of the request
+    uint16_t seq;      // sequence number of the request
+    uint8_t state;     // DHCPD4_LOADGEN_*
+};
+
+struct dhcpd4_loadgen {
+    int s;                      // socket on the client port
+    struct sockaddr_in server;  // socket of the server
+    uint32_t seed;
+    uint32_t clients;           // clients of the run
+    uint32_t cycles;            // cycles of each client
+    uint32_t next;              // index of the next client started
+    int active;                 // clients running
+    struct dhcpd4_loadgen_result *result;
+};
+
+/*
+ * Latency histogram, from the request to its reply (us): the buckets
+ * up to 7 us are exact, then each power of two has 8 buckets.
+ */
+
+#define DHCPD4_LOADGEN_BUCKETS 240
+
+static uint32_t dhcpd4_loadgen_latency[DHCPD4_LOADGEN_BUCKETS];
+
+static struct dhcpd4_loadgen_client dhcpd4_loadgen_slots[CONFIG_DHCPD_LOADGEN_WINDOW];
+static dhcpd_message dhcpd4_loadgen_msg; // the request sent, or the reply received
+static dhcp_option_table dhcpd4_loadgen_opts;
+static atomic_t dhcpd4_loadgen_busy;
+
+static int dhcpd4_loadgen_bucket(uint32_t us)
+{
+    int msb;
+
+    if (us < 8)
+	return us;
+
+    msb = 31 - __builtin_clz(us);
+
+    return (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+static uint32_t dhcpd4_loadgen_bucket_max(int bucket)
+{
+    if (bucket < 8)
+	return bucket;
+
+    return ((9u + bucket % 8) << (bucket / 8 - 1)) - 1;
+}
+
+/*
+ * Get the upper bound of the latency bucket holding the permille
+ * fraction of the replies.
+ */
+
+static uint32_t dhcpd4_loadgen_percentile(uint32_t total, uint32_t permille)
+{
+    uint64_t rank = ((uint64_t)total * permille + 999) / 1000;
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < DHCPD4_LOADGEN_BUCKETS; i++) {
+	count += dhcpd4_loadgen_latency[i];
+
+	if (count >= rank && count != 0)
+	    return dhcpd4_loadgen_bucket_max(i);
+    }
+
+    return 0;
+}
+
+static void dhcpd4_loadgen_chaddr(struct dhcpd4_loadgen *lg, uint32_t client, uint8_t *chaddr)
+{
+    uint32_t index = htonl(client);
+
+    chaddr[0] = 0x02; // locally administered MAC address
+    chaddr[1] = (uint8_t)lg->seed;
+    memcpy(&chaddr[2], &index, sizeof(index));
+}
+
+/*
+ * Send the request of a client for its new state.
+ */
+
+static void dhcpd4_loadgen_send(struct dhcpd4_loadgen *lg, struct dhcpd4_loadgen_client *c, uint8_t state)
+{
+    dhcpd_message *msg = &dhcpd4_loadgen_msg;
+    uint32_t server_id = dhcpd4_get_pool()->server_id;
+    size_t room = sizeof(msg->options) - 1;
+    size_t len = sizeof(option_magic);
+    uint8_t type = state == DHCPD4_LOADGEN_DISCOVER ? DHCP_DISCOVER :
+		   state == DHCPD4_LOADGEN_RELEASE ? DHCP_RELEASE : DHCP_REQUEST;
+
+    memset(msg, 0, DHCP_HEADER_SIZE);
+
+    msg->op = BOOTREQUEST;
+    msg->htype = ETHERNET;
+    msg->hlen = ETHERNET_LEN;
+    msg->xid = htonl((uint32_t)(c - dhcpd4_loadgen_slots) << 16 | ++c->seq);
+    msg->flags = htons(DHCPD4_LOADGEN_BROADCAST_FLAG);
+    dhcpd4_loadgen_chaddr(lg, c->client, msg->chaddr);
+
+    memcpy(msg->options, option_magic, sizeof(option_magic));
+    len += dhcpd4_serialize_option(msg->options + len, room - len, DHCP_MESSAGE_TYPE, 1, &type);
+
+    if (state == DHCPD4_LOADGEN_REQUEST || state == DHCPD4_LOADGEN_RELEASE)
+	len += dhcpd4_serialize_option(msg->options + len, room - len, SERVER_IDENTIFIER, 4, &server_id);
+
+    if (state == DHCPD4_LOADGEN_REQUEST || state == DHCPD4_LOADGEN_RENEW)
+	len += dhcpd4_serialize_option(msg->options + len, room - len, REQUESTED_IP_ADDRESS, 4, &c->address);
+
+    if (state == DHCPD4_LOADGEN_RELEASE)
+	msg->ciaddr = c->address;
+
+    msg->options[len++] = END;
+
+    c->state = state;
+    c->sent = k_cycle_get_32();
+    c->deadline = k_uptime_get() + DHCPD4_LOADGEN_TIMEOUT_MS;
+
+    // a request not sent (no buffer) times out as a request not answered
+
+    if (sendto(lg->s, msg, DHCP_HEADER_SIZE + len, 0, (struct sockaddr *)&lg->server,
+	       sizeof(lg->server)) < 0)
+	LOG_DBG("Load generator request not sent: %d", errno);
+}
+
+/*
+ * Start the next cycle of a client, or the next client when done.
+ */
+
+static void dhcpd4_loadgen_next(struct dhcpd4_loadgen *lg, struct dhcpd4_loadgen_client *c)
+{
+    if (c->cycles == lg->cycles) {
+	if (lg->next == lg->clients) {
+	    c->state = DHCPD4_LOADGEN_IDLE;
+	    lg->active--;
+	    return;
+	}
+
+	c->client = lg->next++;
+	c->cycles = 0;
+    }
+
+    dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_DISCOVER);
+}
+
+/*
+ * Handle a reply received: the clients waiting for another one
+ * (stale replies, replies to other clients) ignore it.
+ */
+
+static void dhcpd4_loadgen_reply(struct dhcpd4_loadgen *lg, size_t len)
+{
+    dhcpd_message *msg = &dhcpd4_loadgen_msg;
+    struct dhcpd4_loadgen_client *c;
+    dhcp_raw_option *type_opt;
+    uint8_t chaddr[ETHERNET_LEN];
+    uint32_t xid = ntohl(msg->xid);
+
+    if (len < DHCP_HEADER_SIZE + 5 || msg->op != BOOTREPLY ||
+	(xid >> 16) >= CONFIG_DHCPD_LOADGEN_WINDOW)
+	return;
+
+    c = &dhcpd4_loadgen_slots[xid >> 16];
+    dhcpd4_loadgen_chaddr(lg, c->client, chaddr);
+
+    if (c->state == DHCPD4_LOADGEN_IDLE || c->seq != (uint16_t)xid ||
+	memcmp(msg->chaddr, chaddr, sizeof(chaddr)) != 0)
+	return;
+
+    if (dhcpd4_parse_options_to_table(&dhcpd4_loadgen_opts, msg->options,
+				      len - DHCP_HEADER_SIZE) == 0 ||
+	(type_opt = dhcpd4_table_option(&dhcpd4_loadgen_opts, DHCP_MESSAGE_TYPE)) == NULL)
+	return;
+
+    dhcpd4_loadgen_latency[dhcpd4_loadgen_bucket(k_cyc_to_us_floor32(k_cycle_get_32() - c->sent))]++;
+
+    if (type_opt->data[0] == DHCP_NAK) {
+	lg->result->naks++;
+	dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_DISCOVER);
+	return;
+    }
+
+    switch (c->state) {
+
+    case DHCPD4_LOADGEN_DISCOVER:
+	if (type_opt->data[0] != DHCP_OFFER)
+	    break;
+
+	c->address = msg->yiaddr;
+	dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_REQUEST);
+	break;
+
+    case DHCPD4_LOADGEN_REQUEST:
+	if (type_opt->data[0] != DHCP_ACK)
+	    break;
+
+	lg->result->dora++;
+	dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_RENEW);
+	break;
+
+    case DHCPD4_LOADGEN_RENEW:
+	if (type_opt->data[0] != DHCP_ACK)
+	    break;
+
+	lg->result->renewals++;
+	dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_RELEASE);
+	lg->result->releases++;
+	c->cycles++;
+	dhcpd4_loadgen_next(lg, c);
+	break;
+    }
+}
+
+/*
+ * Restart the cycle of the clients whose request is not answered.
+ */
+
+static void dhcpd4_loadgen_timeouts(struct dhcpd4_loadgen *lg)
+{
+    int64_t now = k_uptime_get();
+    int i;
+
+    for (i = 0; i < CONFIG_DHCPD_LOADGEN_WINDOW; i++) {
+	struct dhcpd4_loadgen_client *c = &dhcpd4_loadgen_slots[i];
+
+	if (c->state != DHCPD4_LOADGEN_IDLE && c->deadline <= now) {
+	    lg->result->timeouts++;
+	    dhcpd4_loadgen_send(lg, c, DHCPD4_LOADGEN_DISCOVER);
+	}
+    }
+}
+
+/*
+ * Run cycles of virtual clients against the running server, until
+ * each client has done its cycles.
+ *
+ * Return 0 on success, -1 if the server is not running, or on error.
+ */
+
+int dhcpd4_loadgen_run(uint32_t clients, uint32_t cycles, uint32_t seed,
+		       struct dhcpd4_loadgen_result *result)
+{
+    struct dhcpd4_loadgen lg = {
+	.seed = seed,
+	.clients = clients,
+	.cycles = cycles,
+	.result = result,
+    };
+    struct sockaddr_in client_sock = {
+	.sin_family = AF_INET,
+	.sin_addr.s_addr = htonl(INADDR_ANY),
+	.sin_port = htons(BOOTPC),
+    };
+    struct pollfd fds = { .events = POLLIN };
+    uint32_t total = 0;
+    int64_t start;
+    ssize_t len;
+    int i;
+
+    memset(result, 0, sizeof(*result));
+
+    if (clients == 0 || cycles == 0 || !dhcpd4_running() || !atomic_cas(&dhcpd4_loadgen_busy, 0, 1))
+	return -1;
+
+    if ((lg.s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+	LOG_ERR("Load generator: socket() error %s", strerror(errno));
+	goto end;
+    }
+
+    if (bind(lg.s, (struct sockaddr *)&client_sock, sizeof(client_sock)) == -1) {
+	LOG_ERR("Load generator: bind() %s", strerror(errno));
+	close(lg.s);
+	goto end;
+    }
+
+    lg.server.sin_family = AF_INET;
+    lg.server.sin_addr.s_addr = dhcpd4_get_pool()->server_id;
+    lg.server.sin_port = htons(BOOTPS);
+    fds.fd = lg.s;
+
+    memset(dhcpd4_loadgen_slots, 0, sizeof(dhcpd4_loadgen_slots));
+    memset(dhcpd4_loadgen_latency, 0, sizeof(dhcpd4_loadgen_latency));
+
+    start = k_uptime_get();
+
+    for (i = 0; i < CONFIG_DHCPD_LOADGEN_WINDOW && lg.next < clients; i++, lg.active++) {
+	dhcpd4_loadgen_slots[i].client = lg.next++;
+	dhcpd4_loadgen_send(&lg, &dhcpd4_loadgen_slots[i], DHCPD4_LOADGEN_DISCOVER);
+    }
+
+    while (lg.active > 0) {
+	if (poll(&fds, 1, 10) > 0) {
+	    while ((len = recv(lg.s, &dhcpd4_loadgen_msg, sizeof(dhcpd4_loadgen_msg),
+			       MSG_DONTWAIT)) > 0)
+		dhcpd4_loadgen_reply(&lg, len);
+	}
+
+	dhcpd4_loadgen_timeouts(&lg);
+    }
+
+    result->elapsed_ms = (uint32_t)(k_uptime_get() - start);
+
+    for (i = 0; i < DHCPD4_LOADGEN_BUCKETS; i++)
+	total += dhcpd4_loadgen_latency[i];
+
+    result->p50_us = dhcpd4_loadgen_percentile(total, 500);
+    result->p99_us = dhcpd4_loadgen_percentile(total, 990);
+    result->p999_us = dhcpd4_loadgen_percentile(total, 999);
+
+    close(lg.s);
+    atomic_clear(&dhcpd4_loadgen_busy);
+
+    return 0;
+
+end:
+    atomic_clear(&dhcpd4_loadgen_busy);
+
+    return -1;
+}
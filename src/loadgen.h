@@ -0,0 +1,31 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+
+/*
+ * Results of a run of the load generator: virtual clients, each one
+ * running DISCOVER/REQUEST/RENEW/RELEASE cycles against the server.
+ *
+ * The latency is the time from a request to its reply, as seen by
+ * the clients, its percentiles being rounded up by about 12%.
+ */
+
+struct dhcpd4_loadgen_result {
+    uint32_t elapsed_ms; // duration of the run
+    uint32_t dora;       // DISCOVER/OFFER/REQUEST/ACK exchanges completed
+    uint32_t renewals;   // renewals acked
+    uint32_t releases;   // addresses released
+    uint32_t naks;       // requests refused, the cycle is restarted
+    uint32_t timeouts;   // requests not answered, the cycle is restarted
+    uint32_t p50_us;     // latency percentiles
+    uint32_t p99_us;
+    uint32_t p999_us;
+};
+
+/* Prototypes */
+
+int dhcpd4_loadgen_run(uint32_t clients, uint32_t cycles, uint32_t seed,
+		       struct dhcpd4_loadgen_result *result);
+
+#endif
@@ -1,8 +1,28 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
 #include <stdio.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 /*
  * Logging macros
  */
 
 #define log_info(str, ...)  LOG_INF(str, __VA_ARGS__)
-#define log_error(str, ...) LOG_ERR(str, __VA_ARGS__)
\ No newline at end of file
+#define log_error(str, ...) LOG_ERR(str, __VA_ARGS__)
+
+/*
+ * The string is built in a buffer of the caller (see the macro
+ * below), as several workers may log at the same time.
+ */
+
+static inline const char *
+dhcpd4_str_ip (uint32_t ip, char *addrstr)
+{
+    return inet_ntop(AF_INET, &ip, addrstr, INET_ADDRSTRLEN);
+}
+
+#define str_ip(ip) dhcpd4_str_ip(ip, (char [INET_ADDRSTRLEN]){ 0 })
+
+#endif
@@ -1,4 +1,4 @@
-#include <zephyr/logging/log.h>
+#include "platform.h"
 LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 
 #include <arpa/inet.h>
@@ -13,7 +13,9 @@ LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
 #include "options.h"
 #include "logging.h"
 #include "dhcpmem.h"
+#if !defined(DHCPD4_HOST)
 #include "zephyr/debug/stack.h"
+#endif
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic error "-Wall"
@@ -407,37 +409,58 @@ int dhcpd4_append_option(dhcp_option_list *list, dhcp_option *opt)
 }
 
 /*
- * Parse the options contained in a DHCP message into a list.
+ * Exact length of the options read by the server from a request.
+ */
+
+static const uint8_t dhcp_option_request_len[256] = {
+    [DHCP_MESSAGE_TYPE] = 1,
+    [REQUESTED_IP_ADDRESS] = 4,
+    [SERVER_IDENTIFIER] = 4,
+    [IP_ADDRESS_LEASE_TIME] = 4,
+};
+
+/*
+ * Index the options contained in a DHCP message, without copying them.
+ *
+ * A single pass checks the magic cookie, the option lengths and the
+ * END option; the first occurrence of each option is recorded.
  *
  * Return 1 on success, 0 if the options are malformed.
  */
 
-int dhcpd4_parse_options_to_list(dhcp_option_list *list, dhcp_option *opts, size_t len)
+int dhcpd4_parse_options_to_table(dhcp_option_table *table, uint8_t *opts, size_t len)
 {
-    dhcp_option *opt, *end;
+    size_t i;
 
-    opt = opts;
-    end = (dhcp_option *)(((uint8_t *)opts) + len);
+    memset(table->offset, 0, sizeof(table->offset));
+    table->base = opts;
 
     if (len < 4 ||
-	memcmp(opt, option_magic, sizeof(option_magic)) != 0)
+	memcmp(opts, option_magic, sizeof(option_magic)) != 0)
 	return 0;
 
-    opt = (dhcp_option *)(((uint8_t *) opt) + 4);
+    for (i = 4; i < len && opts[i] != END; ) {
 
-    while (opt < end  &&
-	   opt->id != END) { // TODO: check also valid option sizes
+	if (opts[i] == PAD) {
+	    i++;
+	    continue;
+	}
 
-	if ((dhcp_option *)(((uint8_t *) opt) + 2 + opt->len) >= end)
+	if (i + 2 > len || i + 2 + opts[i + 1] >= len)
 	    return 0; // the len field is too long
 
-	dhcpd4_append_option(list, opt);
+	if (dhcp_option_request_len[opts[i]] != 0 &&
+	    dhcp_option_request_len[opts[i]] != opts[i + 1])
+	    return 0; // invalid size
+
+	if (table->offset[opts[i]] == 0)
+	    table->offset[opts[i]] = i;
 
-        opt = (dhcp_option *)(((uint8_t *) opt) + 2 + opt->len);
+	i += 2 + opts[i + 1];
     }
 
-    if (opt < end && opt->id == END)
-        return 1;
+    if (i < len && opts[i] == END)
+	return 1;
 
     return 0;
 }
@@ -482,6 +505,96 @@ size_t dhcpd4_serialize_option_list(dhcp_option_list *list, uint8_t *buf, size_t
     return p - buf;
 }
 
+/*
+ * Serialize a single option.
+ *
+ * Return 0 if there is no room in buf, the serialized len otherwise.
+ */
+
+size_t dhcpd4_serialize_option(uint8_t *buf, size_t len, uint8_t id, uint8_t opt_len, const void *data)
+{
+    if (len < 2 + (size_t)opt_len)
+	return 0;
+
+    buf[0] = id;
+    buf[1] = opt_len;
+    memcpy(buf + 2, data, opt_len);
+
+    return 2 + opt_len;
+}
+
+/*
+ * Compile a list of options into a blob. As for dhcpd4_search_option,
+ * the first option of the list having an id is the one recorded.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+int dhcpd4_compile_option_list(dhcp_option_blob *blob, dhcp_option_list *list)
+{
+    dhcp_option *opt;
+    size_t size = 0;
+
+    dhcpd4_delete_option_blob(blob);
+
+    TAILQ_FOREACH(opt, list, pointers) {
+	if (blob->len[opt->id] == 0) {
+	    blob->len[opt->id] = 2 + opt->len;
+	    size += 2 + opt->len;
+	}
+    }
+
+    if (size == 0)
+	return 0;
+
+    blob->data = dhcpd4_malloc(size);
+
+    if (blob->data == NULL) {
+	memset(blob->len, 0, sizeof(blob->len));
+	return -1;
+    }
+
+    memset(blob->len, 0, sizeof(blob->len));
+
+    TAILQ_FOREACH(opt, list, pointers) {
+	if (blob->len[opt->id] == 0) {
+	    blob->offset[opt->id] = blob->size;
+	    blob->len[opt->id] = dhcpd4_serialize_option(blob->data + blob->size, size - blob->size,
+							 opt->id, opt->len, opt->data);
+	    blob->size += blob->len[opt->id];
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the option of a blob having the passed id.
+ *
+ * Return 0 if the option is not present or there is no room in buf,
+ * the copied len otherwise.
+ */
+
+size_t dhcpd4_serialize_blob_option(dhcp_option_blob *blob, uint8_t id, uint8_t *buf, size_t len)
+{
+    if (blob->len[id] == 0 || len < blob->len[id])
+	return 0;
+
+    memcpy(buf, blob->data + blob->offset[id], blob->len[id]);
+
+    return blob->len[id];
+}
+
+/*
+ * Deallocate the memory of an option blob and empty it.
+ */
+
+void dhcpd4_delete_option_blob(dhcp_option_blob *blob)
+{
+    dhcpd4_free(blob->data);
+    memset(blob, 0, sizeof(*blob));
+}
+
 /*
  * Delete an option list and deallocate its memory.
  * Deallocate even the list elements.
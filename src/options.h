@@ -137,6 +137,63 @@ typedef struct dhcp_option dhcp_option;
 typedef TAILQ_HEAD(dhcp_option_list_, dhcp_option) DHCP_OPTION_LIST;
 typedef struct dhcp_option_list_ dhcp_option_list;
 
+/*
+ * Option as found in a DHCP message buffer.
+ */
+
+struct dhcp_raw_option {
+    uint8_t id;     // option id
+    uint8_t len;    // option length
+    uint8_t data[]; // option data
+};
+
+typedef struct dhcp_raw_option dhcp_raw_option;
+
+/*
+ * Options of a received DHCP message, left in the message buffer.
+ *
+ * The offset of each option from the start of the options section
+ * is recorded by id, zero meaning that the option is not present
+ * (the magic cookie is always at offset zero).
+ */
+
+struct dhcp_option_table {
+    uint8_t *base;        // options section of the message
+    uint16_t offset[256]; // offset of each option by id
+};
+
+typedef struct dhcp_option_table dhcp_option_table;
+
+/*
+ * Get the option of a table having the passed option id,
+ * or NULL if the option is not present.
+ */
+
+static inline dhcp_raw_option *dhcpd4_table_option(dhcp_option_table *table, uint8_t id)
+{
+    return table->offset[id] ? (dhcp_raw_option *)(table->base + table->offset[id]) : NULL;
+}
+
+/*
+ * Options of a pool compiled in wire format, to be copied
+ * as they are in the replies.
+ *
+ * The offset and the length (id and len fields included) of each
+ * option in the data buffer are recorded by id, a zero length meaning
+ * that the option is not present.
+ */
+
+struct dhcp_option_blob {
+    uint8_t *data;        // options in wire format
+    size_t size;          // size of data
+    uint16_t offset[256]; // offset of each option by id
+    uint16_t len[256];    // length of each option by id
+};
+
+typedef struct dhcp_option_blob dhcp_option_blob;
+
+extern const uint8_t option_magic[4];
+
 /* Value parsing functions:
  *
  * Parse the string pointed by s, and allocate the
@@ -164,8 +221,12 @@ dhcp_option *dhcpd4_search_option(dhcp_option_list *list, uint8_t id);
 void dhcpd4_print_options(dhcp_option_list *list);
 int dhcpd4_append_option(dhcp_option_list *list, dhcp_option *opt);
 void dhcpd4_option_free(dhcp_option ** option);
-int dhcpd4_parse_options_to_list(dhcp_option_list *list, dhcp_option *opts, size_t len);
+int dhcpd4_parse_options_to_table(dhcp_option_table *table, uint8_t *opts, size_t len);
 size_t dhcpd4_serialize_option_list(dhcp_option_list *list, uint8_t *buf, size_t len);
+size_t dhcpd4_serialize_option(uint8_t *buf, size_t len, uint8_t id, uint8_t opt_len, const void *data);
+int dhcpd4_compile_option_list(dhcp_option_blob *blob, dhcp_option_list *list);
+size_t dhcpd4_serialize_blob_option(dhcp_option_blob *blob, uint8_t id, uint8_t *buf, size_t len);
+void dhcpd4_delete_option_blob(dhcp_option_blob *blob);
 void dhcpd4_delete_option_list(dhcp_option_list *list);
 
 #endif
\ No newline at end of file
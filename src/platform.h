@@ -0,0 +1,421 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+/*
+ * Platform layer of the engine (bindings, options, prefixes, memory,
+ * statistics, lease events and protocol logic): the few kernel
+ * primitives it uses, from Zephyr, or emulated over POSIX when built
+ * on a host (DHCPD4_HOST, see host/CMakeLists.txt).
+ *
+ * The host keeps the Zephyr names, so that the engine is the same
+ * code on both: logging, uptime and cycle counter, atomics, mutexes,
+ * memory slabs and heap, and the Kconfig options of the engine (with
+ * their Zephyr defaults, unless set by the build). The lease journal
+ * also runs on the host, over a delayed work run by k_sleep() and a
+ * flash circular buffer in a simulated flash (see host/flash_posix.c).
+ */
+
+#if !defined(DHCPD4_HOST)
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#if defined(CONFIG_DHCPD_JOURNAL)
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+#endif
+
+#else
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/* Kconfig options of the engine */
+
+#ifndef CONFIG_DHCPD_HEAP_SIZE
+#define CONFIG_DHCPD_HEAP_SIZE 8192
+#endif
+#ifndef CONFIG_DHCPD_MEM_SCRATCH_SIZE
+#define CONFIG_DHCPD_MEM_SCRATCH_SIZE 32
+#endif
+#ifndef CONFIG_DHCPD_MEM_SCRATCH_BLOCKS
+#define CONFIG_DHCPD_MEM_SCRATCH_BLOCKS 32
+#endif
+#ifndef CONFIG_DHCPD_MEM_OPTION_BLOCKS
+#define CONFIG_DHCPD_MEM_OPTION_BLOCKS 8
+#endif
+#ifndef CONFIG_DHCPD_MAX_BINDINGS
+#define CONFIG_DHCPD_MAX_BINDINGS 256
+#endif
+#ifndef CONFIG_DHCPD_ADDRESS_INDEX_DENSE_MAX
+#define CONFIG_DHCPD_ADDRESS_INDEX_DENSE_MAX 1024
+#endif
+#ifndef CONFIG_DHCPD_LEASE_EVENTS
+#define CONFIG_DHCPD_LEASE_EVENTS 64
+#endif
+#ifndef CONFIG_DHCPD_WORKERS
+#define CONFIG_DHCPD_WORKERS 1
+#endif
+#ifndef CONFIG_MP_MAX_NUM_CPUS
+#define CONFIG_MP_MAX_NUM_CPUS 1
+#endif
+#ifndef CONFIG_DHCPD_JOURNAL_COMMIT_MS
+#define CONFIG_DHCPD_JOURNAL_COMMIT_MS 100
+#endif
+#ifndef CONFIG_DHCPD_JOURNAL_BUFFER
+#define CONFIG_DHCPD_JOURNAL_BUFFER 32
+#endif
+#ifndef CONFIG_DHCPD_JOURNAL_SECTORS
+#define CONFIG_DHCPD_JOURNAL_SECTORS 8
+#endif
+
+/* Utilities */
+
+#define ARG_UNUSED(x) (void)(x)
+#define BUILD_ASSERT(cond, msg) _Static_assert(cond, msg)
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#define ROUND_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+#define POINTER_TO_INT(x) ((int)(intptr_t)(x))
+#define INT_TO_POINTER(x) ((void *)(intptr_t)(x))
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+
+/*
+ * Logging, to the standard error, filtered by dhcpd4_log_level:
+ * LOG_LEVEL_ERR to LOG_LEVEL_DBG.
+ */
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERR  1
+#define LOG_LEVEL_WRN  2
+#define LOG_LEVEL_INF  3
+#define LOG_LEVEL_DBG  4
+
+extern int dhcpd4_log_level;
+
+#define LOG_MODULE_REGISTER(name, level) int dhcpd4_log_level = LOG_LEVEL_INF
+#define LOG_MODULE_DECLARE(name, level) extern int dhcpd4_log_level
+
+#define DHCPD4_HOST_LOG(level, tag, fmt, ...)				\
+    do {								\
+	if (dhcpd4_log_level >= (level))				\
+	    fprintf(stderr, "<" tag "> dhcp4server: " fmt "\n", ##__VA_ARGS__); \
+    } while (false)
+
+#define LOG_ERR(fmt, ...) DHCPD4_HOST_LOG(LOG_LEVEL_ERR, "err", fmt, ##__VA_ARGS__)
+#define LOG_WRN(fmt, ...) DHCPD4_HOST_LOG(LOG_LEVEL_WRN, "wrn", fmt, ##__VA_ARGS__)
+#define LOG_INF(fmt, ...) DHCPD4_HOST_LOG(LOG_LEVEL_INF, "inf", fmt, ##__VA_ARGS__)
+#define LOG_DBG(fmt, ...) DHCPD4_HOST_LOG(LOG_LEVEL_DBG, "dbg", fmt, ##__VA_ARGS__)
+
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define log_stack_usage(thread) ARG_UNUSED(thread)
+#define k_current_get() NULL
+
+/*
+ * Time: the uptime is the monotonic clock, or the simulated clock of
+ * the tests when dhcpd4_host_clock_ms is set (not negative). A cycle
+ * is a nanosecond.
+ */
+
+#define MSEC_PER_SEC 1000
+
+extern int64_t dhcpd4_host_clock_ms;
+
+int64_t k_uptime_get(void);
+uint32_t k_cycle_get_32(void);
+
+static inline uint32_t k_uptime_get_32(void)
+{
+    return (uint32_t)k_uptime_get();
+}
+
+static inline uint32_t k_cyc_to_us_floor32(uint32_t cycles)
+{
+    return cycles / 1000;
+}
+
+/* Atomics */
+
+typedef long atomic_t;
+typedef long atomic_val_t;
+
+static inline atomic_val_t atomic_get(const atomic_t *target)
+{
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+}
+
+static inline atomic_val_t atomic_set(atomic_t *target, atomic_val_t value)
+{
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+static inline atomic_val_t atomic_clear(atomic_t *target)
+{
+    return atomic_set(target, 0);
+}
+
+static inline atomic_val_t atomic_inc(atomic_t *target)
+{
+    return __atomic_fetch_add(target, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline atomic_val_t atomic_dec(atomic_t *target)
+{
+    return __atomic_fetch_sub(target, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic_cas(atomic_t *target, atomic_val_t old_value, atomic_val_t new_value)
+{
+    return __atomic_compare_exchange_n(target, &old_value, new_value, false,
+				       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* CPU: the statistics of the host are counted as a single CPU */
+
+struct _cpu {
+    uint8_t id;
+};
+
+static inline struct _cpu *arch_curr_cpu(void)
+{
+    static struct _cpu cpu;
+
+    return &cpu;
+}
+
+/* Mutexes and timeouts (the host never waits with a timeout) */
+
+typedef struct {
+    int64_t ticks;
+} k_timeout_t;
+
+#define K_NO_WAIT ((k_timeout_t){ 0 })
+#define K_FOREVER ((k_timeout_t){ -1 })
+#define K_MSEC(ms) ((k_timeout_t){ (ms) })
+
+struct k_mutex {
+    pthread_mutex_t mutex;
+};
+
+#define K_MUTEX_DEFINE(name) struct k_mutex name = { .mutex = PTHREAD_MUTEX_INITIALIZER }
+
+static inline int k_mutex_lock(struct k_mutex *mutex, k_timeout_t timeout)
+{
+    ARG_UNUSED(timeout);
+
+    return pthread_mutex_lock(&mutex->mutex);
+}
+
+static inline int k_mutex_unlock(struct k_mutex *mutex)
+{
+    return pthread_mutex_unlock(&mutex->mutex);
+}
+
+/* Spinlocks */
+
+struct k_spinlock {
+    int locked;
+};
+
+typedef int k_spinlock_key_t;
+
+static inline k_spinlock_key_t k_spin_lock(struct k_spinlock *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+	;
+
+    return 0;
+}
+
+static inline void k_spin_unlock(struct k_spinlock *lock, k_spinlock_key_t key)
+{
+    ARG_UNUSED(key);
+
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Delayed works: a work queue has no thread, its works are run by
+ * k_sleep() once due (in the simulated time of the tests, if set),
+ * or when flushed.
+ */
+
+#define K_LOWEST_APPLICATION_THREAD_PRIO 15
+#define K_THREAD_STACK_DEFINE(name, size) char name[size]
+#define K_THREAD_STACK_SIZEOF(sym) sizeof(sym)
+
+struct k_thread {
+    int unused;
+};
+
+#define k_thread_name_set(thread, name) ARG_UNUSED(thread)
+
+struct k_work;
+
+typedef void (*k_work_handler_t)(struct k_work *work);
+
+struct k_work {
+    k_work_handler_t handler;
+};
+
+struct k_work_delayable {
+    struct k_work work;
+    bool scheduled;
+    int64_t due;                     // uptime (ms)
+    struct k_work_delayable *next;   // works scheduled
+};
+
+struct k_work_q {
+    struct k_thread thread;
+};
+
+struct k_work_sync {
+    int unused;
+};
+
+#define K_WORK_DELAYABLE_DEFINE(name, work_handler) \
+    struct k_work_delayable name = { .work = { .handler = (work_handler) } }
+
+void k_work_queue_start(struct k_work_q *queue, char *stack, size_t stack_size, int prio, const void *cfg);
+int k_work_schedule_for_queue(struct k_work_q *queue, struct k_work_delayable *dwork, k_timeout_t delay);
+bool k_work_flush_delayable(struct k_work_delayable *dwork, struct k_work_sync *sync);
+int32_t k_sleep(k_timeout_t timeout);
+
+static inline int32_t k_msleep(int32_t ms)
+{
+    return k_sleep(K_MSEC(ms));
+}
+
+/*
+ * Flash: a single partition of the simulated flash, set up by
+ * dhcpd4_host_flash_setup() (erased). A simulated power loss fails
+ * the writes and the erases once dhcpd4_host_flash_writes (if not
+ * negative) drops to zero.
+ */
+
+#define FIXED_PARTITION_EXISTS(label) 0
+#define FIXED_PARTITION_ID(label) 0
+
+struct flash_area {
+    uint8_t fa_id;
+    off_t fa_off;
+    size_t fa_size;
+};
+
+struct flash_sector {
+    off_t fs_off;
+    size_t fs_size;
+};
+
+extern int dhcpd4_host_flash_writes;
+
+int dhcpd4_host_flash_setup(uint32_t sector_size, uint32_t sectors, uint32_t align);
+
+int flash_area_open(uint8_t id, const struct flash_area **fa);
+void flash_area_close(const struct flash_area *fa);
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst, size_t len);
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src, size_t len);
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len);
+uint32_t flash_area_align(const struct flash_area *fa);
+int flash_area_get_sectors(int fa_id, uint32_t *count, struct flash_sector *sectors);
+
+/*
+ * Flash circular buffer, with the layout and the behavior of the
+ * Zephyr one: sectors used in turn, each with a header, then entries
+ * of a length, data and CRC, the oldest sector erased by fcb_rotate().
+ */
+
+struct fcb_entry {
+    struct flash_sector *fe_sector;
+    uint32_t fe_elem_off;   // offset of the entry in its sector
+    uint32_t fe_data_off;   // offset of its data in its sector
+    uint16_t fe_data_len;
+};
+
+struct fcb_entry_ctx {
+    struct fcb_entry loc;
+    const struct flash_area *fap;
+};
+
+#define FCB_ENTRY_FA_DATA_OFF(entry) ((entry).fe_sector->fs_off + (entry).fe_data_off)
+
+struct fcb {
+    uint32_t f_magic;
+    uint8_t f_version;
+    uint8_t f_sector_cnt;
+    uint8_t f_scratch_cnt;
+    struct flash_sector *f_sectors;
+
+    struct flash_sector *f_oldest;  // oldest sector in use
+    struct fcb_entry f_active;      // end of the last entry written
+    uint16_t f_active_id;
+    uint8_t f_align;
+    const struct flash_area *fap;
+};
+
+typedef int (*fcb_walk_cb)(struct fcb_entry_ctx *loc_ctx, void *arg);
+
+int fcb_init(int f_area_id, struct fcb *fcb);
+int fcb_append(struct fcb *fcb, uint16_t len, struct fcb_entry *loc);
+int fcb_append_finish(struct fcb *fcb, struct fcb_entry *loc);
+int fcb_walk(struct fcb *fcb, struct flash_sector *sector, fcb_walk_cb cb, void *cb_arg);
+int fcb_rotate(struct fcb *fcb);
+int fcb_clear(struct fcb *fcb);
+
+/*
+ * Memory slab: fixed size blocks of a static buffer, as the Zephyr one
+ * (the buffer field is used to find the slab of a block).
+ */
+
+struct k_mem_slab {
+    char *buffer;
+    size_t block_size;
+    uint32_t num_blocks;
+    uint32_t num_used;   // blocks taken from the buffer, free or not
+    void *free_list;
+    pthread_mutex_t lock;
+};
+
+#define K_MEM_SLAB_DEFINE_STATIC(name, size, num, align)		\
+    static char __aligned(align) _k_mem_slab_buf_##name[(size) * (num)]; \
+    static struct k_mem_slab name = {					\
+	.buffer = _k_mem_slab_buf_##name,				\
+	.block_size = (size),						\
+	.num_blocks = (num),						\
+	.lock = PTHREAD_MUTEX_INITIALIZER,				\
+    }
+
+int k_mem_slab_alloc(struct k_mem_slab *slab, void **mem, k_timeout_t timeout);
+void k_mem_slab_free(struct k_mem_slab *slab, void *mem);
+
+/*
+ * Heap: blocks of the C library, up to the size of the heap.
+ */
+
+struct k_heap {
+    size_t size;
+    size_t used;
+    pthread_mutex_t lock;
+};
+
+#define K_HEAP_DEFINE(name, bytes) \
+    struct k_heap name = { .size = (bytes), .used = 0, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void *k_heap_alloc(struct k_heap *heap, size_t bytes, k_timeout_t timeout);
+void k_heap_free(struct k_heap *heap, void *mem);
+
+#endif /* DHCPD4_HOST */
+
+#endif
@@ -0,0 +1,163 @@
+#include "platform.h"
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "prefixes.h"
+#include "dhcpmem.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Addresses of a prefix, in host order.
+ */
+
+struct prefix_span {
+    uint32_t first;
+    uint32_t last;
+    int value;
+    uint32_t order; // position in the list of prefixes
+};
+
+// the deepest nesting: a prefix for each length, /0 to /32
+
+#define PREFIX_MAX_DEPTH 33
+
+/*
+ * Sort the prefixes by first address, the outer ones first,
+ * the identical ones in the order of the list.
+ */
+
+static int dhcpd4_prefix_compare(const void *a, const void *b)
+{
+    const struct prefix_span *pa = a, *pb = b;
+
+    if (pa->first != pb->first)
+	return pa->first < pb->first ? -1 : 1;
+
+    if (pa->last != pb->last)
+	return pa->last > pb->last ? -1 : 1;
+
+    return pa->order < pb->order ? -1 : 1;
+}
+
+/*
+ * Append a range to the table, merged with the last one if possible.
+ */
+
+static void dhcpd4_prefix_emit(prefix_table *table, uint32_t start, int value)
+{
+    prefix_range *last = table->count ? &table->ranges[table->count - 1] : NULL;
+
+    if (last != NULL && last->start == start) { // the last range is empty
+	table->count--;
+	last = table->count ? &table->ranges[table->count - 1] : NULL;
+    }
+
+    if (last != NULL ? last->value == value : value < 0)
+	return; // same value as the previous range
+
+    table->ranges[table->count].start = start;
+    table->ranges[table->count].value = value;
+    table->count++;
+}
+
+/*
+ * Build the table of a list of prefixes. Two prefixes being either
+ * disjoint or nested, the table has at most 2 * count + 1 ranges.
+ * Of two identical prefixes, the last one is kept.
+ *
+ * Return 0 on success, -1 if out of memory.
+ */
+
+int dhcpd4_build_prefix_table(prefix_table *table, const prefix_entry *prefixes, uint32_t count)
+{
+    struct prefix_span stack[PREFIX_MAX_DEPTH];
+    struct prefix_span *spans;
+    int depth = 0;
+    uint32_t i;
+
+    dhcpd4_delete_prefix_table(table);
+
+    if (count == 0)
+	return 0;
+
+    spans = dhcpd4_calloc(count, sizeof(*spans));
+    table->ranges = dhcpd4_calloc(2 * count + 1, sizeof(*table->ranges));
+
+    if (spans == NULL || table->ranges == NULL) {
+	dhcpd4_free(spans);
+	dhcpd4_delete_prefix_table(table);
+	return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+	spans[i].first = ntohl(prefixes[i].network & prefixes[i].netmask);
+	spans[i].last = spans[i].first | ~ntohl(prefixes[i].netmask);
+	spans[i].value = prefixes[i].value;
+	spans[i].order = i;
+    }
+
+    qsort(spans, count, sizeof(*spans), dhcpd4_prefix_compare);
+
+    // sweep the prefixes, keeping the stack of the ones holding the current address
+
+    for (i = 0; i <= count; i++) {
+	while (depth > 0 && (i == count || stack[depth - 1].last < spans[i].first)) {
+	    struct prefix_span *top = &stack[--depth];
+
+	    if (top->last != UINT32_MAX)
+		dhcpd4_prefix_emit(table, top->last + 1, depth > 0 ? stack[depth - 1].value : -1);
+	}
+
+	if (i == count)
+	    break;
+
+	if (depth > 0 && stack[depth - 1].first == spans[i].first && stack[depth - 1].last == spans[i].last)
+	    depth--; // identical prefix, replaced
+
+	stack[depth++] = spans[i];
+	dhcpd4_prefix_emit(table, spans[i].first, spans[i].value);
+    }
+
+    dhcpd4_free(spans);
+
+    return 0;
+}
+
+/*
+ * Get the value of the longest prefix holding an address (in network
+ * order), with a binary search of its range.
+ *
+ * Return -1 if no prefix holds the address.
+ */
+
+int dhcpd4_lookup_prefix(const prefix_table *table, uint32_t address)
+{
+    uint32_t key = ntohl(address);
+    uint32_t low = 0, high = table->count;
+
+    // find the first range starting after the address
+
+    while (low < high) {
+	uint32_t mid = low + (high - low) / 2;
+
+	if (table->ranges[mid].start <= key)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+
+    return low == 0 ? -1 : table->ranges[low - 1].value;
+}
+
+void dhcpd4_delete_prefix_table(prefix_table *table)
+{
+    dhcpd4_free(table->ranges);
+    table->count = 0;
+}
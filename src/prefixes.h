@@ -0,0 +1,52 @@
+#ifndef PREFIXES_H
+#define PREFIXES_H
+
+#include <stdint.h>
+
+/*
+ * Header of the table of network prefixes, used to select the pool
+ * of a request by longest prefix match.
+ */
+
+/*
+ * A network prefix and its value (addresses in network order).
+ */
+
+struct prefix_entry {
+    uint32_t network; // address of the network
+    uint32_t netmask; // contiguous network mask
+    int value;        // value of the prefix, not negative
+};
+
+typedef struct prefix_entry prefix_entry;
+
+/*
+ * The prefixes flattened in disjoint address ranges, sorted by their
+ * first address (in host order): each range takes the value of the
+ * longest prefix holding it, or -1 if none.
+ *
+ * A range ends where the next one starts, the last one at 255.255.255.255,
+ * and the addresses before the first range have no prefix.
+ */
+
+struct prefix_range {
+    uint32_t start; // first address of the range
+    int32_t value;  // value of the longest prefix, -1 if none
+};
+
+typedef struct prefix_range prefix_range;
+
+struct prefix_table {
+    prefix_range *ranges; // ranges sorted by start
+    uint32_t count;       // number of ranges
+};
+
+typedef struct prefix_table prefix_table;
+
+/* Prototypes */
+
+int dhcpd4_build_prefix_table(prefix_table *table, const prefix_entry *prefixes, uint32_t count);
+int dhcpd4_lookup_prefix(const prefix_table *table, uint32_t address);
+void dhcpd4_delete_prefix_table(prefix_table *table);
+
+#endif
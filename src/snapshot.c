@@ -0,0 +1,431 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_DECLARE(dhcp4server, LOG_LEVEL_DBG);
+#include <string.h>
+#include <arpa/inet.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include "bindings.h"
+#include "journal.h"
+#include "snapshot.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+#define DHCPD4_SNAPSHOT_PARTITION FIXED_PARTITION_ID(dhcpd_snapshot_partition)
+
+#define DHCPD4_SNAPSHOT_CHUNK 8 // lease records read or written at once
+
+static const struct flash_area *dhcpd4_snapshot_fa;
+static struct flash_sector dhcpd4_snapshot_sectors[CONFIG_DHCPD_SNAPSHOT_SECTORS];
+
+static off_t dhcpd4_snapshot_slots[2];     // offset of each slot
+static size_t dhcpd4_snapshot_slot_size[2];
+static int dhcpd4_snapshot_current = -1;   // slot of the last valid snapshot, -1 if none
+static uint32_t dhcpd4_snapshot_generation;
+
+/*
+ * The snapshot being written, appended to by several threads.
+ */
+
+static K_MUTEX_DEFINE(dhcpd4_snapshot_lock);
+static dhcpd4_snapshot_header dhcpd4_snapshot_next;
+static int dhcpd4_snapshot_slot; // slot of the snapshot being written
+static int dhcpd4_snapshot_ret;  // first error while writing it
+static dhcpd4_lease_record dhcpd4_snapshot_chunk[DHCPD4_SNAPSHOT_CHUNK];
+static uint32_t dhcpd4_snapshot_buffered;
+
+/*
+ * Number of lease records a slot can hold.
+ */
+
+static uint32_t dhcpd4_snapshot_capacity(int slot)
+{
+    return (dhcpd4_snapshot_slot_size[slot] - sizeof(dhcpd4_snapshot_header)) / sizeof(dhcpd4_lease_record);
+}
+
+/*
+ * Open the snapshot partition, and split it in two slots
+ * of half its sectors.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_snapshot_init(void)
+{
+    uint32_t count = ARRAY_SIZE(dhcpd4_snapshot_sectors);
+    int ret;
+
+    if (dhcpd4_snapshot_fa != NULL)
+	return 0;
+
+    if ((ret = flash_area_get_sectors(DHCPD4_SNAPSHOT_PARTITION, &count, dhcpd4_snapshot_sectors)) != 0) {
+	LOG_ERR("Lease snapshot partition not available (%d), see CONFIG_DHCPD_SNAPSHOT_SECTORS", ret);
+	return -1;
+    }
+
+    if (count < 2 || flash_area_open(DHCPD4_SNAPSHOT_PARTITION, &dhcpd4_snapshot_fa) != 0) {
+	LOG_ERR("Lease snapshot partition not available");
+	dhcpd4_snapshot_fa = NULL;
+	return -1;
+    }
+
+    dhcpd4_snapshot_slots[0] = 0;
+    dhcpd4_snapshot_slots[1] = dhcpd4_snapshot_sectors[count / 2].fs_off;
+    dhcpd4_snapshot_slot_size[0] = dhcpd4_snapshot_slots[1];
+    dhcpd4_snapshot_slot_size[1] = dhcpd4_snapshot_fa->fa_size - dhcpd4_snapshot_slots[1];
+
+    return 0;
+}
+
+/*
+ * Read the header of the snapshot of a slot.
+ *
+ * Return 0 if valid, -1 otherwise.
+ */
+
+static int dhcpd4_snapshot_read_header(int slot, dhcpd4_snapshot_header *header)
+{
+    if (flash_area_read(dhcpd4_snapshot_fa, dhcpd4_snapshot_slots[slot], header, sizeof(*header)) != 0)
+	return -1;
+
+    if (header->magic != DHCPD4_SNAPSHOT_MAGIC || header->version != DHCPD4_SNAPSHOT_VERSION ||
+	header->record_size != sizeof(dhcpd4_lease_record) ||
+	header->header_crc != crc32_ieee((const uint8_t *)header, offsetof(dhcpd4_snapshot_header, header_crc)) ||
+	header->count > dhcpd4_snapshot_capacity(slot))
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Read the lease records of the snapshot of a slot, passing them
+ * to f if not NULL, and compute their CRC.
+ *
+ * Return 0 on success, -1 on read error.
+ */
+
+static int dhcpd4_snapshot_read(int slot, const dhcpd4_snapshot_header *header,
+				void (*f)(const dhcpd4_lease_record *record, void *arg), void *arg,
+				uint32_t *crc)
+{
+    off_t off = dhcpd4_snapshot_slots[slot] + sizeof(*header);
+    uint32_t i, n, k;
+
+    *crc = 0;
+
+    for (i = 0; i < header->count; i += n) {
+	n = MIN(header->count - i, DHCPD4_SNAPSHOT_CHUNK);
+
+	if (flash_area_read(dhcpd4_snapshot_fa, off, dhcpd4_snapshot_chunk, n * sizeof(dhcpd4_lease_record)) != 0)
+	    return -1;
+
+	*crc = crc32_ieee_update(*crc, (const uint8_t *)dhcpd4_snapshot_chunk, n * sizeof(dhcpd4_lease_record));
+	off += n * sizeof(dhcpd4_lease_record);
+
+	for (k = 0; f != NULL && k < n; k++) {
+	    if (dhcpd4_snapshot_chunk[k].status == ASSOCIATED &&
+		dhcpd4_snapshot_chunk[k].cident_len <= DHCPD4_LEASE_CIDENT_MAX)
+		f(&dhcpd4_snapshot_chunk[k], arg);
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Restore the last valid snapshot, calling f for each of its lease
+ * records: the records are checked first (CRC), then passed to f in
+ * one pass. *seq is set to the first journal record to replay after.
+ *
+ * Return the number of lease records, or -1 if no snapshot is valid.
+ */
+
+int dhcpd4_snapshot_restore(void (*f)(const dhcpd4_lease_record *record, void *arg), void *arg, uint32_t *seq)
+{
+    dhcpd4_snapshot_header headers[2];
+    int valid[2];
+    int i, ret = -1;
+
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    for (i = 0; i < 2; i++)
+	valid[i] = dhcpd4_snapshot_read_header(i, &headers[i]) == 0;
+
+    // the newest snapshot first, the other one if corrupted
+
+    i = valid[0] && valid[1] ? (int32_t)(headers[1].generation - headers[0].generation) > 0 : valid[1];
+
+    for (; valid[i]; valid[i] = 0, i = !i) {
+	uint32_t crc;
+
+	if (dhcpd4_snapshot_read(i, &headers[i], NULL, NULL, &crc) != 0 || crc != headers[i].crc) {
+	    LOG_ERR("Lease snapshot %u corrupted", headers[i].generation);
+	    continue;
+	}
+
+	if (dhcpd4_snapshot_read(i, &headers[i], f, arg, &crc) != 0) {
+	    LOG_ERR("Lease snapshot %u not read", headers[i].generation);
+	    break;
+	}
+
+	dhcpd4_snapshot_current = i;
+	dhcpd4_snapshot_generation = headers[i].generation;
+	*seq = headers[i].seq;
+	ret = headers[i].count;
+	break;
+    }
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    return ret;
+}
+
+/*
+ * Write the lease records buffered in the chunk.
+ */
+
+static void dhcpd4_snapshot_flush(void)
+{
+    size_t len = dhcpd4_snapshot_buffered * sizeof(dhcpd4_lease_record);
+    off_t off = dhcpd4_snapshot_slots[dhcpd4_snapshot_slot] + sizeof(dhcpd4_snapshot_header) +
+	(dhcpd4_snapshot_next.count - dhcpd4_snapshot_buffered) * sizeof(dhcpd4_lease_record);
+
+    if (len == 0)
+	return;
+
+    if (dhcpd4_snapshot_ret == 0 && flash_area_write(dhcpd4_snapshot_fa, off, dhcpd4_snapshot_chunk, len) != 0)
+	dhcpd4_snapshot_ret = -1;
+
+    dhcpd4_snapshot_next.crc = crc32_ieee_update(dhcpd4_snapshot_next.crc,
+						 (const uint8_t *)dhcpd4_snapshot_chunk, len);
+    dhcpd4_snapshot_buffered = 0;
+}
+
+/*
+ * Append a lease record to the snapshot being written.
+ */
+
+static void dhcpd4_snapshot_append(const dhcpd4_lease_record *record)
+{
+    if (dhcpd4_snapshot_next.count == dhcpd4_snapshot_capacity(dhcpd4_snapshot_slot)) {
+	dhcpd4_snapshot_ret = -1; // snapshot partition too small
+	return;
+    }
+
+    dhcpd4_snapshot_chunk[dhcpd4_snapshot_buffered++] = *record;
+    dhcpd4_snapshot_next.count++;
+
+    if (dhcpd4_snapshot_buffered == DHCPD4_SNAPSHOT_CHUNK)
+	dhcpd4_snapshot_flush();
+}
+
+/*
+ * Start a new snapshot, in the slot not holding the last one. The
+ * journal records from seq on are replayed after the snapshot.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int dhcpd4_snapshot_begin(uint32_t seq)
+{
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    dhcpd4_snapshot_slot = dhcpd4_snapshot_current == 0;
+    dhcpd4_snapshot_buffered = 0;
+
+    memset(&dhcpd4_snapshot_next, 0, sizeof(dhcpd4_snapshot_next));
+    dhcpd4_snapshot_next.seq = seq;
+
+    dhcpd4_snapshot_ret = flash_area_erase(dhcpd4_snapshot_fa, dhcpd4_snapshot_slots[dhcpd4_snapshot_slot],
+					   dhcpd4_snapshot_slot_size[dhcpd4_snapshot_slot]) == 0 ? 0 : -1;
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    return dhcpd4_snapshot_ret;
+}
+
+/*
+ * Append the ASSOCIATED dynamic bindings of a list to the snapshot
+ * being written.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static void dhcpd4_snapshot_append_binding(address_binding *binding, void *arg)
+{
+    uint32_t now = POINTER_TO_UINT(arg);
+    dhcpd4_lease_record record;
+
+    if (binding->is_static || binding->status != ASSOCIATED ||
+	binding->cident_len > DHCPD4_LEASE_CIDENT_MAX)
+	return;
+
+    dhcpd4_lease_record_of(&record, binding,
+			   (int32_t)(binding->expiry - now) > 0 ? binding->expiry - now : 0);
+    dhcpd4_snapshot_append(&record);
+}
+
+int dhcpd4_snapshot_append_list(binding_list *list)
+{
+    int ret;
+
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    dhcpd4_foreach_binding(list, dhcpd4_snapshot_append_binding, UINT_TO_POINTER(dhcpd4_bindings_time()));
+    ret = dhcpd4_snapshot_ret;
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    return ret;
+}
+
+/*
+ * Complete the snapshot being written with its header: it is
+ * restored from now on.
+ *
+ * Return 0 on success, -1 on error (the last snapshot is kept).
+ */
+
+int dhcpd4_snapshot_end(void)
+{
+    dhcpd4_snapshot_header *header = &dhcpd4_snapshot_next;
+    int ret;
+
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    dhcpd4_snapshot_flush();
+
+    header->magic = DHCPD4_SNAPSHOT_MAGIC;
+    header->version = DHCPD4_SNAPSHOT_VERSION;
+    header->record_size = sizeof(dhcpd4_lease_record);
+    header->generation = dhcpd4_snapshot_generation + 1;
+    header->header_crc = crc32_ieee((const uint8_t *)header, offsetof(dhcpd4_snapshot_header, header_crc));
+
+    if (dhcpd4_snapshot_ret == 0 &&
+	flash_area_write(dhcpd4_snapshot_fa, dhcpd4_snapshot_slots[dhcpd4_snapshot_slot], header,
+			 sizeof(*header)) == 0) {
+	dhcpd4_snapshot_current = dhcpd4_snapshot_slot;
+	dhcpd4_snapshot_generation = header->generation;
+    } else
+	dhcpd4_snapshot_ret = -1;
+
+    ret = dhcpd4_snapshot_ret;
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    if (ret != 0)
+	LOG_ERR("Lease snapshot not written (%u leases)", header->count);
+
+    return ret;
+}
+
+#if defined(CONFIG_DHCPD_SNAPSHOT_BENCH)
+
+/*
+ * Restore a lease of the benchmark in its scratch pool.
+ */
+
+struct dhcpd4_snapshot_scratch {
+    binding_list bindings;
+    pool_indexes indexes;
+    uint32_t restored;
+};
+
+static void dhcpd4_snapshot_bench_lease(const dhcpd4_lease_record *record, void *arg)
+{
+    struct dhcpd4_snapshot_scratch *scratch = arg;
+    address_binding *binding;
+
+    binding = dhcpd4_add_binding(&scratch->bindings, &scratch->indexes, record->address,
+				 (uint8_t *)record->cident, record->cident_len, DYNAMIC);
+
+    if (binding == NULL)
+	return;
+
+    dhcpd4_set_binding_status(&scratch->bindings, &scratch->indexes, binding, ASSOCIATED, record->lease);
+    scratch->restored++;
+}
+
+/*
+ * Write a snapshot of synthetic leases in 10.0.0.0/8, then restore it
+ * in a scratch pool, indexes included, as done at start. The snapshot
+ * of the benchmark is erased after: the last one of the server is kept.
+ *
+ * The server must be stopped. Return the number of leases restored,
+ * or -1 on error.
+ */
+
+int dhcpd4_snapshot_bench(uint32_t leases, uint32_t *write_us, uint32_t *restore_us)
+{
+    static struct dhcpd4_snapshot_scratch scratch;
+    int current = dhcpd4_snapshot_current;
+    uint32_t generation = dhcpd4_snapshot_generation;
+    dhcpd4_lease_record record;
+    int64_t start;
+    uint32_t i, seq;
+    int ret = -1;
+
+    if (leases == 0 || leases >= (1u << 24) - 2 || dhcpd4_snapshot_init() != 0)
+	return -1;
+
+    start = k_uptime_ticks();
+
+    if (dhcpd4_snapshot_begin(0) != 0)
+	goto end;
+
+    memset(&record, 0, sizeof(record));
+    record.status = ASSOCIATED;
+    record.cident_len = 6;
+    record.lease = 3600;
+    record.cident[0] = 0x02; // locally administered MAC address
+
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    for (i = 0; i < leases; i++) {
+	record.address = htonl(0x0a000001 + i);
+	memcpy(&record.cident[2], &record.address, sizeof(record.address));
+	dhcpd4_snapshot_append(&record);
+    }
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    if (dhcpd4_snapshot_end() != 0)
+	goto end;
+
+    *write_us = k_ticks_to_us_floor32(k_uptime_ticks() - start);
+
+    memset(&scratch, 0, sizeof(scratch));
+    dhcpd4_init_binding_list(&scratch.bindings);
+    scratch.indexes.first = htonl(0x0a000001);
+    scratch.indexes.last = htonl(0x0a000000 + leases);
+
+    start = k_uptime_ticks();
+
+    if (dhcpd4_snapshot_restore(dhcpd4_snapshot_bench_lease, &scratch, &seq) >= 0 &&
+	dhcpd4_init_pool_indexes(&scratch.indexes, &scratch.bindings) == 0)
+	ret = scratch.restored;
+
+    *restore_us = k_ticks_to_us_floor32(k_uptime_ticks() - start);
+
+    dhcpd4_delete_binding_list(&scratch.bindings);
+    dhcpd4_delete_pool_indexes(&scratch.indexes);
+
+end:
+    k_mutex_lock(&dhcpd4_snapshot_lock, K_FOREVER);
+
+    flash_area_erase(dhcpd4_snapshot_fa, dhcpd4_snapshot_slots[dhcpd4_snapshot_slot],
+		     dhcpd4_snapshot_slot_size[dhcpd4_snapshot_slot]);
+    dhcpd4_snapshot_current = current;
+    dhcpd4_snapshot_generation = generation;
+
+    k_mutex_unlock(&dhcpd4_snapshot_lock);
+
+    return ret;
+}
+
+#endif
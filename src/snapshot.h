@@ -0,0 +1,49 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "bindings.h"
+#include "journal.h"
+
+/*
+ * Header of the lease snapshot: a compacted binary image of the
+ * ASSOCIATED bindings, restored at start before the tail of the journal.
+ *
+ * The snapshot partition has two slots, written in turn. A snapshot is
+ * made of fixed size lease records, following its header at the start
+ * of its slot, written last: the previous snapshot stays valid until
+ * the new one is complete.
+ */
+
+#define DHCPD4_SNAPSHOT_MAGIC   0x53484344 // "DHCS"
+#define DHCPD4_SNAPSHOT_VERSION 1
+
+struct dhcpd4_snapshot_header {
+    uint32_t magic;       // DHCPD4_SNAPSHOT_MAGIC
+    uint16_t version;     // DHCPD4_SNAPSHOT_VERSION
+    uint16_t record_size; // size of a lease record
+    uint32_t generation;  // the valid snapshot of highest generation is restored
+    uint32_t count;       // number of lease records
+    uint32_t seq;         // first journal record not applied to the snapshot
+    uint32_t crc;         // CRC-32 of the lease records
+    uint32_t reserved;
+    uint32_t header_crc;  // CRC-32 of the header, up to this field
+} __attribute__((packed));
+
+typedef struct dhcpd4_snapshot_header dhcpd4_snapshot_header;
+
+/* Prototypes */
+
+int dhcpd4_snapshot_init(void);
+int dhcpd4_snapshot_restore(void (*f)(const dhcpd4_lease_record *record, void *arg), void *arg, uint32_t *seq);
+
+int dhcpd4_snapshot_begin(uint32_t seq);
+int dhcpd4_snapshot_append_list(binding_list *list);
+int dhcpd4_snapshot_end(void);
+
+#if defined(CONFIG_DHCPD_SNAPSHOT_BENCH)
+int dhcpd4_snapshot_bench(uint32_t leases, uint32_t *write_us, uint32_t *restore_us);
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#include "platform.h"
+#include <string.h>
+#include "stats.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wall"
+#pragma GCC diagnostic error "-Wextra"
+#pragma GCC diagnostic error "-Wunused"
+#pragma GCC diagnostic error "-Wint-conversion"
+#pragma GCC diagnostic error "-Wincompatible-pointer-types"
+
+/*
+ * Counters of a CPU, on cache lines of their own.
+ */
+
+struct dhcpd4_cpu_stats {
+    atomic_t counters[DHCPD4_STATS];
+    atomic_t latency[DHCPD4_LATENCY_BUCKETS];
+} __aligned(64);
+
+static struct dhcpd4_cpu_stats dhcpd4_cpu_stats[CONFIG_MP_MAX_NUM_CPUS];
+
+static const char *const dhcpd4_stat_names[DHCPD4_STATS] = {
+    [DHCPD4_STAT_RX_DISCOVER]    = "discover received",
+    [DHCPD4_STAT_RX_REQUEST]     = "request received",
+    [DHCPD4_STAT_RX_DECLINE]     = "decline received",
+    [DHCPD4_STAT_RX_RELEASE]     = "release received",
+    [DHCPD4_STAT_RX_INFORM]      = "inform received",
+    [DHCPD4_STAT_RX_OTHER]       = "other type received",
+    [DHCPD4_STAT_TX_OFFER]       = "offer sent",
+    [DHCPD4_STAT_TX_ACK]         = "ack sent",
+    [DHCPD4_STAT_TX_NAK]         = "nak sent",
+    [DHCPD4_STAT_MALFORMED]      = "malformed",
+    [DHCPD4_STAT_DROP_INTERFACE] = "dropped, interface not served",
+    [DHCPD4_STAT_DROP_POOL]      = "dropped, no pool",
+    [DHCPD4_STAT_DROP_IGNORED]   = "dropped, no reply due",
+    [DHCPD4_STAT_DROP_PACKET]    = "dropped, no reply packet",
+    [DHCPD4_STAT_DROP_BUSY]      = "dropped, workers busy",
+};
+
+/*
+ * Counters of the current CPU. The thread may move to another CPU
+ * meanwhile: the counters are atomic anyway.
+ */
+
+static struct dhcpd4_cpu_stats *dhcpd4_this_cpu_stats(void)
+{
+    return &dhcpd4_cpu_stats[arch_curr_cpu()->id];
+}
+
+void dhcpd4_count(int counter)
+{
+    atomic_inc(&dhcpd4_this_cpu_stats()->counters[counter]);
+}
+
+/*
+ * Count the latency of a reply sent now, for a request
+ * received at start (hardware cycles).
+ */
+
+void dhcpd4_count_latency(uint32_t start)
+{
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+
+    atomic_inc(&dhcpd4_this_cpu_stats()->latency[MIN(bucket, DHCPD4_LATENCY_BUCKETS - 1)]);
+}
+
+/*
+ * Add the counters of all the CPUs, and reset them if asked.
+ */
+
+void dhcpd4_get_stats(struct dhcpd4_stats *stats, bool reset)
+{
+    int cpu, i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (cpu = 0; cpu < CONFIG_MP_MAX_NUM_CPUS; cpu++) {
+	struct dhcpd4_cpu_stats *cpu_stats = &dhcpd4_cpu_stats[cpu];
+
+	for (i = 0; i < DHCPD4_STATS; i++)
+	    stats->counters[i] += reset ? atomic_clear(&cpu_stats->counters[i]) :
+		atomic_get(&cpu_stats->counters[i]);
+
+	for (i = 0; i < DHCPD4_LATENCY_BUCKETS; i++)
+	    stats->latency[i] += reset ? atomic_clear(&cpu_stats->latency[i]) :
+		atomic_get(&cpu_stats->latency[i]);
+    }
+}
+
+const char *dhcpd4_stat_name(int counter)
+{
+    return dhcpd4_stat_names[counter];
+}
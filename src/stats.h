@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Header of the statistics of the requests served: counters and
+ * histogram of the latency from the reception of a request to the
+ * sending of its reply.
+ *
+ * Each CPU counts in its own counters, without any lock: the
+ * counters of all the CPUs are added when read.
+ */
+
+enum {
+    DHCPD4_STAT_RX_DISCOVER = 0,  // requests received, by DHCP message type
+    DHCPD4_STAT_RX_REQUEST,
+    DHCPD4_STAT_RX_DECLINE,
+    DHCPD4_STAT_RX_RELEASE,
+    DHCPD4_STAT_RX_INFORM,
+    DHCPD4_STAT_RX_OTHER,         // other message type
+    DHCPD4_STAT_TX_OFFER,         // replies sent, by DHCP message type
+    DHCPD4_STAT_TX_ACK,
+    DHCPD4_STAT_TX_NAK,
+    DHCPD4_STAT_MALFORMED,        // invalid header or options
+    DHCPD4_STAT_DROP_INTERFACE,   // received on an interface not served
+    DHCPD4_STAT_DROP_POOL,        // no pool for the relay agent or the interface
+    DHCPD4_STAT_DROP_IGNORED,     // no reply due (other server selected, no address left...)
+    DHCPD4_STAT_DROP_PACKET,      // reply dropped, no packet available
+    DHCPD4_STAT_DROP_BUSY,        // request dropped, workers busy
+    DHCPD4_STATS
+};
+
+/*
+ * Latency histogram: bucket 0 counts the replies sent in less than
+ * 1 us, bucket i > 0 the replies sent in 2^(i-1) up to 2^i - 1 us,
+ * the last bucket all the longer ones.
+ */
+
+#define DHCPD4_LATENCY_BUCKETS 20
+
+struct dhcpd4_stats {
+    uint32_t counters[DHCPD4_STATS];
+    uint32_t latency[DHCPD4_LATENCY_BUCKETS];
+};
+
+/* Prototypes */
+
+void dhcpd4_count(int counter);
+void dhcpd4_count_latency(uint32_t start);
+void dhcpd4_get_stats(struct dhcpd4_stats *stats, bool reset);
+const char *dhcpd4_stat_name(int counter);
+
+#endif
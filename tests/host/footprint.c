@@ -0,0 +1,69 @@
+#include "platform.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "dhcpmem.h"
+#include "test.h"
+
+/*
+ * Footprint of the binding records of 64k leases, taken from the slab.
+ *
+ * A record is 24 bytes with 32-bit pointers (the targets, and native_sim):
+ * 1.5 MiB for 64k leases, the budget. With 64-bit pointers (the hosts),
+ * the list link and the pointer of a long client identifier make it
+ * 40 bytes. The hash indexes and the bitmaps of the pool are reported
+ * apart: their slots are pointers, at most two per lease and index.
+ */
+
+#define TEST_LEASES 65536
+#define TEST_RECORD_BUDGET (sizeof(void *) == 4 ? 24u : 40u)
+#define TEST_INDEX_SLOTS_MAX (2u * TEST_LEASES) // per index
+
+int main(void)
+{
+    struct dhcpd4_mem_stats mem[DHCPD4_MEM_CLASSES];
+    pool_indexes indexes;
+    binding_list list;
+    uint32_t i, added = 0;
+    size_t records, index_slots, bitmaps;
+
+    memset(&indexes, 0, sizeof(indexes));
+    indexes.first = htonl(0x0a000001);
+    indexes.last = htonl(0x0a000000 + TEST_LEASES);
+    dhcpd4_init_binding_list(&list);
+    CHECK(dhcpd4_init_pool_indexes(&indexes, &list) == 0, "pool indexes");
+
+    for (i = 0; i < TEST_LEASES; i++) {
+	uint8_t cident[6] = { 0x02, 0 };
+	uint32_t client = htonl(i);
+
+	memcpy(&cident[2], &client, sizeof(client));
+
+	if (dhcpd4_add_binding(&list, &indexes, htonl(0x0a000001 + i), cident, sizeof(cident), DYNAMIC) != NULL)
+	    added++;
+    }
+
+    CHECK(added == TEST_LEASES, "%u leases added of %u", added, TEST_LEASES);
+
+    dhcpd4_get_mem_stats(mem);
+
+    records = (size_t)mem[DHCPD4_MEM_BINDING].used * mem[DHCPD4_MEM_BINDING].block_size;
+    index_slots = ((size_t)list.cident_index.size + list.address_index.size) * sizeof(address_binding *);
+    bitmaps = 2 * ((indexes.size + 63) / 64) * sizeof(uint64_t);
+
+    printf("%u leases: records %zu bytes (%u per record), budget %zu bytes\n",
+	   added, records, mem[DHCPD4_MEM_BINDING].block_size, (size_t)TEST_LEASES * TEST_RECORD_BUDGET);
+    printf("indexes %zu bytes (%u + %u slots), bitmaps %zu bytes\n", index_slots,
+	   list.cident_index.size, list.address_index.size, bitmaps);
+
+    CHECK(records <= (size_t)TEST_LEASES * TEST_RECORD_BUDGET, "%zu bytes of records for %u leases",
+	  records, TEST_LEASES);
+    CHECK(sizeof(void *) != 4 || records <= (3u << 19), "%zu bytes of records, over 1.5 MiB", records);
+    CHECK(list.cident_index.size <= TEST_INDEX_SLOTS_MAX && list.address_index.size <= TEST_INDEX_SLOTS_MAX,
+	  "%u and %u index slots", list.cident_index.size, list.address_index.size);
+
+    dhcpd4_delete_binding_list(&list);
+    dhcpd4_delete_pool_indexes(&indexes);
+
+    return TEST_RESULT();
+}
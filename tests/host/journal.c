@@ -0,0 +1,341 @@
+#include "platform.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "journal.h"
+#include "test.h"
+
+/*
+ * Lease journal in the simulated flash of the host, on the simulated
+ * clock (the tests of tests/journal on native_sim): group commit of
+ * the buffered records, replay after a reboot, rotation of the sectors
+ * when the journal is full, a flash written by blocks larger than a
+ * record header, and a compaction interrupted by a power loss.
+ */
+
+#define TEST_SECTOR_SIZE 4096
+#define TEST_SECTORS     CONFIG_DHCPD_JOURNAL_SECTORS
+#define TEST_BINDINGS    10
+#define TEST_LEASE       3600
+#define TEST_ROUND       100 // bindings written by each compaction of the wraparound test
+#define TEST_HISTORY     5   // compactions written before the one interrupted
+
+static pool_indexes test_indexes;
+static binding_list test_list;
+static address_binding *test_bindings[TEST_ROUND];
+
+/*
+ * Records replayed from the journal.
+ */
+
+struct test_replay {
+    uint32_t count;      // records replayed
+    uint32_t first;      // sequence number of the first one
+    uint32_t last;       // sequence number of the last one
+    bool contiguous;     // each record follows the previous one
+    dhcpd4_lease_record records[TEST_BINDINGS * 2];
+};
+
+static struct test_replay test_replay;
+
+static void test_replay_record(const dhcpd4_lease_record *record, void *arg)
+{
+    struct test_replay *replay = arg;
+
+    if (replay->count == 0)
+	replay->first = record->seq;
+    else if (record->seq != replay->last + 1)
+	replay->contiguous = false;
+
+    if (replay->count < ARRAY_SIZE(replay->records))
+	replay->records[replay->count] = *record;
+
+    replay->last = record->seq;
+    replay->count++;
+}
+
+static struct test_replay *test_replay_journal(void)
+{
+    memset(&test_replay, 0, sizeof(test_replay));
+    test_replay.contiguous = true;
+
+    CHECK(dhcpd4_journal_replay(test_replay_record, &test_replay) == 0, "journal not replayed");
+
+    return &test_replay;
+}
+
+/*
+ * Mount the journal again, as after a reboot.
+ */
+
+static void test_reboot(void)
+{
+    dhcpd4_journal_unmount();
+    CHECK(dhcpd4_journal_get_seq() == 0, "sequence number not forgotten");
+    CHECK(dhcpd4_journal_init() == 0, "journal not mounted again");
+}
+
+/*
+ * Bind count clients of the scratch pool 10.0.0.0/24.
+ */
+
+static void test_bind(int count)
+{
+    uint8_t cident[6] = { 0x02, 0, 0, 0, 0, 0 };
+    int i;
+
+    for (i = 0; i < count; i++) {
+	cident[5] = (uint8_t)i;
+	test_bindings[i] = dhcpd4_new_dynamic_binding(&test_list, &test_indexes, 0, cident, sizeof(cident));
+	CHECK(test_bindings[i] != NULL, "client %d not bound", i);
+	if (test_bindings[i] != NULL)
+	    dhcpd4_set_binding_status(&test_list, &test_indexes, test_bindings[i], ASSOCIATED, TEST_LEASE);
+    }
+}
+
+/*
+ * Each test starts with an erased flash written by blocks of align
+ * bytes, and the journal mounted on it.
+ */
+
+static void test_before(uint32_t align)
+{
+    CHECK(dhcpd4_host_flash_setup(TEST_SECTOR_SIZE, TEST_SECTORS, align) == 0, "no flash");
+    dhcpd4_journal_unmount();
+    CHECK(dhcpd4_journal_init() == 0, "journal not mounted");
+
+    memset(&test_indexes, 0, sizeof(test_indexes));
+    test_indexes.first = htonl(0x0a000002);
+    test_indexes.last = htonl(0x0a0000fe);
+    dhcpd4_init_binding_list(&test_list);
+    CHECK(dhcpd4_init_pool_indexes(&test_indexes, &test_list) == 0, "pool indexes");
+}
+
+static void test_after(void)
+{
+    dhcpd4_journal_stop();
+    dhcpd4_delete_binding_list(&test_list);
+    dhcpd4_delete_pool_indexes(&test_indexes);
+}
+
+/*
+ * The records are written together, once the commit interval is over.
+ */
+
+static void test_group_commit(void)
+{
+    struct test_replay *replay;
+    int i;
+
+    test_before(8);
+    dhcpd4_journal_start();
+    test_bind(TEST_BINDINGS);
+
+    replay = test_replay_journal();
+    CHECK(replay->count == 0, "%u records written before the commit", replay->count);
+
+    k_msleep(2 * CONFIG_DHCPD_JOURNAL_COMMIT_MS);
+
+    replay = test_replay_journal();
+    CHECK(replay->count == TEST_BINDINGS, "%u records written", replay->count);
+    CHECK(replay->contiguous, "records out of order");
+    CHECK(replay->first == 0, "first record %u", replay->first);
+
+    for (i = 0; i < TEST_BINDINGS && i < (int)replay->count; i++) {
+	CHECK(replay->records[i].status == ASSOCIATED, "record %d: status %u", i, replay->records[i].status);
+	CHECK(replay->records[i].address == test_bindings[i]->address, "record %d: address", i);
+	CHECK(replay->records[i].lease == TEST_LEASE, "record %d: lease %u", i, replay->records[i].lease);
+	CHECK(replay->records[i].cident_len == 6 &&
+	      memcmp(replay->records[i].cident, dhcpd4_binding_cident(test_bindings[i]), 6) == 0,
+	      "record %d: client identifier", i);
+    }
+
+    test_after();
+}
+
+/*
+ * The records buffered are written when recording stops, and
+ * replayed in order once the journal is mounted again.
+ */
+
+static void test_replay_after_reboot(uint32_t align)
+{
+    struct test_replay *replay;
+    int i;
+
+    test_before(align);
+    dhcpd4_journal_start();
+    test_bind(TEST_BINDINGS);
+
+    for (i = 0; i < TEST_BINDINGS / 2; i++)
+	dhcpd4_set_binding_status(&test_list, &test_indexes, test_bindings[i], RELEASED, 0);
+
+    dhcpd4_journal_stop();
+    test_reboot();
+
+    replay = test_replay_journal();
+    CHECK(replay->count == TEST_BINDINGS + TEST_BINDINGS / 2, "align %u: %u records replayed", align, replay->count);
+    CHECK(replay->contiguous, "align %u: records out of order", align);
+    CHECK(replay->first == 0, "align %u: first record %u", align, replay->first);
+
+    for (i = 0; i < TEST_BINDINGS; i++)
+	CHECK(replay->records[i].status == ASSOCIATED, "align %u: record %d: status %u",
+	      align, i, replay->records[i].status);
+
+    for (i = 0; i < TEST_BINDINGS / 2; i++) {
+	const dhcpd4_lease_record *record = &replay->records[TEST_BINDINGS + i];
+
+	CHECK(record->status == RELEASED, "align %u: release %d: status %u", align, i, record->status);
+	CHECK(record->address == test_bindings[i]->address, "align %u: release %d: address", align, i);
+	CHECK(record->lease == 0, "align %u: release %d: lease %u", align, i, record->lease);
+    }
+
+    test_after();
+}
+
+/*
+ * Written beyond the size of the partition, the journal drops its
+ * oldest sectors: the newest records are all replayed, in order.
+ */
+
+static void test_wraparound(void)
+{
+    struct test_replay *replay;
+    uint32_t rounds, total, i;
+
+    test_before(8);
+
+    rounds = TEST_SECTOR_SIZE * TEST_SECTORS / (DHCPD4_LEASE_HEADER_SIZE * TEST_ROUND) * 2 + 1; // twice the partition
+    total = rounds * TEST_ROUND;
+
+    test_bind(TEST_ROUND); // journal not started: nothing buffered
+
+    for (i = 0; i < rounds; i++)
+	CHECK(dhcpd4_journal_append_list(&test_list) == 0, "round %u not written", i);
+
+    CHECK(dhcpd4_journal_get_seq() == total, "sequence number %u", dhcpd4_journal_get_seq());
+
+    replay = test_replay_journal();
+    CHECK(replay->count > TEST_ROUND, "%u records replayed", replay->count);
+    CHECK(replay->count < total, "no record dropped out of %u", total);
+    CHECK(replay->contiguous, "records out of order");
+    CHECK(replay->last == total - 1, "last record %u", replay->last);
+    CHECK(replay->first == total - replay->count, "first record %u", replay->first);
+
+    // the journal still takes records after its rotation, once mounted again
+
+    test_reboot();
+    dhcpd4_journal_set_seq(total);
+    CHECK(dhcpd4_journal_append_list(&test_list) == 0, "round not written after the reboot");
+
+    replay = test_replay_journal();
+    CHECK(replay->contiguous, "records out of order after the reboot");
+    CHECK(replay->last == total + TEST_ROUND - 1, "last record %u after the reboot", replay->last);
+
+    test_after();
+}
+
+/*
+ * Status of the bindings replayed, by address.
+ */
+
+static uint8_t test_status[TEST_ROUND];
+
+static void test_replay_status(const dhcpd4_lease_record *record, void *arg)
+{
+    uint32_t i = ntohl(record->address) - ntohl(test_indexes.first);
+
+    ARG_UNUSED(arg);
+
+    if (i < TEST_ROUND)
+	test_status[i] = record->status;
+}
+
+/*
+ * Compact the journal as at start without a snapshot (see
+ * dhcpd4_restore_leases()), with a power loss after writes writes
+ * or erases of the flash, then replay it after the reboot: the
+ * clients still bound are all restored.
+ *
+ * Return true if the power was lost before the end of the compaction.
+ */
+
+static bool test_interrupted_compaction(int writes)
+{
+    uint32_t released = TEST_BINDINGS, i, history; // records buffered, not lost
+    bool written;
+
+    test_before(8);
+    test_bind(TEST_ROUND);
+
+    for (i = 0; i < TEST_HISTORY; i++)
+	CHECK(dhcpd4_journal_append_list(&test_list) == 0, "history %u not written", i);
+
+    dhcpd4_journal_start();
+
+    for (i = 0; i < released; i++)
+	dhcpd4_set_binding_status(&test_list, &test_indexes, test_bindings[i], RELEASED, 0);
+
+    dhcpd4_journal_stop();
+    history = dhcpd4_journal_get_seq();
+
+    // reboot, then compaction until the power loss
+
+    test_reboot();
+    dhcpd4_journal_set_seq(history);
+    dhcpd4_host_flash_writes = writes;
+
+    dhcpd4_journal_compact_begin();
+    written = dhcpd4_journal_append_list(&test_list) == 0;
+    written = dhcpd4_journal_compact_end(written) == 0;
+
+    if (dhcpd4_host_flash_writes != 0)
+	CHECK(written, "compaction failed without a power loss");
+
+    dhcpd4_host_flash_writes = -1;
+    test_reboot();
+
+    memset(test_status, 0, sizeof(test_status));
+    CHECK(dhcpd4_journal_replay(test_replay_status, NULL) == 0, "journal not replayed");
+
+    for (i = 0; i < TEST_ROUND; i++) {
+	if (i < released)
+	    CHECK(test_status[i] == RELEASED, "power loss after %d writes: client %u status %u",
+		  writes, i, test_status[i]);
+	else
+	    CHECK(test_status[i] == ASSOCIATED, "power loss after %d writes: client %u not restored (status %u)",
+		  writes, i, test_status[i]);
+    }
+
+    if (written) { // the older sectors dropped
+	struct test_replay *replay = test_replay_journal();
+
+	CHECK(replay->count < history, "%u records after the compaction of %u", replay->count, history);
+	CHECK(replay->last == history + TEST_ROUND - released - 1, "last record %u", replay->last);
+    }
+
+    test_after();
+
+    return !written;
+}
+
+int main(void)
+{
+    int writes;
+
+    dhcpd4_log_level = LOG_LEVEL_NONE;
+    dhcpd4_host_clock_ms = 1000;
+
+    test_group_commit();
+    test_replay_after_reboot(1);
+    test_replay_after_reboot(8);
+    test_replay_after_reboot(32);
+    test_wraparound();
+
+    for (writes = 0; test_interrupted_compaction(writes); writes++)
+	;
+
+    CHECK(writes > TEST_ROUND, "compaction done after %d writes", writes);
+
+    return TEST_RESULT();
+}
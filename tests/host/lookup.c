@@ -0,0 +1,97 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "test.h"
+
+/*
+ * Benchmark of dhcpd4_search_binding() from 10 to 10000 bindings: the
+ * hash index on the client identifier keeps the cost of a lookup flat,
+ * where the walk of the list it replaced grew with the bindings.
+ *
+ * The cost of a lookup (the median of several runs, hits and misses)
+ * is printed for each size, and must not grow more than
+ * TEST_GROWTH_MAX times from 10 to 10000 bindings (the walk of the
+ * list grew about 1000 times).
+ */
+
+#define TEST_LOOKUPS    200000
+#define TEST_RUNS       7
+#define TEST_GROWTH_MAX 5
+
+static void test_cident(uint32_t client, uint8_t *cident)
+{
+    uint32_t index = htonl(client * 2654435761u); // spread over the bytes
+
+    cident[0] = 0x02; // locally administered MAC address
+    cident[1] = 0;
+    memcpy(&cident[2], &index, sizeof(index));
+}
+
+/*
+ * Get the median cost of a lookup (ns) with the passed number of bindings,
+ * every other lookup being for a client without binding.
+ */
+
+static uint64_t test_lookup_cost(uint32_t bindings)
+{
+    pool_indexes indexes;
+    binding_list list;
+    uint64_t runs[TEST_RUNS];
+    uint8_t cident[6];
+    uint32_t i, found;
+    int run;
+
+    memset(&indexes, 0, sizeof(indexes));
+    indexes.first = htonl(0x0a000001);
+    indexes.last = htonl(0x0a000000 + bindings);
+    dhcpd4_init_binding_list(&list);
+    CHECK(dhcpd4_init_pool_indexes(&indexes, &list) == 0, "pool indexes");
+
+    for (i = 0; i < bindings; i++) {
+	test_cident(i, cident);
+	CHECK(dhcpd4_add_binding(&list, &indexes, htonl(0x0a000001 + i), cident, sizeof(cident), DYNAMIC) != NULL,
+	      "binding %u of %u not added", i, bindings);
+    }
+
+    for (run = 0; run < TEST_RUNS; run++) {
+	uint64_t start = test_now_ns();
+
+	found = 0;
+
+	for (i = 0; i < TEST_LOOKUPS; i++) {
+	    // hits on clients 0..bindings-1, misses on clients from bindings on
+	    test_cident((i & 1) ? bindings + i % bindings : i % bindings, cident);
+	    found += dhcpd4_search_binding(&list, cident, sizeof(cident), DYNAMIC, 0) != NULL;
+	}
+
+	runs[run] = (test_now_ns() - start) / TEST_LOOKUPS;
+	CHECK(found == TEST_LOOKUPS / 2, "%u bindings: %u lookups found instead of %u",
+	      bindings, found, TEST_LOOKUPS / 2);
+    }
+
+    dhcpd4_delete_binding_list(&list);
+    dhcpd4_delete_pool_indexes(&indexes);
+
+    qsort(runs, TEST_RUNS, sizeof(runs[0]), test_compare);
+
+    return runs[TEST_RUNS / 2];
+}
+
+int main(void)
+{
+    static const uint32_t sizes[] = { 10, 100, 1000, 10000 };
+    uint64_t cost[ARRAY_SIZE(sizes)];
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+	cost[i] = test_lookup_cost(sizes[i]);
+	printf("%5u bindings: %3u ns per lookup\n", sizes[i], (unsigned)cost[i]);
+    }
+
+    CHECK(cost[ARRAY_SIZE(sizes) - 1] <= TEST_GROWTH_MAX * (cost[0] ? cost[0] : 1),
+	  "lookup cost grew from %u ns to %u ns", (unsigned)cost[0], (unsigned)cost[ARRAY_SIZE(sizes) - 1]);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,161 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcpmem.h"
+#include "test.h"
+
+/*
+ * Benchmark of the options of a reply: the options requested by the
+ * client (PARAMETER_REQUEST_LIST) copied from the pool options compiled
+ * in a blob, against the list path the blob replaced (search of the
+ * pool option list, copy appended to the reply list, serialization of
+ * the list). Both must write the same options.
+ *
+ * The cost of a reply (the median of several runs) is printed for each
+ * path, and the blob must be at least TEST_SPEEDUP_MIN times faster.
+ */
+
+#define TEST_REPLIES     20000
+#define TEST_RUNS        7
+#define TEST_SPEEDUP_MIN 3
+
+static char *test_pool_options[][2] = {
+    { "SUBNET_MASK", "255.255.255.0" },
+    { "TIME_OFFSET", "3600" },
+    { "ROUTER", "192.168.2.1" },
+    { "TIME_SERVER", "192.168.2.1" },
+    { "NAME_SERVER", "192.168.2.1" },
+    { "DOMAIN_NAME_SERVER", "192.168.2.1,192.168.2.2" },
+    { "LOG_SERVER", "192.168.2.1" },
+    { "HOST_NAME", "dhcpd4" },
+    { "DOMAIN_NAME", "example.org" },
+    { "INTERFACE_MTU", "1500" },
+    { "BROADCAST_ADDRESS", "192.168.2.255" },
+    { "STATIC_ROUTE", "10.0.0.0,192.168.2.1" },
+    { "ARP_CACHE_TIMEOUT", "60" },
+    { "TCP_DEFAULT_TTL", "64" },
+    { "ROOT_PATH", "/srv/root" },
+    { "IP_FORWARDING", "0" },
+};
+
+static const uint8_t test_requested[] = {
+    SUBNET_MASK, ROUTER, DOMAIN_NAME_SERVER, DOMAIN_NAME, HOST_NAME,
+    BROADCAST_ADDRESS, INTERFACE_MTU, STATIC_ROUTE, TIME_OFFSET, NETWORK_TIME_PROTOCOL_SERVERS,
+};
+
+static uint8_t test_list_buf[312], test_blob_buf[312];
+
+/*
+ * Write the options of a reply as before the blob.
+ */
+
+static size_t test_list_reply(address_pool *pool, uint8_t *buf, size_t len)
+{
+    static dhcp_option type_opt = { .id = DHCP_MESSAGE_TYPE, .len = 1, .data = { DHCP_ACK } };
+    static dhcp_option server_id_opt = { .id = SERVER_IDENTIFIER, .len = 4 };
+    dhcp_option_list reply_opts;
+    size_t n;
+    size_t i;
+
+    memcpy(server_id_opt.data, &pool->server_id, sizeof(pool->server_id));
+
+    dhcpd4_init_option_list(&reply_opts);
+    dhcpd4_append_option(&reply_opts, &type_opt);
+    dhcpd4_append_option(&reply_opts, &server_id_opt);
+
+    for (i = 0; i < sizeof(test_requested); i++) {
+	dhcp_option *opt = dhcpd4_search_option(&pool->options, test_requested[i]);
+
+	if (opt != NULL)
+	    dhcpd4_append_option(&reply_opts, opt);
+    }
+
+    n = dhcpd4_serialize_option_list(&reply_opts, buf, len);
+    dhcpd4_delete_option_list(&reply_opts);
+
+    return n;
+}
+
+/*
+ * Write the options of a reply as the engine does (one byte always
+ * left for END).
+ */
+
+static size_t test_blob_reply(address_pool *pool, uint8_t *buf, size_t len)
+{
+    uint8_t type = DHCP_ACK;
+    size_t n = sizeof(option_magic);
+    size_t i;
+
+    memcpy(buf, option_magic, sizeof(option_magic));
+    n += dhcpd4_serialize_option(buf + n, len - n, DHCP_MESSAGE_TYPE, 1, &type);
+    n += dhcpd4_serialize_option(buf + n, len - n, SERVER_IDENTIFIER, 4, &pool->server_id);
+
+    for (i = 0; i < sizeof(test_requested); i++)
+	n += dhcpd4_serialize_blob_option(&pool->option_blob, test_requested[i], buf + n, len - n - 1);
+
+    buf[n++] = END;
+
+    return n;
+}
+
+/*
+ * Get the median cost of the options of a reply (ns).
+ */
+
+static uint64_t test_reply_cost(address_pool *pool, size_t (*reply)(address_pool *, uint8_t *, size_t),
+				uint8_t *buf)
+{
+    uint64_t runs[TEST_RUNS];
+    int run, i;
+
+    for (run = 0; run < TEST_RUNS; run++) {
+	uint64_t start = test_now_ns();
+
+	for (i = 0; i < TEST_REPLIES; i++)
+	    reply(pool, buf, 312);
+
+	runs[run] = (test_now_ns() - start) / TEST_REPLIES;
+    }
+
+    qsort(runs, TEST_RUNS, sizeof(runs[0]), test_compare);
+
+    return runs[TEST_RUNS / 2];
+}
+
+int main(void)
+{
+    static address_pool pool;
+    uint64_t list_ns, blob_ns;
+    size_t list_len, blob_len, i;
+
+    dhcpd4_init_option_list(&pool.options);
+    pool.server_id = htonl(0xc0a80201);
+
+    for (i = 0; i < ARRAY_SIZE(test_pool_options); i++)
+	CHECK(dhcpd4_parse_and_add_option(&pool, test_pool_options[i][0], test_pool_options[i][1]) == 0,
+	      "option %s", test_pool_options[i][0]);
+
+    CHECK(dhcpd4_compile_option_list(&pool.option_blob, &pool.options) == 0, "blob not compiled");
+
+    list_len = test_list_reply(&pool, test_list_buf, sizeof(test_list_buf));
+    blob_len = test_blob_reply(&pool, test_blob_buf, sizeof(test_blob_buf));
+
+    CHECK(list_len != 0 && list_len == blob_len && memcmp(test_list_buf, test_blob_buf, list_len) == 0,
+	  "options differ (%zu and %zu bytes)", list_len, blob_len);
+
+    list_ns = test_reply_cost(&pool, test_list_reply, test_list_buf);
+    blob_ns = test_reply_cost(&pool, test_blob_reply, test_blob_buf);
+
+    printf("%zu pool options, %zu requested (%zu bytes): list %u ns, blob %u ns per reply\n",
+	   ARRAY_SIZE(test_pool_options), sizeof(test_requested), blob_len, (unsigned)list_ns, (unsigned)blob_ns);
+
+    CHECK(blob_ns * TEST_SPEEDUP_MIN <= list_ns, "blob %u ns, list %u ns", (unsigned)blob_ns, (unsigned)list_ns);
+
+    dhcpd4_delete_option_blob(&pool.option_blob);
+    dhcpd4_delete_option_list(&pool.options);
+
+    return TEST_RESULT();
+}
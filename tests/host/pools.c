@@ -0,0 +1,127 @@
+#include "platform.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcpmem.h"
+#include "test.h"
+
+/*
+ * Pools of the relayed subnets across a stop and a start of the server
+ * (dhcpd4_delete_pools() then dhcpd4_init_pools()): a relay pool stays
+ * registered with its static bindings, the dynamic ones being deleted.
+ */
+
+#define TEST_SERVER 0x0a000001 // 10.0.0.1, pool of the interface
+#define TEST_RELAY  0x0a010001 // 10.1.0.1, relay agent of 10.1.0.0/24
+#define TEST_STATIC 0x0a010032 // 10.1.0.50, static binding of the relay pool
+#define TEST_CYCLES 3
+
+static address_pool test_relay_pool;
+static dhcpd_message test_request;
+static dhcpd_message test_reply;
+
+static const uint8_t test_static_mac[6] = { 0x02, 0, 0, 0, 0, 0x50 };
+static const uint8_t test_dynamic_mac[6] = { 0x02, 0, 0, 0, 0, 0x51 };
+
+/*
+ * Serve a DISCOVER of a client relayed by TEST_RELAY.
+ *
+ * Return the address offered, 0 if none.
+ */
+
+static uint32_t test_relayed_discover(const uint8_t *mac)
+{
+    dhcpd_message *msg = &test_request;
+    dhcpd4_rxinfo rxinfo = {
+	.server_id = htonl(TEST_SERVER),
+	.src_addr = htonl(TEST_RELAY),
+	.src_port = htons(BOOTPS),
+    };
+    size_t room = sizeof(msg->options) - 1, len = sizeof(option_magic);
+    size_t reply_len = sizeof(test_reply);
+    uint8_t type = DHCP_DISCOVER;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->op = BOOTREQUEST;
+    msg->htype = ETHERNET;
+    msg->hlen = ETHERNET_LEN;
+    msg->hops = 1;
+    msg->xid = htonl(1);
+    msg->giaddr = htonl(TEST_RELAY);
+    memcpy(msg->chaddr, mac, ETHERNET_LEN);
+
+    memcpy(msg->options, option_magic, sizeof(option_magic));
+    len += dhcpd4_serialize_option(msg->options + len, room - len, DHCP_MESSAGE_TYPE, 1, &type);
+    msg->options[len++] = END;
+
+    if (dhcpd4_handle((const uint8_t *)msg, DHCP_HEADER_SIZE + len, (uint8_t *)&test_reply,
+		      &reply_len, &rxinfo) != DHCP_OFFER)
+	return 0;
+
+    return test_reply.yiaddr;
+}
+
+int main(void)
+{
+    address_pool *pool = dhcpd4_get_pool();
+    address_pool *relay = &test_relay_pool;
+    address_binding *binding;
+    int cycle;
+
+    dhcpd4_log_level = LOG_LEVEL_NONE;
+
+    memset(pool, 0, sizeof(*pool));
+    dhcpd4_init_binding_list(&pool->bindings);
+    dhcpd4_init_option_list(&pool->options);
+    pool->server_id = htonl(TEST_SERVER);
+    pool->netmask = htonl(0xffffff00);
+    pool->indexes.first = htonl(TEST_SERVER + 1);
+    pool->indexes.last = htonl(TEST_SERVER + 100);
+
+    // as configured by "dhcpd4 subnet -a 10.1.0.10,10.1.0.100 -s mac,10.1.0.50 10.1.0.0/24"
+
+    dhcpd4_init_binding_list(&relay->bindings);
+    dhcpd4_init_option_list(&relay->options);
+    relay->subnet = htonl(TEST_RELAY);
+    relay->netmask = htonl(0xffffff00);
+    relay->indexes.first = htonl(0x0a01000a);
+    relay->indexes.last = htonl(0x0a010064);
+    CHECK(dhcpd4_add_binding(&relay->bindings, &relay->indexes, htonl(TEST_STATIC),
+			     (uint8_t *)test_static_mac, sizeof(test_static_mac), STATIC) != NULL,
+	  "static binding not added");
+    CHECK(dhcpd4_add_pool(relay) == 0, "relay pool not added");
+
+    for (cycle = 0; cycle < TEST_CYCLES; cycle++) {
+	uint32_t offered;
+
+	CHECK(dhcpd4_init_pools(pool) == 0 && dhcpd4_init_shards() == 0, "start %d: pools not set up", cycle);
+	CHECK(dhcpd4_pool_count == 2, "start %d: %d pools", cycle, dhcpd4_pool_count);
+
+	binding = dhcpd4_search_binding_by_address(&relay->bindings, &relay->indexes, htonl(TEST_STATIC));
+	CHECK(binding != NULL && binding->is_static, "start %d: static binding lost", cycle);
+	CHECK(binding == NULL || binding->status == B_EMPTY, "start %d: static binding status %u",
+	      cycle, binding != NULL ? binding->status : 0);
+	CHECK(relay->indexes.free == relay->indexes.size - 1, "start %d: %u addresses free out of %u",
+	      cycle, relay->indexes.free, relay->indexes.size);
+
+	offered = test_relayed_discover(test_static_mac);
+	CHECK(offered == htonl(TEST_STATIC), "start %d: static client offered %08x", cycle, ntohl(offered));
+
+	offered = test_relayed_discover(test_dynamic_mac);
+	CHECK(offered != 0 && offered != htonl(TEST_STATIC), "start %d: dynamic client offered %08x",
+	      cycle, ntohl(offered));
+
+	dhcpd4_delete_pools();
+
+	// stopped: the dynamic binding is gone, the static one kept
+
+	CHECK(dhcpd4_search_binding(&relay->bindings, (uint8_t *)test_dynamic_mac, sizeof(test_dynamic_mac),
+				    STATIC_OR_DYNAMIC, 0) == NULL, "stop %d: dynamic binding kept", cycle);
+	CHECK(relay->bindings.cident_index.count == 1, "stop %d: %u bindings kept",
+	      cycle, relay->bindings.cident_index.count);
+    }
+
+    dhcpd4_delete_option_list(&pool->options);
+
+    return TEST_RESULT();
+}
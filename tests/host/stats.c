@@ -0,0 +1,103 @@
+#include "platform.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dhcpmem.h"
+#include "stats.h"
+#include "test.h"
+
+/*
+ * Counters of the requests served through dhcpd4_handle(): the requests
+ * having no reply by design (DECLINE, RELEASE) and the unknown types are
+ * not counted as dropped.
+ */
+
+#define TEST_SERVER 0x0a000001 // 10.0.0.1
+
+static dhcpd_message test_request;
+static dhcpd_message test_reply;
+
+/*
+ * Serve a request of type from the client, having the passed ciaddr,
+ * server identifier and requested address (0 if absent).
+ *
+ * Return the type of the reply, 0 if none.
+ */
+
+static int test_serve(uint8_t type, uint32_t ciaddr, uint32_t server_id, uint32_t requested)
+{
+    dhcpd_message *msg = &test_request;
+    dhcpd4_rxinfo rxinfo = { .server_id = htonl(TEST_SERVER), .src_port = htons(BOOTPC) };
+    size_t room = sizeof(msg->options) - 1, len = sizeof(option_magic);
+    size_t reply_len = sizeof(test_reply);
+
+    memset(msg, 0, sizeof(*msg));
+    msg->op = BOOTREQUEST;
+    msg->htype = ETHERNET;
+    msg->hlen = ETHERNET_LEN;
+    msg->xid = htonl(1);
+    msg->ciaddr = ciaddr;
+    msg->chaddr[0] = 0x02;
+    msg->chaddr[5] = 0x01;
+
+    memcpy(msg->options, option_magic, sizeof(option_magic));
+    len += dhcpd4_serialize_option(msg->options + len, room - len, DHCP_MESSAGE_TYPE, 1, &type);
+    if (server_id != 0)
+	len += dhcpd4_serialize_option(msg->options + len, room - len, SERVER_IDENTIFIER, 4, &server_id);
+    if (requested != 0)
+	len += dhcpd4_serialize_option(msg->options + len, room - len, REQUESTED_IP_ADDRESS, 4, &requested);
+    msg->options[len++] = END;
+
+    return dhcpd4_handle((const uint8_t *)msg, DHCP_HEADER_SIZE + len, (uint8_t *)&test_reply,
+			 &reply_len, &rxinfo);
+}
+
+int main(void)
+{
+    address_pool *pool = dhcpd4_get_pool();
+    struct dhcpd4_stats stats;
+    uint32_t server_id = htonl(TEST_SERVER), other_server = htonl(TEST_SERVER + 1), address;
+
+    dhcpd4_log_level = LOG_LEVEL_NONE;
+
+    memset(pool, 0, sizeof(*pool));
+    dhcpd4_init_binding_list(&pool->bindings);
+    dhcpd4_init_option_list(&pool->options);
+    pool->server_id = server_id;
+    pool->netmask = htonl(0xffffff00);
+    pool->indexes.first = htonl(TEST_SERVER + 1);
+    pool->indexes.last = htonl(TEST_SERVER + 100);
+
+    CHECK(dhcpd4_init_pools(pool) == 0 && dhcpd4_init_shards() == 0, "pool not set up");
+
+    dhcpd4_get_stats(&stats, true);
+
+    CHECK(test_serve(DHCP_DISCOVER, 0, 0, 0) == DHCP_OFFER, "no offer");
+    address = test_reply.yiaddr;
+    CHECK(test_serve(DHCP_REQUEST, 0, server_id, address) == DHCP_ACK, "no ack");
+    CHECK(test_serve(DHCP_RELEASE, address, server_id, 0) == 0, "reply to a release");
+    CHECK(test_serve(DHCP_DECLINE, 0, server_id, address) == 0, "reply to a decline");
+    CHECK(test_serve(9, 0, 0, 0) == 0, "reply to an unknown type");
+
+    dhcpd4_get_stats(&stats, true);
+
+    CHECK(stats.counters[DHCPD4_STAT_RX_RELEASE] == 1, "%u releases", stats.counters[DHCPD4_STAT_RX_RELEASE]);
+    CHECK(stats.counters[DHCPD4_STAT_RX_DECLINE] == 1, "%u declines", stats.counters[DHCPD4_STAT_RX_DECLINE]);
+    CHECK(stats.counters[DHCPD4_STAT_RX_OTHER] == 1, "%u other", stats.counters[DHCPD4_STAT_RX_OTHER]);
+    CHECK(stats.counters[DHCPD4_STAT_DROP_IGNORED] == 0, "%u dropped",
+	  stats.counters[DHCPD4_STAT_DROP_IGNORED]);
+
+    // a REQUEST selecting another server has no reply due: dropped
+
+    CHECK(test_serve(DHCP_REQUEST, 0, other_server, address) == 0, "reply for another server");
+
+    dhcpd4_get_stats(&stats, true);
+
+    CHECK(stats.counters[DHCPD4_STAT_DROP_IGNORED] == 1, "%u dropped",
+	  stats.counters[DHCPD4_STAT_DROP_IGNORED]);
+
+    dhcpd4_delete_pools();
+    dhcpd4_delete_option_list(&pool->options);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,46 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Checks of the host tests of the engine: a failed check is reported,
+ * and the test exits with the number of failed checks.
+ */
+
+static int dhcpd4_test_failures;
+
+#define CHECK(cond, fmt, ...)						\
+    do {								\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: %s: " fmt "\n", __FILE__, __LINE__, #cond, ##__VA_ARGS__); \
+	    dhcpd4_test_failures++;					\
+	}								\
+    } while (0)
+
+#define TEST_RESULT() (dhcpd4_test_failures != 0)
+
+/*
+ * Timing of the benchmarks: monotonic time (ns), and comparison
+ * of two times for qsort(), to take the median of several runs.
+ */
+
+static inline uint64_t test_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline int test_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+#endif
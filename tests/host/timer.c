@@ -0,0 +1,167 @@
+#include "platform.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "test.h"
+
+/*
+ * Expiry of the leases when the bindings timer is run when
+ * dhcpd4_bindings_timer_timeout() says so, as by the server waiting
+ * in poll(), and at any time in between, as at the expiry of another
+ * binding or at a request: a lease must expire at its end, not when
+ * the timeout of the wheel saturates.
+ */
+
+#define TEST_WAKEUPS_MAX 10000
+#define TEST_CLIENTS     64
+
+/*
+ * Lease an address at start (seconds) for lease seconds, run the timer
+ * at run_at (seconds, if not 0), then at each timeout of the simulated
+ * clock until the lease expires.
+ */
+
+static void test_expiry(uint32_t start, uint32_t lease, uint32_t run_at)
+{
+    pool_indexes indexes;
+    binding_list list;
+    address_binding *binding;
+    uint8_t cident[6] = { 0x02, 0, 0, 0, 0, 1 };
+    uint32_t expiry;
+    int wakeups = 0;
+
+    dhcpd4_host_clock_ms = (int64_t)start * MSEC_PER_SEC;
+
+    memset(&indexes, 0, sizeof(indexes));
+    indexes.first = htonl(0x0a000002);
+    indexes.last = htonl(0x0a00000a);
+    dhcpd4_init_binding_list(&list);
+    CHECK(dhcpd4_init_pool_indexes(&indexes, &list) == 0, "pool indexes");
+
+    binding = dhcpd4_new_dynamic_binding(&list, &indexes, 0, cident, sizeof(cident));
+    CHECK(binding != NULL, "no binding");
+    if (binding == NULL)
+	return;
+
+    dhcpd4_set_binding_status(&list, &indexes, binding, ASSOCIATED, lease);
+    expiry = binding->expiry;
+
+    if (run_at != 0) {
+	dhcpd4_host_clock_ms = (int64_t)run_at * MSEC_PER_SEC;
+	dhcpd4_run_bindings_timer(&list, &indexes);
+    }
+
+    while (binding->status == ASSOCIATED && wakeups++ < TEST_WAKEUPS_MAX) {
+	int timeout = dhcpd4_bindings_timer_timeout(&list);
+
+	CHECK(timeout >= 0, "start %u, lease %u, run at %u: no timeout with a lease scheduled", start, lease, run_at);
+	if (timeout < 0)
+	    break;
+
+	dhcpd4_host_clock_ms += timeout;
+	dhcpd4_run_bindings_timer(&list, &indexes);
+    }
+
+    CHECK(binding->status == EXPIRED, "start %u, lease %u, run at %u: not expired after %d wakeups",
+	  start, lease, run_at, wakeups);
+    CHECK(dhcpd4_bindings_time() == expiry, "start %u, lease %u, run at %u: expired at %u s instead of %u s",
+	  start, lease, run_at, dhcpd4_bindings_time(), expiry);
+
+    dhcpd4_delete_binding_list(&list);
+    dhcpd4_delete_pool_indexes(&indexes);
+}
+
+/*
+ * Lease addresses to clients for random times, then run the timer at
+ * random times before each timeout of the simulated clock, as the
+ * requests would: each lease must expire at its end.
+ */
+
+static void test_random_runs(uint32_t seed)
+{
+    pool_indexes indexes;
+    binding_list list;
+    address_binding *bindings[TEST_CLIENTS];
+    uint32_t expiries[TEST_CLIENTS];
+    uint8_t cident[6] = { 0x02, 0, 0, 0, 0, 0 };
+    uint32_t rng = seed;
+    int left = TEST_CLIENTS, wakeups = 0;
+    int i;
+
+    dhcpd4_host_clock_ms = 100 * MSEC_PER_SEC + seed % MSEC_PER_SEC;
+
+    memset(&indexes, 0, sizeof(indexes));
+    indexes.first = htonl(0x0a000002);
+    indexes.last = htonl(0x0a0000fe);
+    dhcpd4_init_binding_list(&list);
+    CHECK(dhcpd4_init_pool_indexes(&indexes, &list) == 0, "pool indexes");
+
+    for (i = 0; i < TEST_CLIENTS; i++) {
+	cident[5] = (uint8_t)i;
+	bindings[i] = dhcpd4_new_dynamic_binding(&list, &indexes, 0, cident, sizeof(cident));
+	CHECK(bindings[i] != NULL, "seed %u: no binding", seed);
+	if (bindings[i] == NULL)
+	    return;
+
+	rng = rng * 1103515245 + 12345;
+	dhcpd4_set_binding_status(&list, &indexes, bindings[i], ASSOCIATED, (rng >> 8) % 20000 + 1);
+	expiries[i] = bindings[i]->expiry;
+    }
+
+    while (left > 0 && wakeups++ < TEST_WAKEUPS_MAX) {
+	int timeout = dhcpd4_bindings_timer_timeout(&list);
+
+	CHECK(timeout >= 0, "seed %u: no timeout with %d leases scheduled", seed, left);
+	if (timeout < 0)
+	    break;
+
+	// half of the runs at a request before the timeout
+
+	rng = rng * 1103515245 + 12345;
+	dhcpd4_host_clock_ms += (rng & 0x100) ? (int64_t)(rng >> 9) % (timeout + 1) : timeout;
+	dhcpd4_run_bindings_timer(&list, &indexes);
+
+	for (i = 0; i < TEST_CLIENTS; i++) {
+	    if (bindings[i] == NULL || bindings[i]->status == ASSOCIATED)
+		continue;
+
+	    CHECK(dhcpd4_bindings_time() == expiries[i], "seed %u: lease %d expired at %u s instead of %u s",
+		  seed, i, dhcpd4_bindings_time(), expiries[i]);
+	    bindings[i] = NULL;
+	    left--;
+	}
+    }
+
+    CHECK(left == 0, "seed %u: %d leases not expired after %d wakeups", seed, left, wakeups);
+
+    dhcpd4_delete_binding_list(&list);
+    dhcpd4_delete_pool_indexes(&indexes);
+}
+
+int main(void)
+{
+    uint32_t lease, seed;
+
+    // expiries put in the current slot of an upper level, due 64 slots on
+
+    test_expiry(100, 4070, 0);
+    test_expiry(5000, 262000, 0);
+
+    // timer run before the expiry, base left on the start of a slot of an upper level
+
+    test_expiry(100, 70, 127);      // 64 s boundary
+    test_expiry(100, 8000, 4095);   // 4096 s boundary
+    test_expiry(100, 300000, 262143); // 262144 s boundary
+
+    // expiries of each level of the wheel, and beyond its span
+
+    for (lease = 1; lease < (1u << 25); lease = lease * 3 + 1) {
+	test_expiry(100, lease, 0);
+	test_expiry(100, lease, 100 + lease / 2);
+    }
+
+    for (seed = 1; seed <= 32; seed++)
+	test_random_runs(seed);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,221 @@
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <zephyr/storage/flash_map.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "bindings.h"
+#include "journal.h"
+
+/*
+ * Test of the lease journal on native_sim, in the storage partition of
+ * the flash simulator: group commit of the buffered records, replay
+ * after a restart, and rotation of the sectors when the journal is full.
+ */
+
+#define TEST_BINDINGS 10
+#define TEST_LEASE    3600
+#define TEST_ROUND    100 // bindings written by each compaction of the wraparound test
+
+static pool_indexes test_indexes;
+static binding_list test_list;
+static address_binding *test_bindings[TEST_ROUND];
+
+/*
+ * Records replayed from the journal.
+ */
+
+struct test_replay {
+    uint32_t count;      // records replayed
+    uint32_t first;      // sequence number of the first one
+    uint32_t last;       // sequence number of the last one
+    bool contiguous;     // each record follows the previous one
+    dhcpd4_lease_record records[TEST_BINDINGS * 2];
+};
+
+static struct test_replay test_replay;
+
+static void test_replay_record(const dhcpd4_lease_record *record, void *arg)
+{
+    struct test_replay *replay = arg;
+
+    if (replay->count == 0)
+	replay->first = record->seq;
+    else if (record->seq != replay->last + 1)
+	replay->contiguous = false;
+
+    if (replay->count < ARRAY_SIZE(replay->records))
+	replay->records[replay->count] = *record;
+
+    replay->last = record->seq;
+    replay->count++;
+}
+
+static struct test_replay *test_replay_journal(void)
+{
+    memset(&test_replay, 0, sizeof(test_replay));
+    test_replay.contiguous = true;
+
+    zassert_ok(dhcpd4_journal_replay(test_replay_record, &test_replay), "journal not replayed");
+
+    return &test_replay;
+}
+
+/*
+ * Bind count clients of the scratch pool 10.0.0.0/24.
+ */
+
+static void test_bind(int count)
+{
+    uint8_t cident[6] = { 0x02, 0, 0, 0, 0, 0 };
+    int i;
+
+    for (i = 0; i < count; i++) {
+	cident[5] = (uint8_t)i;
+	test_bindings[i] = dhcpd4_new_dynamic_binding(&test_list, &test_indexes, 0, cident, sizeof(cident));
+	zassert_not_null(test_bindings[i], "client %d not bound", i);
+	dhcpd4_set_binding_status(&test_list, &test_indexes, test_bindings[i], ASSOCIATED, TEST_LEASE);
+    }
+}
+
+/*
+ * Each test starts with an empty journal, mounted again as after a reboot.
+ */
+
+static void test_before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+
+    dhcpd4_journal_unmount();
+    zassert_ok(dhcpd4_journal_init(), "journal not mounted");
+    zassert_ok(dhcpd4_journal_clear(), "journal not cleared");
+
+    memset(&test_indexes, 0, sizeof(test_indexes));
+    test_indexes.first = htonl(0x0a000002);
+    test_indexes.last = htonl(0x0a0000fe);
+    dhcpd4_init_binding_list(&test_list);
+    zassert_ok(dhcpd4_init_pool_indexes(&test_indexes, &test_list), "pool indexes");
+}
+
+static void test_after(void *fixture)
+{
+    ARG_UNUSED(fixture);
+
+    dhcpd4_journal_stop();
+    dhcpd4_delete_binding_list(&test_list);
+    dhcpd4_delete_pool_indexes(&test_indexes);
+}
+
+/*
+ * The records are written together, once the commit interval is over.
+ */
+
+ZTEST(dhcpd_journal, test_group_commit)
+{
+    struct test_replay *replay;
+    int i;
+
+    dhcpd4_journal_start();
+    test_bind(TEST_BINDINGS);
+
+    replay = test_replay_journal();
+    zassert_equal(replay->count, 0, "%u records written before the commit", replay->count);
+
+    k_msleep(2 * CONFIG_DHCPD_JOURNAL_COMMIT_MS);
+
+    replay = test_replay_journal();
+    zassert_equal(replay->count, TEST_BINDINGS, "%u records written", replay->count);
+    zassert_true(replay->contiguous, "records out of order");
+    zassert_equal(replay->first, 0, "first record %u", replay->first);
+
+    for (i = 0; i < TEST_BINDINGS; i++) {
+	zassert_equal(replay->records[i].status, ASSOCIATED, "record %d: status %u", i, replay->records[i].status);
+	zassert_equal(replay->records[i].address, test_bindings[i]->address, "record %d: address", i);
+	zassert_equal(replay->records[i].lease, TEST_LEASE, "record %d: lease %u", i, replay->records[i].lease);
+	zassert_equal(replay->records[i].cident_len, 6, "record %d: client identifier", i);
+	zassert_mem_equal(replay->records[i].cident, dhcpd4_binding_cident(test_bindings[i]), 6,
+			  "record %d: client identifier", i);
+    }
+}
+
+/*
+ * The records buffered are written when recording stops, and
+ * replayed in order once the journal is mounted again.
+ */
+
+ZTEST(dhcpd_journal, test_replay_after_restart)
+{
+    struct test_replay *replay;
+    int i;
+
+    dhcpd4_journal_start();
+    test_bind(TEST_BINDINGS);
+
+    for (i = 0; i < TEST_BINDINGS / 2; i++)
+	dhcpd4_set_binding_status(&test_list, &test_indexes, test_bindings[i], RELEASED, 0);
+
+    dhcpd4_journal_stop();
+
+    dhcpd4_journal_unmount();
+    zassert_equal(dhcpd4_journal_get_seq(), 0, "sequence number not forgotten");
+    zassert_ok(dhcpd4_journal_init(), "journal not mounted again");
+
+    replay = test_replay_journal();
+    zassert_equal(replay->count, TEST_BINDINGS + TEST_BINDINGS / 2, "%u records replayed", replay->count);
+    zassert_true(replay->contiguous, "records out of order");
+    zassert_equal(replay->first, 0, "first record %u", replay->first);
+
+    for (i = 0; i < TEST_BINDINGS; i++)
+	zassert_equal(replay->records[i].status, ASSOCIATED, "record %d: status %u", i, replay->records[i].status);
+
+    for (i = 0; i < TEST_BINDINGS / 2; i++) {
+	const dhcpd4_lease_record *record = &replay->records[TEST_BINDINGS + i];
+
+	zassert_equal(record->status, RELEASED, "release %d: status %u", i, record->status);
+	zassert_equal(record->address, test_bindings[i]->address, "release %d: address", i);
+	zassert_equal(record->lease, 0, "release %d: lease %u", i, record->lease);
+    }
+}
+
+/*
+ * Written beyond the size of the partition, the journal drops its
+ * oldest sectors: the newest records are all replayed, in order.
+ */
+
+ZTEST(dhcpd_journal, test_wraparound)
+{
+    const struct flash_area *fa;
+    struct test_replay *replay;
+    uint32_t rounds, total, i;
+
+    zassert_ok(flash_area_open(FIXED_PARTITION_ID(storage_partition), &fa), "no storage partition");
+    rounds = fa->fa_size / (DHCPD4_LEASE_HEADER_SIZE * TEST_ROUND) * 2 + 1; // twice the partition at least
+    total = rounds * TEST_ROUND;
+    flash_area_close(fa);
+
+    test_bind(TEST_ROUND); // journal not started: nothing buffered
+
+    for (i = 0; i < rounds; i++)
+	zassert_ok(dhcpd4_journal_append_list(&test_list), "round %u not written", i);
+
+    zassert_equal(dhcpd4_journal_get_seq(), total, "sequence number %u", dhcpd4_journal_get_seq());
+
+    replay = test_replay_journal();
+    zassert_true(replay->count > TEST_ROUND, "%u records replayed", replay->count);
+    zassert_true(replay->count < total, "no record dropped out of %u", total);
+    zassert_true(replay->contiguous, "records out of order");
+    zassert_equal(replay->last, total - 1, "last record %u", replay->last);
+    zassert_equal(replay->first, total - replay->count, "first record %u", replay->first);
+
+    // the journal still takes records after its rotation, once mounted again
+
+    dhcpd4_journal_unmount();
+    zassert_ok(dhcpd4_journal_init(), "journal not mounted again");
+    dhcpd4_journal_set_seq(total);
+    zassert_ok(dhcpd4_journal_append_list(&test_list), "round not written after the restart");
+
+    replay = test_replay_journal();
+    zassert_true(replay->contiguous, "records out of order after the restart");
+    zassert_equal(replay->last, total + TEST_ROUND - 1, "last record %u after the restart", replay->last);
+}
+
+ZTEST_SUITE(dhcpd_journal, NULL, NULL, test_before, test_after, NULL);